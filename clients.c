@@ -18,13 +18,21 @@
 #include <string.h>
 #include <sys/epoll.h>
 #include <sys/prctl.h>
+#include <signal.h>
+#include <stddef.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <zookeeper.h>
 
 #include "clients.h"
+#include "heap.h"
+#include "histogram.h"
 #include "queue.h"
+#include "stats.h"
+#include "uring.h"
 #include "util.h"
+#include "wheel.h"
 
 
 #ifndef EPOLLRDHUP
@@ -35,16 +43,135 @@
 #define DEFAULT_USERNAME_PREFIX       "zk-client"
 #define DEFAULT_PATH        "/"
 
+/* how soon to check again when zookeeper_interest() fails */
+#define INTERESTS_RETRY_MS            10
+
+/* upper bound on how long a client goes without an interests check */
+#define INTERESTS_MAX_WAIT_MS         1000
+
+#define ENGINE_THREADED     0  /* poller -> queue -> workers */
+#define ENGINE_REACTOR      1  /* N threads, each owning a shard of clients */
+
+/* how long an idle worker waits on its own queue before trying to steal */
+#define WORKER_IDLE_MS      5
+
+/* only steal from queues at least this deep, leave the rest to the owner */
+#define WORKER_STEAL_MIN    2
+
+/*
+ * With --min-workers < --max-workers, the # of active workers is revisited
+ * every WORKER_RESIZE_MS. It grows by one if the queues are backed up or
+ * connections waited too long in them, and shrinks by one after
+ * WORKER_SHRINK_ROUNDS quiet rounds in a row.
+ */
+#define WORKER_RESIZE_MS       500
+#define WORKER_GROW_WAIT_US    1000
+#define WORKER_SHRINK_WAIT_US  100
+#define WORKER_SHRINK_ROUNDS   4
+
+#define EPOLL_MODE_LEVEL    0  /* level-triggered, the poller dedups via queued */
+#define EPOLL_MODE_ONESHOT  1  /* EPOLLONESHOT, re-armed after processing */
+#define EPOLL_MODE_EDGE     2  /* EPOLLET, re-armed after processing */
+
+/* the counters each child publishes to the shared stats, see publish_stats() */
+#define PUB_CONNECTED       0  /* sessions connected right now */
+#define PUB_SESSIONS        1  /* sessions established, in total */
+#define PUB_EXPIRATIONS     2
+#define PUB_CONNECT_RETRIES 3
+#define PUB_EVENTS          4
+#define PUB_QUEUE_DEPTH     5
+#define PUB_OP_ERRORS       6  /* followed by one per op */
+
+/* the results file is appended to through a buffer this big */
+#define RESULTS_BUFFER_SIZE (1 << 16)
+
+#define POLL_BACKEND_EPOLL  0
+#define POLL_BACKEND_URING  1  /* multishot IORING_OP_POLL_ADD */
+
+/* io_uring user_data is the connection, tagged for non-poll requests */
+#define URING_TAG_UPDATE    1
+#define URING_TAG_REMOVE    2
+#define URING_TAGS          3
+
+/* issuers (see --rate) check their wheel once per tick */
+#define ISSUER_TICK_US      1000
+#define ISSUER_WHEEL_SLOTS  1024
+
+/* getopt_long() vals for clients_add_options()' options */
+#define EXTRA_OPTION_BASE   256
+
+
+typedef struct interests_sched interests_sched;
+typedef struct poll_set poll_set;
 
 typedef struct {
   int events;
   int queued;
+  int in_flight;   /* oneshot: claimed by the poller, see claim() */
+  int home;        /* its queue is home % (active workers) */
+  uint64_t ready_at; /* when epoll_wait() reported it */
   pthread_mutex_t lock;
   zhandle_t *zh;
+  poll_set *ps;    /* the poll set this client is registered with */
+  int reg_fd;      /* what's currently registered with ps, -1 if nothing */
+  uint32_t reg_events;
+  int reg_state;   /* zoo_state() when it was registered */
+  interests_sched *sched; /* who checks this client's interests */
+  int dirty;       /* already in sched->dirty */
+  int timer_pos;   /* position in sched->timers, -1 if not there */
   const char *server;
   int session_timeout;
+  uint64_t connect_started; /* 0 once connected */
+  int connected;   /* as of the last session event */
+  wheel_timer issue_timer; /* its next op, in its issuer's wheel */
 } connection;
 
+/* what poll_backend->wait() reports */
+typedef struct {
+  connection *conn;
+  uint32_t events;  /* EPOLLIN, EPOLLOUT, etc. (same bits as POLLIN, ...) */
+  int gone;         /* the registration is gone, it needs to be added again */
+} poll_event;
+
+/* a set of polled fds, waited on by a single thread */
+struct poll_set {
+  int epfd;
+  uring_t ring;
+  void *scratch;    /* epoll_events or cqes, for wait() */
+  int max_events;
+};
+
+/*
+ * The poll backend: epoll, or io_uring with multishot polls. With the
+ * latter, poll (re)arms are only queued by ctl() and submitted all at once
+ * on flush() (or wait()), so a sweep costs a single io_uring_enter().
+ */
+typedef struct {
+  const char *name;
+  void (*init)(poll_set *ps, int size);
+  /* op is EPOLL_CTL_*, returns 0 or an errno */
+  int (*ctl)(poll_set *ps, int op, connection *conn, int fd, uint32_t events);
+  /* drops conn's registration, its fd was closed */
+  void (*forget)(poll_set *ps, connection *conn);
+  void (*flush)(poll_set *ps);
+  /* returns how many events were stored, 0 on timeout or EINTR */
+  int (*wait)(poll_set *ps, poll_event *evlist, int timeout_ms);
+} poll_backend;
+
+/*
+ * Instead of sweeping every client, interests are checked when a client
+ * was just processed (or created), or when zookeeper_interest() said it'd
+ * need us again (i.e.: for the next ping).
+ */
+struct interests_sched {
+  poll_set *ps;    /* where its clients are registered */
+  heap_t timers;   /* connections keyed by their next check (nsecs) */
+  queue_t dirty;   /* connections that need a check right away */
+  connection **batch;
+  int batch_size;
+  int locked;      /* take the connection's lock around zookeeper_interest() */
+};
+
 typedef struct {
   char *username_prefix;
   char *path;
@@ -52,7 +179,21 @@ typedef struct {
   int max_events;   /* max events for epoll_wait */
   int num_clients;  /* clients per child process */
   int num_procs;   /* # of procs which'll spawn ZK clients */
+  int engine;       /* ENGINE_THREADED or ENGINE_REACTOR */
+  int poll_backend; /* POLL_BACKEND_* */
+  int epoll_mode;   /* EPOLL_MODE_* */
   int num_workers;  /* # of threads to call zookeeper_process from */
+  int min_workers;  /* bounds for num_workers, if it's adaptive */
+  int max_workers;
+  int worker_batch; /* max # of connections a worker takes per wakeup */
+  int queue_size;   /* work queue size, defaults to num_clients */
+  int queue_timeout; /* ms the poller waits for room in a full queue */
+  int stats_interval; /* secs between stats reports */
+  int write_interval; /* ms between the writer's changes, 0 for no writer */
+  int rate;         /* ops/sec issued across all procs, 0 for none */
+  int num_issuers;  /* threads issuing them, per child */
+  int duration;     /* secs to run for, 0 for ever */
+  const char *results_file; /* where to append JSON lines to, if at all */
   int wait_time;   /* wait time for epoll_wait */
   int zk_session_timeout;
   int switch_uid;
@@ -63,8 +204,142 @@ typedef struct {
   void (*reset_watcher_data)(void *);
 } run_params;
 
-static int g_epfd;
+typedef struct worker_pool worker_pool;
+
+/*
+ * Each worker has its own queue, fed with the connections homed there, so
+ * a connection is usually processed by the same thread (and its buffers
+ * stay in the same cache). Idle workers steal from the others' queues.
+ */
+typedef struct {
+  int id;
+  queue_t queue;
+  worker_pool *pool;
+} worker;
+
+/* workers with an id >= active are parked, once their queue is empty */
+struct worker_pool {
+  worker *workers;
+  int count;         /* threads, i.e.: --max-workers */
+  int active;
+  pthread_mutex_t lock;
+  pthread_cond_t unparked;
+  run_params *params;
+};
+
+/* a reactor thread does interests, epoll_wait & processing for its shard */
+typedef struct {
+  poll_set *ps;
+  int first;  /* the shard is g_zhs[first, last) */
+  int last;
+  interests_sched sched;
+  run_params *params;
+} reactor;
+
+typedef struct {
+  long events;             /* events handed to zookeeper_process(), in total */
+  long event_latency_sum;  /* nsecs from epoll_wait() to zookeeper_process() */
+  long event_latency_max;
+  long interest_checks;    /* calls to zookeeper_interest() */
+  long epoll_ctls;         /* epoll_ctl()s (or poll sqes) issued for interests */
+  long epoll_ctls_saved;   /* ... and skipped, because nothing changed */
+  long ring_submits;       /* io_uring_enter() calls to submit them */
+  long poller_wakeups;     /* epoll_wait() returns in the poller */
+  long poller_events;      /* ... and the events they reported */
+  long poller_cpu;         /* nsecs of CPU used by the poller, in total */
+  long steals;             /* connections processed away from their home */
+  long queue_wait_sum;     /* event_latency_sum, for resizing the workers */
+  long queue_wait_count;
+  long sessions;           /* sessions that got to connected, in total */
+  long connected;          /* ... and are connected right now */
+  long expirations;        /* sessions that expired, in total */
+  long connect_retries;    /* zookeeper_init()s retried on ZCONNECTIONLOSS */
+  long issued;             /* ops issued on schedule (see --rate) */
+  long issue_skipped;      /* ... and skipped, the session couldn't take them */
+} child_stats;
+
+static poll_set *g_ps;
+static int g_epoll_mode;
+static const poll_backend *g_backend;
 static connection *g_zhs; /* state & meta-state for all zk clients */
+static child_stats g_stats;
+
+/* each thread recording latencies gets one, see clients_record_latency() */
+typedef struct thread_histograms {
+  histogram_t hists[CLIENTS_MAX_OPS];
+  struct thread_histograms *next;
+} thread_histograms;
+
+static const char *g_op_names[CLIENTS_MAX_OPS];
+static int g_num_ops;
+static thread_histograms *g_thread_hists; /* all of them */
+static __thread thread_histograms *t_hists;
+static int g_connect_op;
+static int g_write_op;
+static int g_corrected_ops[CLIENTS_MAX_OPS]; /* 0 if none (op 0 is never one) */
+
+/*
+ * What clients_op_start() returns for an op issued on schedule (tagged
+ * with the low bit, unscheduled ops get an even timestamp instead).
+ */
+typedef struct {
+  uint64_t intended;  /* when it was due */
+  uint64_t actual;    /* when it was sent */
+} scheduled_start;
+
+/* set while an issuer calls g_issue */
+static __thread uint64_t t_intended;
+static __thread scheduled_start *t_scheduled;
+
+static stats_t g_shared; /* a region per child, created before fork() */
+static long g_op_errors[CLIENTS_MAX_OPS];
+static volatile sig_atomic_t g_stop;
+
+static int (*g_issue)(zhandle_t *, session_context *);
+static const clients_option *g_options;
+static int g_num_options;
+
+/* what the children published, as of the last read_summary() */
+typedef struct {
+  int num_counters;       /* PUB_OP_ERRORS + an error counter per op */
+  uint64_t *totals;       /* summed up */
+  uint64_t *last_totals;  /* ... as of the previous read */
+  histogram_t *hists;     /* per op, merged */
+  histogram_t *last_hists; /* ... as of the previous read */
+  histogram_t *interval_hists; /* hists - last_hists */
+  uint64_t *last_counts;  /* per op, as of the previous read */
+  uint64_t *counters;     /* scratch, for reading each child's */
+  histogram_t *child_hists; /* ... same */
+  uint64_t **child_totals; /* per child, as of its last good read */
+  histogram_t **child_last; /* per child & op, same */
+  uint64_t read_at;
+  uint64_t last_read_at;
+} run_summary;
+
+/*
+ * Child 0 can run a writer, which replaces the CLIENTS_FANOUT_PREFIX child
+ * under the watched path every --write-interval ms (a delete & a create,
+ * in one multi) so watchers get a single notification per change.
+ */
+typedef struct {
+  char path[256];      /* the child created last, "" if none */
+  char next[256];      /* the one being created */
+  char created[256];   /* ... as the server returns it */
+  zoo_op_t ops[2];
+  zoo_op_result_t results[2];
+  int pending;         /* a multi is in flight */
+} fanout_writer;
+
+/*
+ * An issuer owns the connections j with j % --issuers == id, each of them
+ * with a timer in its wheel for when the next op is due. Timers are moved
+ * forward by a fixed interval from when they were due (not from when they
+ * fired) so a slow server doesn't slow the load down: that's open-loop.
+ */
+typedef struct {
+  int id;
+  run_params *params;
+} issuer;
 
 static void help(void);
 static void parse_argv(int argc, const char **argv, run_params *params);
@@ -75,8 +350,29 @@ static void *create_clients(void *data);
 static void *poll_clients(void *data);
 static void *check_interests(void *data);
 static void *zk_process_worker(void *data);
-static void do_check_interests(connection *zkc);
+static void *run_reactor(void *data);
+static void interests_sched_init(interests_sched *sched, poll_set *ps, int size, int batch_size, int locked);
+static int run_interests(interests_sched *sched, int wait_ms);
+static void mark_dirty(connection *zkc);
+static void rearm(connection *zkc);
+static const poll_backend *get_poll_backend(int which);
+static poll_set *poll_set_new(int size, int max_events);
+static void forget_registration(connection *zkc);
+static void update_interest(connection *zkc, int rc, int fd, int interest, int state);
 static void create_client(connection *conn, void *context);
+static worker_pool *start_threaded_engine(run_params *params);
+static void start_reactor_engine(run_params *params);
+static void record_event(uint64_t ready_at);
+static void report_stats(worker_pool *pool);
+static void report_latencies(void);
+static void publish_stats(worker_pool *pool, int child_num);
+static void run_parent(run_params *params, pid_t *pids);
+static void record_latency(int op, uint64_t start);
+static void *write_fanout(void *data);
+static void *resize_workers(void *data);
+static void *issue_ops(void *data);
+static void start_issuers(run_params *params);
+static void register_corrected_ops(void);
 
 
 void clients_run(int argc,
@@ -87,10 +383,19 @@ void clients_run(int argc,
 {
   int i = 0;
   pid_t pid;
+  pid_t *pids;
   run_params params;
 
   init_params(&params);
   parse_argv(argc, argv, &params);
+  if (params.rate)
+    register_corrected_ops();
+  g_connect_op = clients_register_op("connect");
+  if (params.write_interval)
+    g_write_op = clients_register_op("fanout_write");
+
+  g_shared = stats_new(params.num_procs, PUB_OP_ERRORS + g_num_ops, g_num_ops);
+  pids = (pid_t *)safe_alloc(sizeof(pid_t) * params.num_procs);
   params.watcher = my_watcher;
   params.new_watcher_data = new_watcher_data;
   params.reset_watcher_data = reset_watcher_data;
@@ -105,15 +410,15 @@ void clients_run(int argc,
       error(EXIT_SYSTEM_CALL, "Ugh, couldn't fork");
 
     if (!pid) {
+      /* a Ctrl-C goes to all of us, but it's the parent who stops them */
+      signal(SIGINT, SIG_IGN);
       start_child_proc(i, &params);
     }
-  }
 
-  if (pid) { /* parent */
-    /* TODO: wait() on children */
-    while (1)
-      sleep(100);
+    pids[i] = pid;
   }
+
+  run_parent(&params, pids);
 }
 
 /* set defaults */
@@ -125,7 +430,21 @@ static void init_params(run_params *params)
   params->max_events = 100;
   params->num_clients = 500;
   params->num_procs = 20;
+  params->engine = ENGINE_THREADED;
+  params->epoll_mode = EPOLL_MODE_LEVEL;
+  params->poll_backend = POLL_BACKEND_EPOLL;
   params->num_workers = 1;
+  params->min_workers = 0;
+  params->max_workers = 0;
+  params->worker_batch = 16;
+  params->queue_size = 0;
+  params->queue_timeout = 10;
+  params->stats_interval = 10;
+  params->write_interval = 0;
+  params->rate = 0;
+  params->num_issuers = 1;
+  params->duration = 0;
+  params->results_file = NULL;
   params->wait_time = 50;
   params->zk_session_timeout = 10000;
   params->switch_uid = 0;
@@ -136,160 +455,1453 @@ static void init_params(run_params *params)
 static void start_child_proc(int child_num, run_params *params)
 {
   char tname[20];
-  int saved, j;
-  int num_workers = params->num_workers;
+  int j, secs;
   int num_clients = params->num_clients;
-  pthread_t tid_interests, tid_poller, tid_create_clients;
-  pthread_t *tids_workers;
-  queue_t queue;
+  pthread_t tid_create_clients;
+  worker_pool *pool = NULL;
+
+  snprintf(tname, 20, "child[%d]", child_num);
+  prctl(PR_SET_NAME, tname, 0, 0, 0);
+
+  /* so watchers & completions don't wait on stdout */
+  log_async_start();
+
+  if (params->switch_uid) {
+    char username[64];
+    sprintf(username, "%s%d", params->username_prefix, child_num);
+    change_uid(username);
+  }
+
+  g_zhs = (connection *)safe_alloc(sizeof(connection) * num_clients);
+  g_epoll_mode = params->epoll_mode;
+  g_backend = get_poll_backend(params->poll_backend);
+
+  g_ps = poll_set_new(num_clients, params->max_events);
+
+  /* prepare locks */
+  for (j=0; j < num_clients; j++) {
+    if (pthread_mutex_init(&g_zhs[j].lock, 0)) {
+      error(EXIT_SYSTEM_CALL, "Failed to init mutex");
+    }
+    g_zhs[j].ps = g_ps;
+    g_zhs[j].timer_pos = -1;
+    g_zhs[j].reg_fd = -1;
+  }
+
+  /* start threads */
+  if (params->engine == ENGINE_REACTOR)
+    start_reactor_engine(params);
+  else
+    pool = start_threaded_engine(params);
+
+  pthread_create(&tid_create_clients, NULL, &create_clients, params);
+  set_thread_name(tid_create_clients, "creator");
+
+  if (child_num == 0 && params->write_interval) {
+    pthread_create(&tid_create_clients, NULL, &write_fanout, params);
+    set_thread_name(tid_create_clients, "writer");
+  }
+
+  if (params->rate)
+    start_issuers(params);
+
+  /* TODO: monitor each thread's health */
+  for (secs=1; ; secs++) {
+    sleep(1);
+    publish_stats(pool, child_num);
+
+    if (secs % params->stats_interval == 0) {
+      report_stats(pool);
+      report_latencies();
+    }
+  }
+}
+
+static void start_issuers(run_params *params)
+{
+  char tname[20];
+  pthread_t tid;
+  issuer *iss;
+  int j;
+
+  for (j=0; j < params->num_issuers; j++) {
+    iss = (issuer *)safe_alloc(sizeof(issuer));
+    iss->id = j;
+    iss->params = params;
+
+    pthread_create(&tid, NULL, &issue_ops, iss);
+    snprintf(tname, 20, "issuer[%d]", j);
+    set_thread_name(tid, tname);
+  }
+}
+
+/* returns the worker pool */
+static worker_pool *start_threaded_engine(run_params *params)
+{
+  int j, queue_size;
+  int num_workers = params->max_workers;
+  int num_clients = params->num_clients;
+  pthread_t tid_interests, tid_poller, tid;
+  worker_pool *pool;
+  interests_sched *sched;
+
+  sched = (interests_sched *)safe_alloc(sizeof(interests_sched));
+  interests_sched_init(sched, g_ps, num_clients, params->max_events, 1);
+  for (j=0; j < num_clients; j++) {
+    g_zhs[j].sched = sched;
+    g_zhs[j].home = j;
+  }
+
+  pool = (worker_pool *)safe_alloc(sizeof(worker_pool));
+  pool->workers = (worker *)safe_alloc(sizeof(worker) * num_workers);
+  pool->count = num_workers;
+  pool->active = params->num_workers;
+  pool->params = params;
+
+  if (pthread_mutex_init(&pool->lock, 0) ||
+      pthread_cond_init(&pool->unparked, 0))
+    error(EXIT_SYSTEM_CALL, "Failed to init the worker pool");
+
+  /* the work queue is split evenly among the fewest workers we'd run */
+  queue_size = params->queue_size ? params->queue_size : num_clients;
+  queue_size = (queue_size + params->min_workers - 1) / params->min_workers;
+
+  for (j=0; j < num_workers; j++) {
+    pool->workers[j].id = j;
+    pool->workers[j].pool = pool;
+    pool->workers[j].queue = queue_new(queue_size);
+
+    /* when the workers fall behind, make the poller wait a bit */
+    queue_set_add_timeout(pool->workers[j].queue, params->queue_timeout);
+  }
+
+  pthread_create(&tid_interests, NULL, &check_interests, sched);
+  set_thread_name(tid_interests, "interests");
+
+  pthread_create(&tid_poller, NULL, &poll_clients, pool);
+  set_thread_name(tid_poller, "poller");
+
+  for (j=0; j < num_workers; j++) {
+    char thread_name[128];
+
+    snprintf(thread_name, 128, "work[%d]", j);
+    pthread_create(&tid, NULL, &zk_process_worker, &pool->workers[j]);
+    set_thread_name(tid, thread_name);
+  }
+
+  if (params->min_workers < params->max_workers) {
+    pthread_create(&tid, NULL, &resize_workers, pool);
+    set_thread_name(tid, "resizer");
+  }
+
+  return pool;
+}
+
+/*
+ * Each reactor gets its own poll set and a contiguous shard of g_zhs,
+ * which nobody else touches once a client is created.
+ */
+static void start_reactor_engine(run_params *params)
+{
+  int j, k;
+  int num_reactors = params->num_workers;
+  int num_clients = params->num_clients;
+  pthread_t tid;
+  reactor *reactors;
+
+  reactors = (reactor *)safe_alloc(sizeof(reactor) * num_reactors);
+
+  for (j=0; j < num_reactors; j++) {
+    char thread_name[128];
+
+    reactors[j].params = params;
+    reactors[j].first = (int)((long)num_clients * j / num_reactors);
+    reactors[j].last = (int)((long)num_clients * (j + 1) / num_reactors);
+    reactors[j].ps = poll_set_new(reactors[j].last - reactors[j].first,
+                                  params->max_events);
+
+    interests_sched_init(&reactors[j].sched,
+                         reactors[j].ps,
+                         reactors[j].last - reactors[j].first,
+                         params->max_events,
+                         0);
+
+    for (k=reactors[j].first; k < reactors[j].last; k++) {
+      g_zhs[k].ps = reactors[j].ps;
+      g_zhs[k].sched = &reactors[j].sched;
+    }
+
+    snprintf(thread_name, 128, "reactor[%d]", j);
+    pthread_create(&tid, NULL, &run_reactor, &reactors[j]);
+    set_thread_name(tid, thread_name);
+  }
+}
+
+static void record_event(uint64_t ready_at)
+{
+  long latency = (long)(now_nsecs() - ready_at);
+  long max = __atomic_load_n(&g_stats.event_latency_max, __ATOMIC_RELAXED);
+
+  __atomic_add_fetch(&g_stats.events, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&g_stats.event_latency_sum, latency, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&g_stats.queue_wait_count, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&g_stats.queue_wait_sum, latency, __ATOMIC_RELAXED);
+
+  while (latency > max &&
+         !__atomic_compare_exchange_n(&g_stats.event_latency_max, &max, latency,
+                                      1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+/*
+ * Registers an op type to record latencies for, returns its id. It must
+ * be called before clients_run().
+ */
+int clients_register_op(const char *name)
+{
+  if (g_num_ops == CLIENTS_MAX_OPS)
+    error(EXIT_BAD_PARAMS, "Too many op types, can't add %s", name);
+
+  g_op_names[g_num_ops] = name;
+  return g_num_ops++;
+}
+
+/* the program's ops so far, they are the ones that get issued on schedule */
+static void register_corrected_ops(void)
+{
+  int j, num_ops = g_num_ops;
+  char *name;
+
+  for (j=0; j < num_ops; j++) {
+    name = (char *)safe_alloc(strlen(g_op_names[j]) + sizeof("_corrected"));
+    sprintf(name, "%s_corrected", g_op_names[j]);
+    g_corrected_ops[j] = clients_register_op(name);
+  }
+}
+
+/* meant to be passed as the data of an async op's completion */
+const void * clients_op_start(void)
+{
+  scheduled_start *sched;
+
+  if (!t_intended)
+    return (const void *)(uintptr_t)(now_nsecs() & ~1ULL);
+
+  /* the completion frees it, or issue_op() if there won't be one */
+  sched = (scheduled_start *)safe_alloc(sizeof(scheduled_start));
+  sched->intended = t_intended;
+  sched->actual = now_nsecs();
+  t_scheduled = sched;
+
+  return (const void *)((uintptr_t)sched | 1);
+}
+
+/*
+ * start is what clients_op_start() returned when the op was issued. If it
+ * was issued on schedule, the time it spent waiting to be sent (i.e.: the
+ * issuer fell behind) also goes to its _corrected histogram.
+ */
+void clients_record_latency(int op, const void *start)
+{
+  scheduled_start *sched;
+  uint64_t now;
+
+  if (!((uintptr_t)start & 1)) {
+    record_latency(op, (uint64_t)(uintptr_t)start);
+    return;
+  }
+
+  sched = (scheduled_start *)((uintptr_t)start & ~(uintptr_t)1);
+  now = now_nsecs();
+
+  clients_record_value(op, now - sched->actual);
+  if (g_corrected_ops[op])
+    clients_record_value(g_corrected_ops[op], now - sched->intended);
+
+  free(sched);
+}
+
+/*
+ * An op that was due but couldn't even be issued (i.e.: its session had
+ * expired). It's still waited on, as far as a user is concerned, so it
+ * goes to the _corrected histogram as a failure: from when it was due.
+ */
+void clients_record_missed(int op)
+{
+  clients_record_error(op);
+
+  if (t_intended && g_corrected_ops[op])
+    clients_record_value(g_corrected_ops[op], now_nsecs() - t_intended);
+}
+
+/* start is a now_nsecs() timestamp */
+static void record_latency(int op, uint64_t start)
+{
+  clients_record_value(op, now_nsecs() - start);
+}
+
+/* an op that completed with an error (its latency is still recorded) */
+void clients_record_error(int op)
+{
+  assert(op >= 0 && op < g_num_ops);
+  __atomic_add_fetch(&g_op_errors[op], 1, __ATOMIC_RELAXED);
+}
+
+/* for latencies that don't end now, i.e.: measured by the caller */
+void clients_record_value(int op, uint64_t nsecs)
+{
+  thread_histograms *th = t_hists;
+  int j;
+
+  assert(op >= 0 && op < g_num_ops);
+
+  if (!th) {
+    th = (thread_histograms *)safe_alloc(sizeof(thread_histograms));
+    for (j=0; j < g_num_ops; j++)
+      th->hists[j] = histogram_new();
+
+    /* so the reporter can find it */
+    th->next = __atomic_load_n(&g_thread_hists, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&g_thread_hists, &th->next, th, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      ;
+    t_hists = th;
+  }
+
+  histogram_record(th->hists[op], nsecs);
+}
+
+/* all threads' latencies for op, since the child started */
+static void merge_latencies(int op, histogram_t merged)
+{
+  thread_histograms *th;
+
+  histogram_reset(merged);
+
+  th = __atomic_load_n(&g_thread_hists, __ATOMIC_ACQUIRE);
+  for (; th; th = th->next)
+    histogram_merge(merged, th->hists[op]);
+}
+
+static void report_latencies(void)
+{
+  static histogram_t merged = NULL;
+  int j;
+
+  if (!merged)
+    merged = histogram_new();
+
+  for (j=0; j < g_num_ops; j++) {
+    merge_latencies(j, merged);
+
+    info("latency[%s]: count=%lu p50_us=%.1f p90_us=%.1f p99_us=%.1f "
+         "p99.9_us=%.1f max_us=%.1f",
+         g_op_names[j],
+         histogram_count(merged),
+         histogram_percentile(merged, 50.0) / 1000.0,
+         histogram_percentile(merged, 90.0) / 1000.0,
+         histogram_percentile(merged, 99.0) / 1000.0,
+         histogram_percentile(merged, 99.9) / 1000.0,
+         histogram_max(merged) / 1000.0);
+  }
+}
+
+/* pool is NULL for the reactor engine */
+static int queue_depth(worker_pool *pool)
+{
+  int j, depth = 0;
+
+  for (j=0; pool && j < pool->count; j++)
+    depth += queue_count(pool->workers[j].queue);
+
+  return depth;
+}
+
+/* for the parent to aggregate, see report_summary() */
+static void publish_stats(worker_pool *pool, int child_num)
+{
+  uint64_t *counters;
+  int j;
+
+  stats_begin_write(g_shared, child_num);
+
+  counters = stats_counters(g_shared, child_num);
+  counters[PUB_CONNECTED] = __atomic_load_n(&g_stats.connected, __ATOMIC_RELAXED);
+  counters[PUB_SESSIONS] = __atomic_load_n(&g_stats.sessions, __ATOMIC_RELAXED);
+  counters[PUB_EXPIRATIONS] = __atomic_load_n(&g_stats.expirations, __ATOMIC_RELAXED);
+  counters[PUB_CONNECT_RETRIES] = __atomic_load_n(&g_stats.connect_retries, __ATOMIC_RELAXED);
+  counters[PUB_EVENTS] = __atomic_load_n(&g_stats.events, __ATOMIC_RELAXED);
+  counters[PUB_QUEUE_DEPTH] = queue_depth(pool);
+  for (j=0; j < g_num_ops; j++)
+    counters[PUB_OP_ERRORS + j] = __atomic_load_n(&g_op_errors[j], __ATOMIC_RELAXED);
+
+  for (j=0; j < g_num_ops; j++)
+    merge_latencies(j, stats_histogram(g_shared, child_num, j));
+
+  stats_end_write(g_shared, child_num);
+}
+
+/* sums up what all the children published */
+static void read_summary(run_params *params, run_summary *sum)
+{
+  int j, k;
+
+  if (!sum->totals) {
+    sum->num_counters = PUB_OP_ERRORS + g_num_ops;
+    sum->totals = (uint64_t *)safe_alloc(sizeof(uint64_t) * sum->num_counters);
+    sum->last_totals = (uint64_t *)safe_alloc(sizeof(uint64_t) * sum->num_counters);
+    sum->last_counts = (uint64_t *)safe_alloc(sizeof(uint64_t) * (g_num_ops + 1));
+    sum->child_hists = (histogram_t *)safe_alloc(sizeof(histogram_t) * (g_num_ops + 1));
+    sum->hists = (histogram_t *)safe_alloc(sizeof(histogram_t) * (g_num_ops + 1));
+    sum->last_hists = (histogram_t *)safe_alloc(sizeof(histogram_t) * (g_num_ops + 1));
+    sum->interval_hists = (histogram_t *)safe_alloc(sizeof(histogram_t) * (g_num_ops + 1));
+    for (j=0; j < g_num_ops; j++) {
+      sum->child_hists[j] = histogram_new();
+      sum->hists[j] = histogram_new();
+      sum->last_hists[j] = histogram_new();
+      sum->interval_hists[j] = histogram_new();
+    }
+
+    sum->counters = (uint64_t *)safe_alloc(sizeof(uint64_t) * sum->num_counters);
+    sum->child_totals = (uint64_t **)safe_alloc(sizeof(uint64_t *) * params->num_procs);
+    sum->child_last = (histogram_t **)safe_alloc(sizeof(histogram_t *) * params->num_procs);
+    for (k=0; k < params->num_procs; k++) {
+      sum->child_totals[k] = (uint64_t *)safe_alloc(sizeof(uint64_t) * sum->num_counters);
+      sum->child_last[k] = (histogram_t *)safe_alloc(sizeof(histogram_t) * (g_num_ops + 1));
+      for (j=0; j < g_num_ops; j++)
+        sum->child_last[k][j] = histogram_new();
+    }
+  }
+
+  /* what's now, becomes what was */
+  memcpy(sum->last_totals, sum->totals, sizeof(uint64_t) * sum->num_counters);
+  for (j=0; j < g_num_ops; j++) {
+    sum->last_counts[j] = histogram_count(sum->hists[j]);
+    histogram_reset(sum->last_hists[j]);
+    histogram_merge(sum->last_hists[j], sum->hists[j]);
+    histogram_reset(sum->hists[j]);
+  }
+  sum->last_read_at = sum->read_at;
+  sum->read_at = now_nsecs();
+
+  memset(sum->totals, 0, sizeof(uint64_t) * sum->num_counters);
+
+  /*
+   * A child that died while publishing is left with a region that can't
+   * be read anymore, so it's counted as of its last good read: the totals
+   * (and rates) would go backwards otherwise.
+   */
+  for (k=0; k < params->num_procs; k++) {
+    if (stats_read(g_shared, k, sum->counters, sum->child_hists) == 0) {
+      memcpy(sum->child_totals[k], sum->counters, sizeof(uint64_t) * sum->num_counters);
+      for (j=0; j < g_num_ops; j++)
+        memcpy(sum->child_last[k][j], sum->child_hists[j], sizeof(histogram));
+    } else {
+      warn("Child %d died while publishing its stats, using its last ones", k);
+    }
+
+    for (j=0; j < sum->num_counters; j++)
+      sum->totals[j] += sum->child_totals[k][j];
+
+    for (j=0; j < g_num_ops; j++)
+      histogram_merge(sum->hists[j], sum->child_last[k][j]);
+  }
+
+  /* the children's are since they started, these are since the last read */
+  for (j=0; j < g_num_ops; j++) {
+    histogram_reset(sum->interval_hists[j]);
+    histogram_merge(sum->interval_hists[j], sum->hists[j]);
+    histogram_subtract(sum->interval_hists[j], sum->last_hists[j]);
+  }
+}
+
+/* since the previous read_summary() */
+static double summary_rate(run_summary *sum, uint64_t now, uint64_t before)
+{
+  if (!sum->last_read_at || sum->read_at == sum->last_read_at)
+    return 0.0;
+
+  return (now - before) * 1e9 / (sum->read_at - sum->last_read_at);
+}
+
+static void report_summary(run_summary *sum)
+{
+  int j;
+
+  info("summary: connected=%lu sessions=%lu sessions_per_sec=%.1f "
+       "expirations=%lu connect_retries=%lu events_per_sec=%.1f queue_depth=%lu",
+       sum->totals[PUB_CONNECTED],
+       sum->totals[PUB_SESSIONS],
+       summary_rate(sum, sum->totals[PUB_SESSIONS], sum->last_totals[PUB_SESSIONS]),
+       sum->totals[PUB_EXPIRATIONS],
+       sum->totals[PUB_CONNECT_RETRIES],
+       summary_rate(sum, sum->totals[PUB_EVENTS], sum->last_totals[PUB_EVENTS]),
+       sum->totals[PUB_QUEUE_DEPTH]);
+
+  for (j=0; j < g_num_ops; j++)
+    info("summary[%s]: count=%lu ops_per_sec=%.1f errors=%lu p50_us=%.1f "
+         "p90_us=%.1f p99_us=%.1f p99.9_us=%.1f max_us=%.1f",
+         g_op_names[j],
+         histogram_count(sum->hists[j]),
+         summary_rate(sum, histogram_count(sum->hists[j]), sum->last_counts[j]),
+         sum->totals[PUB_OP_ERRORS + j],
+         histogram_percentile(sum->hists[j], 50.0) / 1000.0,
+         histogram_percentile(sum->hists[j], 90.0) / 1000.0,
+         histogram_percentile(sum->hists[j], 99.0) / 1000.0,
+         histogram_percentile(sum->hists[j], 99.9) / 1000.0,
+         histogram_max(sum->hists[j]) / 1000.0);
+}
+
+static void json_string(FILE *out, const char *str)
+{
+  fputc('"', out);
+  for (; str && *str; str++) {
+    if (*str == '"' || *str == '\\')
+      fprintf(out, "\\%c", *str);
+    else if ((unsigned char)*str < 0x20)
+      fprintf(out, "\\u%04x", *str);
+    else
+      fputc(*str, out);
+  }
+  fputc('"', out);
+}
+
+/*
+ * Everything is since the previous read, or since started (for the
+ * summary) if it's given.
+ */
+static void json_ops(FILE *out, run_summary *sum, uint64_t started)
+{
+  double secs = (sum->read_at - started) / 1e9;
+  histogram_t *hists = started ? sum->hists : sum->interval_hists;
+  uint64_t count, errors;
+  int j;
+
+  fprintf(out, "\"ops\":{");
+  for (j=0; j < g_num_ops; j++) {
+    count = histogram_count(hists[j]);
+    errors = sum->totals[PUB_OP_ERRORS + j];
+    if (!started)
+      errors -= sum->last_totals[PUB_OP_ERRORS + j];
+
+    json_string(out, g_op_names[j]);
+    fprintf(out,
+            ":{\"count\":%lu,\"ops_per_sec\":%.1f,\"errors\":%lu,"
+            "\"p50_us\":%.1f,\"p90_us\":%.1f,\"p99_us\":%.1f,"
+            "\"p99.9_us\":%.1f,\"max_us\":%.1f}%s",
+            count,
+            started ? (secs > 0 ? count / secs : 0.0) : summary_rate(sum, count, 0),
+            errors,
+            histogram_percentile(hists[j], 50.0) / 1000.0,
+            histogram_percentile(hists[j], 90.0) / 1000.0,
+            histogram_percentile(hists[j], 99.0) / 1000.0,
+            histogram_percentile(hists[j], 99.9) / 1000.0,
+            histogram_max(hists[j]) / 1000.0,
+            j + 1 < g_num_ops ? "," : "");
+  }
+  fprintf(out, "}");
+}
+
+/* a JSON line per summary, it's only flushed when the run is over */
+static void write_interval_record(FILE *out, run_summary *sum, uint64_t started)
+{
+  fprintf(out,
+          "{\"type\":\"interval\",\"elapsed_secs\":%.3f,"
+          "\"connected\":%lu,\"sessions\":%lu,\"sessions_per_sec\":%.1f,"
+          "\"expirations\":%lu,\"connect_retries\":%lu,"
+          "\"events_per_sec\":%.1f,\"queue_depth\":%lu,",
+          (sum->read_at - started) / 1e9,
+          sum->totals[PUB_CONNECTED],
+          sum->totals[PUB_SESSIONS],
+          summary_rate(sum, sum->totals[PUB_SESSIONS], sum->last_totals[PUB_SESSIONS]),
+          sum->totals[PUB_EXPIRATIONS],
+          sum->totals[PUB_CONNECT_RETRIES],
+          summary_rate(sum, sum->totals[PUB_EVENTS], sum->last_totals[PUB_EVENTS]),
+          sum->totals[PUB_QUEUE_DEPTH]);
+  json_ops(out, sum, 0);
+  fprintf(out, "}\n");
+}
+
+/* the whole run, along with what it ran with */
+static void write_final(FILE *out, run_params *params, run_summary *sum, uint64_t started)
+{
+  double secs = (sum->read_at - started) / 1e9;
+
+  fprintf(out, "{\"type\":\"summary\",\"params\":{\"server\":");
+  json_string(out, params->servername);
+  fprintf(out, ",\"path\":");
+  json_string(out, params->path);
+  fprintf(out, ",\"username_prefix\":");
+  json_string(out, params->username_prefix);
+  fprintf(out,
+          ",\"max_events\":%d,\"num_clients\":%d,\"num_procs\":%d,"
+          "\"engine\":\"%s\",\"poll_backend\":\"%s\",\"epoll_mode\":\"%s\","
+          "\"num_workers\":%d,\"min_workers\":%d,\"max_workers\":%d,"
+          "\"worker_batch\":%d,\"queue_size\":%d,\"queue_timeout\":%d,"
+          "\"stats_interval\":%d,\"write_interval\":%d,\"wait_time\":%d,"
+          "\"zk_session_timeout\":%d,\"switch_uid\":%d,"
+          "\"sleep_after_clients\":%d,\"sleep_inbetween_clients\":%d,"
+          "\"duration\":%d},",
+          params->max_events,
+          params->num_clients,
+          params->num_procs,
+          params->engine == ENGINE_REACTOR ? "reactor" : "threaded",
+          params->poll_backend == POLL_BACKEND_URING ? "io_uring" : "epoll",
+          params->epoll_mode == EPOLL_MODE_ONESHOT ? "oneshot" :
+          params->epoll_mode == EPOLL_MODE_EDGE ? "edge" : "level",
+          params->num_workers,
+          params->min_workers,
+          params->max_workers,
+          params->worker_batch,
+          params->queue_size,
+          params->queue_timeout,
+          params->stats_interval,
+          params->write_interval,
+          params->wait_time,
+          params->zk_session_timeout,
+          params->switch_uid,
+          params->sleep_after_clients,
+          params->sleep_inbetween_clients,
+          params->duration);
+  fprintf(out,
+          "\"elapsed_secs\":%.3f,\"connected\":%lu,\"sessions\":%lu,"
+          "\"sessions_per_sec\":%.1f,\"expirations\":%lu,"
+          "\"connect_retries\":%lu,\"events\":%lu,\"events_per_sec\":%.1f,",
+          secs,
+          sum->totals[PUB_CONNECTED],
+          sum->totals[PUB_SESSIONS],
+          secs > 0 ? sum->totals[PUB_SESSIONS] / secs : 0.0,
+          sum->totals[PUB_EXPIRATIONS],
+          sum->totals[PUB_CONNECT_RETRIES],
+          sum->totals[PUB_EVENTS],
+          secs > 0 ? sum->totals[PUB_EVENTS] / secs : 0.0);
+  json_ops(out, sum, started);
+  fprintf(out, "}\n");
+}
+
+static void stop_running(int signum)
+{
+  g_stop = 1;
+}
+
+/*
+ * Reports what the children are up to until --duration is over (if any)
+ * or we're told to stop, then stops them.
+ */
+static void run_parent(run_params *params, pid_t *pids)
+{
+  run_summary sum;
+  struct sigaction sa;
+  uint64_t started = now_nsecs();
+  FILE *results = NULL;
+  int j, saved;
+
+  memset(&sum, 0, sizeof(sum));
+
+  if (params->results_file) {
+    results = fopen(params->results_file, "a");
+    if (!results) {
+      saved = errno;
+      error(EXIT_SYSTEM_CALL,
+            "Failed to open %s: %s",
+            params->results_file,
+            strerror(saved));
+    }
+
+    /* so appending a line is just a memcpy, most of the time */
+    setvbuf(results, NULL, _IOFBF, RESULTS_BUFFER_SIZE);
+  }
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = &stop_running;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  while (!g_stop) {
+    sleep(1);
+
+    read_summary(params, &sum);
+    report_summary(&sum);
+    if (results)
+      write_interval_record(results, &sum, started);
+
+    if (params->duration && sum.read_at - started >= params->duration * 1000000000ULL)
+      break;
+  }
+
+  /* as of now, in case it was interrupted before the 1st read */
+  read_summary(params, &sum);
+
+  if (results) {
+    write_final(results, params, &sum, started);
+    fclose(results);
+  }
+
+  for (j=0; j < params->num_procs; j++)
+    kill(pids[j], SIGTERM);
+
+  while (wait(NULL) > 0)
+    ;
+
+  info("Ran for %.1f secs", (sum.read_at - started) / 1e9);
+  exit(0);
+}
+
+static void report_stats(worker_pool *pool)
+{
+  long events = __atomic_load_n(&g_stats.events, __ATOMIC_RELAXED);
+  long sum = __atomic_exchange_n(&g_stats.event_latency_sum, 0, __ATOMIC_RELAXED);
+  long max = __atomic_exchange_n(&g_stats.event_latency_max, 0, __ATOMIC_RELAXED);
+  long checks = __atomic_exchange_n(&g_stats.interest_checks, 0, __ATOMIC_RELAXED);
+  long ctls = __atomic_exchange_n(&g_stats.epoll_ctls, 0, __ATOMIC_RELAXED);
+  long saved = __atomic_exchange_n(&g_stats.epoll_ctls_saved, 0, __ATOMIC_RELAXED);
+  long submits = __atomic_exchange_n(&g_stats.ring_submits, 0, __ATOMIC_RELAXED);
+  long wakeups = __atomic_exchange_n(&g_stats.poller_wakeups, 0, __ATOMIC_RELAXED);
+  long polled = __atomic_exchange_n(&g_stats.poller_events, 0, __ATOMIC_RELAXED);
+  long cpu = __atomic_load_n(&g_stats.poller_cpu, __ATOMIC_RELAXED);
+  long steals = __atomic_exchange_n(&g_stats.steals, 0, __ATOMIC_RELAXED);
+  long sessions = __atomic_load_n(&g_stats.sessions, __ATOMIC_RELAXED);
+  long retries = __atomic_load_n(&g_stats.connect_retries, __ATOMIC_RELAXED);
+  uint64_t now = now_nsecs();
+  static uint64_t last_report = 0;
+  static long last_cpu = 0, last_events = 0, last_sessions = 0, last_retries = 0;
+  long overflows = 0;
+  int j;
+
+  for (j=0; pool && j < pool->count; j++)
+    overflows += queue_overflows(pool->workers[j].queue);
+
+  info("stats: events=%ld event_latency_avg_us=%.1f event_latency_max_us=%.1f "
+       "interest_checks=%ld epoll_ctls=%ld epoll_ctls_saved=%ld ring_submits=%ld "
+       "poller_wakeups=%ld poller_events=%ld poller_cpu_ms=%.1f "
+       "queue_depth=%d queue_overflows=%ld steals=%ld workers=%d "
+       "sessions=%ld sessions_per_sec=%.1f connect_retries=%ld log_drops=%ld "
+       "ops_issued=%ld ops_skipped=%ld",
+       events - last_events,
+       events > last_events ? sum / 1000.0 / (events - last_events) : 0.0,
+       max / 1000.0,
+       checks,
+       ctls,
+       saved,
+       submits,
+       wakeups,
+       polled,
+       (cpu - last_cpu) / 1000000.0,
+       queue_depth(pool),
+       overflows,
+       steals,
+       pool ? __atomic_load_n(&pool->active, __ATOMIC_RELAXED) : 0,
+       sessions,
+       last_report ? (sessions - last_sessions) * 1e9 / (now - last_report) : 0.0,
+       retries - last_retries,
+       log_drops(),
+       __atomic_exchange_n(&g_stats.issued, 0, __ATOMIC_RELAXED),
+       __atomic_exchange_n(&g_stats.issue_skipped, 0, __ATOMIC_RELAXED));
+
+  last_cpu = cpu;
+  last_events = events;
+  last_sessions = sessions;
+  last_retries = retries;
+  last_report = now;
+}
+
+/*
+ * Grows or shrinks the active workers by one, given how backed up the
+ * queues are and how long connections waited in them since last time.
+ */
+static void *resize_workers(void *data)
+{
+  int j, depth, active;
+  int quiet = 0;
+  long sum, count;
+  double wait_us;
+  worker_pool *pool = (worker_pool *)data;
+  run_params *params = pool->params;
+
+  while (1) {
+    usleep(WORKER_RESIZE_MS * 1000);
+
+    sum = __atomic_exchange_n(&g_stats.queue_wait_sum, 0, __ATOMIC_RELAXED);
+    count = __atomic_exchange_n(&g_stats.queue_wait_count, 0, __ATOMIC_RELAXED);
+    wait_us = count ? sum / 1000.0 / count : 0.0;
+
+    for (j=0, depth=0; j < pool->count; j++)
+      depth += queue_count(pool->workers[j].queue);
+
+    active = pool->active;
+
+    if (active < params->max_workers &&
+        (depth > active * params->worker_batch ||
+         wait_us > WORKER_GROW_WAIT_US)) {
+      if (depth > active * params->worker_batch)
+        info("workers: %d -> %d, queue_depth=%d > %d",
+             active, active + 1, depth, active * params->worker_batch);
+      else
+        info("workers: %d -> %d, queue_wait_avg_us=%.1f > %d",
+             active, active + 1, wait_us, WORKER_GROW_WAIT_US);
+
+      pthread_mutex_lock(&pool->lock);
+      __atomic_store_n(&pool->active, active + 1, __ATOMIC_RELEASE);
+      pthread_cond_broadcast(&pool->unparked);
+      pthread_mutex_unlock(&pool->lock);
+      quiet = 0;
+      continue;
+    }
+
+    if (depth || wait_us >= WORKER_SHRINK_WAIT_US) {
+      quiet = 0;
+      continue;
+    }
+
+    if (++quiet < WORKER_SHRINK_ROUNDS || active <= params->min_workers)
+      continue;
+
+    info("workers: %d -> %d, queue_depth=0 & queue_wait_avg_us=%.1f < %d "
+         "for %d rounds",
+         active, active - 1, wait_us, WORKER_SHRINK_WAIT_US, quiet);
+
+    /* the parked one drains its queue first, see get_work() */
+    pthread_mutex_lock(&pool->lock);
+    __atomic_store_n(&pool->active, active - 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&pool->lock);
+    quiet = 0;
+  }
+
+  return NULL;
+}
+
+/* takes up to half of the first busy queue found, returns how many */
+static int steal_work(worker *self, connection **batch, int max)
+{
+  int j, n, count;
+  worker *victim;
+  worker_pool *pool = self->pool;
+  int active = __atomic_load_n(&pool->active, __ATOMIC_ACQUIRE);
+
+  for (j=1; j < pool->count; j++) {
+    victim = &pool->workers[(self->id + j) % pool->count];
+
+    /* a parked worker's leftovers are all up for grabs */
+    count = queue_count(victim->queue);
+    if (count < (victim->id < active ? WORKER_STEAL_MIN : 1))
+      continue;
+
+    if (victim->id < active)
+      count /= 2;
+    count = count < max ? count : max;
+    n = queue_remove_many_timeout(victim->queue, (void **)batch, count, 0);
+    if (n > 0) {
+      __atomic_add_fetch(&g_stats.steals, n, __ATOMIC_RELAXED);
+      return n;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Own queue first, then somebody else's, then wait a bit on our own. A
+ * parked worker finishes off its queue and then sleeps until unparked.
+ */
+static int get_work(worker *self, connection **batch, int max)
+{
+  int n;
+  worker_pool *pool = self->pool;
+
+  if (pool->count == 1)
+    return queue_remove_many(self->queue, (void **)batch, max);
+
+  if ((n = queue_remove_many_timeout(self->queue, (void **)batch, max, 0)))
+    return n;
+
+  if (self->id >= __atomic_load_n(&pool->active, __ATOMIC_ACQUIRE)) {
+    pthread_mutex_lock(&pool->lock);
+    while (self->id >= pool->active)
+      pthread_cond_wait(&pool->unparked, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+  }
+
+  if ((n = steal_work(self, batch, max)))
+    return n;
+
+  return queue_remove_many_timeout(self->queue, (void **)batch, max,
+                                   WORKER_IDLE_MS);
+}
+
+static void *zk_process_worker(void *data)
+{
+  int j, count;
+  connection *zkc;
+  connection **batch;
+  worker *self = (worker *)data;
+  int worker_batch = self->pool->params->worker_batch;
+
+  batch = (connection **)safe_alloc(sizeof(connection *) * worker_batch);
+
+  while (1) {
+    count = get_work(self, batch, worker_batch);
+
+    for (j=0; j < count; j++) {
+      zkc = batch[j];
+
+      /* Note:
+       *
+       * watchers are called from here, so no need for locking from there
+       */
+      pthread_mutex_lock(&zkc->lock);
+      zkc->queued = 0;
+      record_event(zkc->ready_at);
+      zookeeper_process(zkc->zh, zkc->events);
+      if (g_epoll_mode != EPOLL_MODE_LEVEL)
+        rearm(zkc);
+      pthread_mutex_unlock(&zkc->lock);
+
+      /* it might have something to send now */
+      mark_dirty(zkc);
+    }
+
+    /* the re-arms, if any */
+    g_backend->flush(g_ps);
+  }
+
+  return NULL;
+}
+
+static void *check_interests(void *data)
+{
+  int wait_ms = 0;
+  interests_sched *sched = (interests_sched *)data;
+
+  while (1)
+    wait_ms = run_interests(sched, wait_ms);
+
+  return NULL;
+}
+
+static void set_timer_pos(void *value, int pos)
+{
+  ((connection *)value)->timer_pos = pos;
+}
+
+/* size is the # of clients handled by this scheduler */
+static void interests_sched_init(interests_sched *sched,
+                                 poll_set *ps,
+                                 int size,
+                                 int batch_size,
+                                 int locked)
+{
+  sched->ps = ps;
+  sched->timers = heap_new(size);
+  heap_set_pos_func(sched->timers, &set_timer_pos);
+  /* each client is in there at most once, so it never fills up */
+  sched->dirty = queue_new(size);
+  sched->batch = (connection **)safe_alloc(sizeof(connection *) * batch_size);
+  sched->batch_size = batch_size;
+  sched->locked = locked;
+}
+
+/* asks for zkc's interests to be checked asap, can be called from any thread */
+static void mark_dirty(connection *zkc)
+{
+  if (!__atomic_exchange_n(&zkc->dirty, 1, __ATOMIC_ACQ_REL))
+    queue_add(zkc->sched->dirty, zkc);
+}
+
+/* checks zkc's interests and schedules the next check */
+static void do_check_interests(interests_sched *sched, connection *zkc)
+{
+  int fd, rc, interest;
+  struct timeval tv;
+  uint64_t wait_us;
+  zhandle_t *zh;
+
+  fd = -1;
+
+  /* the lock also covers the registration cache (see create_client()) */
+  if (sched->locked)
+    pthread_mutex_lock(&zkc->lock);
+  /* published by create_client() */
+  zh = __atomic_load_n(&zkc->zh, __ATOMIC_ACQUIRE);
+  if (zh) {
+    rc = zookeeper_interest(zh, &fd, &interest, &tv);
+    update_interest(zkc, rc, fd, interest, zoo_state(zh));
+  }
+  if (sched->locked)
+    pthread_mutex_unlock(&zkc->lock);
+
+  if (!zh) {
+    /* create_client() will mark it dirty once it's there */
+    if (zkc->timer_pos != -1)
+      heap_remove(sched->timers, zkc->timer_pos);
+    return;
+  }
+
+  __atomic_add_fetch(&g_stats.interest_checks, 1, __ATOMIC_RELAXED);
+
+  if (rc == ZOK)
+    wait_us = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+  else
+    wait_us = INTERESTS_RETRY_MS * 1000;
+
+  if (wait_us > INTERESTS_MAX_WAIT_MS * 1000)
+    wait_us = INTERESTS_MAX_WAIT_MS * 1000;
+
+  if (zkc->timer_pos == -1)
+    heap_push(sched->timers, now_nsecs() + wait_us * 1000, zkc);
+  else
+    heap_update(sched->timers, zkc->timer_pos, now_nsecs() + wait_us * 1000);
+}
+
+/*
+ * Checks the dirty clients (waiting up to wait_ms for one to show up) and
+ * then those whose time has come.
+ *
+ * returns the ms until the next check is due
+ */
+static int run_interests(interests_sched *sched, int wait_ms)
+{
+  int j, n;
+  uint64_t due, now;
+  connection *zkc;
+
+  n = queue_remove_many_timeout(sched->dirty,
+                                (void **)sched->batch,
+                                sched->batch_size,
+                                wait_ms);
+  while (n > 0) {
+    for (j=0; j < n; j++) {
+      zkc = sched->batch[j];
+      /* so marks from here on queue it again */
+      __atomic_store_n(&zkc->dirty, 0, __ATOMIC_SEQ_CST);
+      do_check_interests(sched, zkc);
+    }
+
+    if (n < sched->batch_size)
+      break;
+
+    n = queue_remove_many_timeout(sched->dirty,
+                                  (void **)sched->batch,
+                                  sched->batch_size,
+                                  0);
+  }
+
+  now = now_nsecs();
+  while ((zkc = heap_peek(sched->timers, &due)) && due <= now)
+    do_check_interests(sched, zkc);
+
+  /* one submission for the whole sweep (with io_uring) */
+  g_backend->flush(sched->ps);
+
+  if (!zkc)
+    return INTERESTS_MAX_WAIT_MS;
+
+  /* round up, so we don't wake up just before it's due */
+  return (int)((due - now + 999999) / 1000000);
+}
+
+static void poll_ctl_or_die(connection *zkc, int op, int fd, uint32_t events)
+{
+  int rv;
+
+  __atomic_add_fetch(&g_stats.epoll_ctls, 1, __ATOMIC_RELAXED);
+
+  if ((rv = g_backend->ctl(zkc->ps, op, zkc, fd, events)))
+    error(EXIT_SYSTEM_CALL,
+          "%s ctl(%s) failed with: %s",
+          g_backend->name,
+          op == EPOLL_CTL_ADD ? "add" : op == EPOLL_CTL_MOD ? "mod" : "del",
+          strerror(rv));
+}
+
+/*
+ * Oneshot: the poller claims a reported connection, so it's only queued
+ * once even if it was re-armed (and reported again) in the meantime. The
+ * claim is dropped right before it's re-armed.
+ */
+static int claim(connection *zkc)
+{
+  int expected = 0;
+
+  return __atomic_compare_exchange_n(&zkc->in_flight, &expected, 1, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+static int claimed(connection *zkc)
+{
+  return __atomic_load_n(&zkc->in_flight, __ATOMIC_ACQUIRE);
+}
+
+static void unclaim(connection *zkc)
+{
+  __atomic_store_n(&zkc->in_flight, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * (Re)registers the fd with the poll set, given what zookeeper_interest()
+ * said.
+ *
+ * Only issues a ctl() when the fd or the events changed, since the last
+ * registration is cached in zkc. A state change (i.e.: a reconnect) also
+ * forces it: the new socket might have reused the old fd number, in which
+ * case closing the old one already took it out of epoll. Any error drops
+ * the cached registration too, since the library might've closed the
+ * socket (i.e.: a connect timeout) without a state change: the next
+ * attempt could get the same fd number while still CONNECTING.
+ */
+static void update_interest(connection *zkc, int rc, int fd, int interest, int state)
+{
+  int rv;
+  uint32_t events;
+
+  if (rc || fd == -1) {
+    if (fd != -1 && fd == zkc->reg_fd) {
+      /* still open, so it's still ours */
+      __atomic_add_fetch(&g_stats.epoll_ctls, 1, __ATOMIC_RELAXED);
+      g_backend->ctl(zkc->ps, EPOLL_CTL_DEL, zkc, fd, 0);
+      zkc->reg_fd = -1;
+    }
+    forget_registration(zkc);
+    return;
+  }
+
+  /* whoever claimed it will re-arm it (see rearm()) */
+  if (g_epoll_mode == EPOLL_MODE_ONESHOT && claimed(zkc))
+    return;
+
+  events = 0;
+  if (interest & ZOOKEEPER_READ)
+    events |= EPOLLIN;
+
+  if (interest & ZOOKEEPER_WRITE)
+    events |= EPOLLOUT;
+
+  if (g_epoll_mode == EPOLL_MODE_ONESHOT)
+    events |= EPOLLONESHOT;
+  else if (g_epoll_mode == EPOLL_MODE_EDGE)
+    events |= EPOLLET;
+
+  if (fd == zkc->reg_fd && state == zkc->reg_state) {
+    if (events == zkc->reg_events) {
+      __atomic_add_fetch(&g_stats.epoll_ctls_saved, 1, __ATOMIC_RELAXED);
+      return;
+    }
+
+    poll_ctl_or_die(zkc, EPOLL_CTL_MOD, fd, events);
+  } else if (fd == zkc->reg_fd) {
+    /* might be gone from epoll already, if the fd number was reused */
+    __atomic_add_fetch(&g_stats.epoll_ctls, 1, __ATOMIC_RELAXED);
+    if ((rv = g_backend->ctl(zkc->ps, EPOLL_CTL_MOD, zkc, fd, events))) {
+      if (rv != ENOENT)
+        error(EXIT_SYSTEM_CALL,
+              "%s ctl(mod) failed with: %s",
+              g_backend->name,
+              strerror(rv));
+      poll_ctl_or_die(zkc, EPOLL_CTL_ADD, fd, events);
+    }
+  } else {
+    /* Note:
+     *
+     * a new fd means the library closed the old one, which took it out of
+     * epoll already (that's the DEL). Issuing it by hand could hit another
+     * client's socket, if it got the old fd number in the meantime.
+     * io_uring polls keep the old socket alive though, so those are
+     * dropped by connection instead (see forget_registration()).
+     */
+    forget_registration(zkc);
+    poll_ctl_or_die(zkc, EPOLL_CTL_ADD, fd, events);
+  }
+
+  zkc->reg_fd = fd;
+  zkc->reg_events = events;
+  zkc->reg_state = state;
+}
+
+/* the fd registered for zkc (if any) was closed */
+static void forget_registration(connection *zkc)
+{
+  if (zkc->reg_fd != -1)
+    g_backend->forget(zkc->ps, zkc);
 
-  tids_workers = (pthread_t *)safe_alloc(sizeof(pthread_t) * num_workers);
+  zkc->reg_fd = -1;
+}
 
-  snprintf(tname, 20, "child[%d]", child_num);
-  prctl(PR_SET_NAME, tname, 0, 0, 0);
+/*
+ * A registration that's gone (i.e.: a multishot poll that ended) gets
+ * added again by the next interests check.
+ */
+static void registration_gone(connection *zkc, int locked)
+{
+  if (locked)
+    pthread_mutex_lock(&zkc->lock);
+  zkc->reg_fd = -1;
+  if (locked)
+    pthread_mutex_unlock(&zkc->lock);
 
-  queue = queue_new(num_clients);
+  mark_dirty(zkc);
+}
 
-  /* for threads needing the params */
-  queue_set_user_data(queue, (void *)params);
 
-  if (params->switch_uid) {
-    char username[64];
-    sprintf(username, "%s%d", params->username_prefix, child_num);
-    change_uid(username);
-  }
+/*
+ * epoll backend
+ */
 
-  g_zhs = (connection *)safe_alloc(sizeof(connection) * num_clients);
+static void epoll_init(poll_set *ps, int size)
+{
+  int saved;
 
-  g_epfd = epoll_create(1);
-  if (g_epfd == -1) {
+  ps->epfd = epoll_create(1);
+  if (ps->epfd == -1) {
     saved = errno;
     error(EXIT_SYSTEM_CALL,
           "Failed to create an epoll instance: %s",
           strerror(saved));
   }
 
-  /* prepare locks */
-  for (j=0; j < num_clients; j++) {
-    if (pthread_mutex_init(&g_zhs[j].lock, 0)) {
-      error(EXIT_SYSTEM_CALL, "Failed to init mutex");
-    }
-  }
+  ps->scratch = safe_alloc(sizeof(struct epoll_event) * ps->max_events);
+}
 
-  /* start threads */
-  pthread_create(&tid_create_clients, NULL, &create_clients, params);
-  set_thread_name(tid_create_clients, "creator");
+static int epoll_backend_ctl(poll_set *ps, int op, connection *conn, int fd, uint32_t events)
+{
+  /* Note that ev must be !NULL for DEL on kernels < 2.6.9 */
+  struct epoll_event ev;
 
-  pthread_create(&tid_interests, NULL, &check_interests, params);
-  set_thread_name(tid_interests, "interests");
+  ev.data.ptr = conn;
+  ev.events = events;
 
-  pthread_create(&tid_poller, NULL, &poll_clients, queue);
-  set_thread_name(tid_poller, "poller");
+  return epoll_ctl(ps->epfd, op, fd, &ev) == -1 ? errno : 0;
+}
 
-  for (j=0; j < num_workers; j++) {
-    char thread_name[128];
+/* closing the fd already took it out */
+static void epoll_forget(poll_set *ps, connection *conn)
+{
+}
 
-    snprintf(thread_name, 128, "work[%d]", j);
-    pthread_create(&tids_workers[j], NULL, &zk_process_worker, queue);
-    set_thread_name(tids_workers[j], thread_name);
+static void epoll_flush(poll_set *ps)
+{
+}
+
+static int epoll_backend_wait(poll_set *ps, poll_event *evlist, int timeout_ms)
+{
+  int ready, j, saved;
+  struct epoll_event *evs = (struct epoll_event *)ps->scratch;
+
+  ready = epoll_wait(ps->epfd, evs, ps->max_events, timeout_ms);
+  if (ready == -1) {
+    if (errno == EINTR)
+      return 0;
+
+    saved = errno;
+    error(EXIT_SYSTEM_CALL, "epoll_wait failed with: %s", strerror(saved));
   }
 
-  /* TODO: monitor each thread's health */
-  while (1)
-    sleep(100);
+  for (j=0; j < ready; j++) {
+    evlist[j].conn = (connection *)evs[j].data.ptr;
+    evlist[j].events = evs[j].events;
+    evlist[j].gone = 0;
+  }
+
+  return ready;
 }
 
-static void *zk_process_worker(void *data)
+static const poll_backend epoll_backend = {
+  "epoll",
+  epoll_init,
+  epoll_backend_ctl,
+  epoll_forget,
+  epoll_flush,
+  epoll_backend_wait,
+};
+
+
+/*
+ * io_uring backend
+ *
+ * Each registration is a multishot poll whose user_data is the connection,
+ * so it's updated & removed by connection rather than by fd. Multishot
+ * polls only fire on new wakeups (much like EPOLLET), so this backend
+ * always runs in edge mode.
+ */
+
+static void uring_init(poll_set *ps, int size)
 {
-  connection *zkc;
-  queue_t queue = (queue_t)data;
+  unsigned entries = size < 4096 ? size : 4096;
 
-  while (1) {
-    zkc = (connection *)queue_remove(queue);
+  /* a cqe per wakeup per client, so leave room for a few */
+  ps->ring = uring_new(entries ? entries : 1, (unsigned)size * 4);
+  ps->scratch = safe_alloc(sizeof(struct io_uring_cqe) * ps->max_events);
+}
 
-    /* Note:
-     *
-     * watchers are called from here, so no need for locking from there
-     */
-    pthread_mutex_lock(&zkc->lock);
-    zkc->queued = 0;
-    zookeeper_process(zkc->zh, zkc->events);
-    pthread_mutex_unlock(&zkc->lock);
+static int uring_backend_ctl(poll_set *ps, int op, connection *conn, int fd, uint32_t events)
+{
+  uint64_t ud = (uint64_t)(uintptr_t)conn;
+
+  events &= ~(EPOLLET | EPOLLONESHOT);
+
+  switch (op) {
+  case EPOLL_CTL_ADD:
+    /* so there's never more than one poll per connection */
+    uring_poll_remove(ps->ring, ud, ud | URING_TAG_REMOVE);
+    uring_poll_add(ps->ring, fd, events, ud, 1);
+    break;
+  case EPOLL_CTL_MOD:
+    /* a missing poll shows up as gone in wait() */
+    uring_poll_update(ps->ring, ud, events, 1, ud | URING_TAG_UPDATE);
+    break;
+  case EPOLL_CTL_DEL:
+    uring_poll_remove(ps->ring, ud, ud | URING_TAG_REMOVE);
+    break;
   }
 
-  return NULL;
+  return 0;
 }
 
-static void *check_interests(void *data)
+static void uring_forget(poll_set *ps, connection *conn)
 {
-  int j;
-  struct timespec req = { 0, 10 * 1000 * 1000 } ; /* 10ms */
-  run_params *params = (run_params *)data;
-  int num_clients = params->num_clients;
+  uint64_t ud = (uint64_t)(uintptr_t)conn;
 
-  while (1) {
-    /* Lets see what new interests we've got (i.e.: new Pings, etc) */
-    for (j=0; j < num_clients; j++) {
-      do_check_interests(&g_zhs[j]);
+  uring_poll_remove(ps->ring, ud, ud | URING_TAG_REMOVE);
+}
+
+static void uring_flush(poll_set *ps)
+{
+  if (uring_submit(ps->ring) > 0)
+    __atomic_add_fetch(&g_stats.ring_submits, 1, __ATOMIC_RELAXED);
+}
+
+static int uring_backend_wait(poll_set *ps, poll_event *evlist, int timeout_ms)
+{
+  int n, j, count;
+  struct io_uring_cqe *cqe;
+  struct io_uring_cqe *cqes = (struct io_uring_cqe *)ps->scratch;
+
+  n = uring_wait(ps->ring, cqes, ps->max_events, timeout_ms);
+
+  for (j=0, count=0; j < n; j++) {
+    cqe = &cqes[j];
+
+    if (cqe->user_data & URING_TAGS) {
+      /* an update that didn't find its poll */
+      if ((cqe->user_data & URING_TAGS) == URING_TAG_UPDATE &&
+          cqe->res == -ENOENT) {
+        evlist[count].conn =
+          (connection *)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_TAGS);
+        evlist[count].events = 0;
+        evlist[count++].gone = 1;
+      }
+      continue;
     }
 
-    nanosleep(&req, NULL);
+    /* we removed it ourselves */
+    if (cqe->res == -ECANCELED)
+      continue;
+
+    evlist[count].conn = (connection *)(uintptr_t)cqe->user_data;
+    evlist[count].events = cqe->res > 0 ? (uint32_t)cqe->res : 0;
+    evlist[count++].gone = !(cqe->flags & IORING_CQE_F_MORE);
   }
 
-  return NULL;
+  return count;
+}
+
+static const poll_backend uring_backend = {
+  "io_uring",
+  uring_init,
+  uring_backend_ctl,
+  uring_forget,
+  uring_flush,
+  uring_backend_wait,
+};
+
+static const poll_backend *get_poll_backend(int which)
+{
+  return which == POLL_BACKEND_URING ? &uring_backend : &epoll_backend;
 }
 
-static void do_check_interests(connection *zkc)
+/* size is the # of clients it'll hold */
+static poll_set *poll_set_new(int size, int max_events)
 {
-  int fd, rc, interest, saved, client_ready;
-  struct epoll_event ev;
+  poll_set *ps = (poll_set *)safe_alloc(sizeof(poll_set));
+
+  ps->max_events = max_events;
+  g_backend->init(ps, size);
+
+  return ps;
+}
+
+/*
+ * With EPOLLONESHOT the fd is disabled once reported, and with EPOLLET it
+ * won't be reported again for data that was already there. Either way, a
+ * MOD after zookeeper_process() (with the lock held, for the threaded
+ * engine) gets it going again, reporting whatever is still pending.
+ */
+static void rearm(connection *zkc)
+{
+  int fd, rc, interest;
   struct timeval tv;
 
   fd = -1;
-  client_ready = 1;
+  unclaim(zkc);
+  zkc->reg_events = 0; /* forces the MOD */
 
-  /* TODO: if queued to be processed, should we skip? */
-  pthread_mutex_lock(&zkc->lock);
-  if (zkc->zh) {
-    rc = zookeeper_interest(zkc->zh, &fd, &interest, &tv);
-  } else {
-    client_ready = 0;
-  }
-  pthread_mutex_unlock(&zkc->lock);
+  rc = zookeeper_interest(zkc->zh, &fd, &interest, &tv);
+  update_interest(zkc, rc, fd, interest, zoo_state(zkc->zh));
+}
 
-  if (!client_ready)
-    return;
+/*
+ * Run-to-completion: interests, epoll_wait() & zookeeper_process() all
+ * happen here, for this reactor's shard only, so no locking is needed.
+ */
+static void *run_reactor(void *data)
+{
+  int ready, j, events;
+  int wait_time, next_check;
+  uint64_t ready_at;
+  poll_event *evlist;
+  connection *conn;
+  zhandle_t *zh;
+  reactor *r = (reactor *)data;
+  int max_events = r->params->max_events;
 
-  if (rc || fd == -1) {
-    if (fd != -1 && (rc == ZINVALIDSTATE || rc == ZCONNECTIONLOSS))
-      /* Note that ev must be !NULL for kernels < 2.6.9 */
-      epoll_ctl(g_epfd, EPOLL_CTL_DEL, fd, &ev);
-    return;
-  }
+  evlist = (poll_event *)safe_alloc(sizeof(poll_event) * max_events);
 
-  ev.data.ptr = zkc;
-  ev.events = 0;
-  if (interest & ZOOKEEPER_READ)
-    ev.events |= EPOLLIN;
+  while (1) {
+    /* don't sleep past the next interests check */
+    next_check = run_interests(&r->sched, 0);
+    wait_time = r->params->wait_time < next_check ?
+      r->params->wait_time : next_check;
 
-  if (interest & ZOOKEEPER_WRITE)
-    ev.events |= EPOLLOUT;
+    ready = g_backend->wait(r->ps, evlist, wait_time);
 
-  if (epoll_ctl(g_epfd, EPOLL_CTL_MOD, fd, &ev) == -1) {
-    saved = errno;
-    if (saved != ENOENT)
-      error(EXIT_SYSTEM_CALL,
-            "epoll_ctl_mod failed with: %s ",
-            strerror(saved));
+    ready_at = now_nsecs();
 
-    /* New FD, lets add it */
-    if (epoll_ctl(g_epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
-      saved = errno;
-      error(EXIT_SYSTEM_CALL,
-            "epoll_ctl_add failed with: %s",
-            strerror(saved));
+    for (j=0; j < ready; j++) {
+      if (evlist[j].gone)
+        registration_gone(evlist[j].conn, 0);
+
+      if (!(evlist[j].events & (EPOLLIN|EPOLLOUT)))
+        continue; /* errors are dealt with via zookeeper_interest() */
+
+      events = 0;
+      if (evlist[j].events & EPOLLIN)
+        events |= ZOOKEEPER_READ;
+      if (evlist[j].events & EPOLLOUT)
+        events |= ZOOKEEPER_WRITE;
+
+      conn = evlist[j].conn;
+      zh = __atomic_load_n(&conn->zh, __ATOMIC_ACQUIRE);
+      if (!zh)
+        continue;
+
+      record_event(ready_at);
+      zookeeper_process(zh, events);
+      if (g_epoll_mode != EPOLL_MODE_LEVEL)
+        rearm(conn);
+      mark_dirty(conn);
     }
   }
+
+  return NULL;
 }
 
 static void * create_clients(void *data)
@@ -309,11 +1921,15 @@ static void * create_clients(void *data)
     context->data = params->new_watcher_data();
     context->reset_watcher_data = params->reset_watcher_data;
 
-    pthread_mutex_lock(&g_zhs[j].lock);
+    /* reactors own their clients, create_client() publishes them */
+    if (params->engine == ENGINE_THREADED)
+      pthread_mutex_lock(&g_zhs[j].lock);
     g_zhs[j].server = params->servername;
     g_zhs[j].session_timeout = params->zk_session_timeout;
     create_client(&g_zhs[j], context);
-    pthread_mutex_unlock(&g_zhs[j].lock);
+    if (params->engine == ENGINE_THREADED)
+      pthread_mutex_unlock(&g_zhs[j].lock);
+    g_backend->flush(g_zhs[j].ps);
 
     if (after > 0 && j > 0 && j % after == 0) {
       info("Sleeping for %d secs after having created %d clients",
@@ -328,32 +1944,70 @@ static void * create_clients(void *data)
   return NULL;
 }
 
+/*
+ * Connections that didn't fit in the queue (even after waiting) get their
+ * queued flag back, so the next epoll_wait() reports them again. Unless
+ * they need re-arming (oneshot & edge), which is left to the interests
+ * thread.
+ */
+static void requeue_later(connection **conns, int count)
+{
+  int j;
+
+  for (j=0; j < count; j++) {
+    pthread_mutex_lock(&conns[j]->lock);
+    conns[j]->queued = 0;
+    if (g_epoll_mode != EPOLL_MODE_LEVEL) {
+      unclaim(conns[j]);
+      conns[j]->reg_events = 0;
+    }
+    pthread_mutex_unlock(&conns[j]->lock);
+
+    if (g_epoll_mode != EPOLL_MODE_LEVEL)
+      mark_dirty(conns[j]);
+  }
+}
+
 static void *poll_clients(void *data)
 {
-  int ready, j, saved;
+  int ready, j, added, w, active;
   int events;
-  struct epoll_event *evlist;
-  queue_t queue = (queue_t)data;
+  uint64_t ready_at;
+  poll_event *evlist;
+  connection ***batches; /* one per worker */
+  int *counts;
+  worker_pool *pool = (worker_pool *)data;
   connection *conn;
-  run_params *params = (run_params *)queue_get_user_data(queue);
+  run_params *params = pool->params;
   int max_events = params->max_events;
   int wait_time = params->wait_time;
 
-  evlist = (struct epoll_event *)safe_alloc(
-      sizeof(struct epoll_event) * max_events);
+  evlist = (poll_event *)safe_alloc(sizeof(poll_event) * max_events);
+  batches = (connection ***)safe_alloc(sizeof(connection **) * pool->count);
+  counts = (int *)safe_alloc(sizeof(int) * pool->count);
+  for (w=0; w < pool->count; w++)
+    batches[w] = (connection **)safe_alloc(sizeof(connection *) * max_events);
 
   while (1) {
-    ready = epoll_wait(g_epfd, evlist, max_events, wait_time);
-    if (ready == -1) {
-      if (errno == EINTR)
-        continue;
+    __atomic_store_n(&g_stats.poller_cpu, thread_cpu_nsecs(), __ATOMIC_RELAXED);
 
-      saved = errno;
-      error(EXIT_SYSTEM_CALL, "epoll_wait failed with: %s", strerror(saved));
-    }
+    ready = g_backend->wait(g_ps, evlist, wait_time);
+
+    ready_at = now_nsecs();
+
+    __atomic_add_fetch(&g_stats.poller_wakeups, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&g_stats.poller_events, ready, __ATOMIC_RELAXED);
 
     /* Go over file descriptors that are ready */
+    for (w=0; w < pool->count; w++)
+      counts[w] = 0;
+
+    active = __atomic_load_n(&pool->active, __ATOMIC_ACQUIRE);
+
     for (j=0; j < ready; j++) {
+      if (evlist[j].gone)
+        registration_gone(evlist[j].conn, 1);
+
       events = 0;
       if (evlist[j].events & (EPOLLIN|EPOLLOUT)) {
         if (evlist[j].events & EPOLLIN)
@@ -361,14 +2015,38 @@ static void *poll_clients(void *data)
         if (evlist[j].events & EPOLLOUT)
           events |= ZOOKEEPER_WRITE;
 
-        conn = (connection *)evlist[j].data.ptr;
+        conn = evlist[j].conn;
+
+        /*
+         * It's disabled until re-armed, but the interests thread might've
+         * re-armed it while it was being claimed. Whoever claims it first
+         * gets it, and the worker's rearm() reports what's left.
+         */
+        if (g_epoll_mode == EPOLL_MODE_ONESHOT) {
+          if (!claim(conn))
+            continue;
+
+          pthread_mutex_lock(&conn->lock);
+          conn->events = events;
+          conn->ready_at = ready_at;
+          pthread_mutex_unlock(&conn->lock);
+
+          w = conn->home % active;
+          batches[w][counts[w]++] = conn;
+          continue;
+        }
 
         pthread_mutex_lock(&conn->lock);
 
         if (!conn->queued) {
           conn->events = events;
+          conn->ready_at = ready_at;
           conn->queued = 1;
-          queue_add(queue, (void *)conn);
+          w = conn->home % active;
+          batches[w][counts[w]++] = conn;
+        } else {
+          /* edge: it'll be re-armed (and reported again) after processing */
+          conn->events |= events;
         }
 
         pthread_mutex_unlock(&conn->lock);
@@ -376,10 +2054,21 @@ static void *poll_clients(void *data)
       } else if (evlist[j].events & (EPOLLHUP | EPOLLERR | EPOLLRDHUP)) {
         /* Invalid FDs will be removed when zookeeper_interest() indicates
          * they are not valid anymore */
-      } else {
+      } else if (!evlist[j].gone) {
         warn("Unknown events: %d\n", evlist[j].events);
       }
     }
+
+    /* hand each worker its whole batch at once */
+    for (w=0; w < pool->count; w++) {
+      if (!counts[w])
+        continue;
+
+      added = queue_add_many(pool->workers[w].queue,
+                             (void **)batches[w],
+                             counts[w]);
+      requeue_later(batches[w] + added, counts[w] - added);
+    }
   }
 
   return NULL;
@@ -387,11 +2076,13 @@ static void *poll_clients(void *data)
 
 static void create_client(connection *conn, void *context)
 {
-  int fd, rc, interest, saved;
-  struct epoll_event ev;
+  int fd, rc, interest;
   struct timeval tv;
   zhandle_t *zh;
 
+  /* until the watcher sees it connected */
+  conn->connect_started = now_nsecs();
+
   /* try until we succeed */
   while (1) {
     zh = zookeeper_init(conn->server,
@@ -407,6 +2098,7 @@ static void create_client(connection *conn, void *context)
 
     if (rc == ZCONNECTIONLOSS) {
       /* busy server perhaps? lets try again */
+      __atomic_add_fetch(&g_stats.connect_retries, 1, __ATOMIC_RELAXED);
       zookeeper_close(zh);
       continue;
     }
@@ -414,19 +2106,193 @@ static void create_client(connection *conn, void *context)
     error(EXIT_ZOOKEEPER_CALL, "zookeeper_interest failed with rc=%d\n", rc);
   }
 
-  ev.events = 0;
-  if (interest & ZOOKEEPER_READ)
-    ev.events |= EPOLLIN;
-  if (interest & ZOOKEEPER_WRITE)
-    ev.events |= EPOLLOUT;
-  ev.data.ptr = conn;
+  /* the old session's fd (if any) was closed by zookeeper_close() */
+  forget_registration(conn);
+  update_interest(conn, rc, fd, interest, zoo_state(zh));
 
-  if (epoll_ctl(g_epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
-    saved = errno;
-    error(EXIT_SYSTEM_CALL, "epoll_ctl_add failed with: %s", strerror(saved));
+  __atomic_store_n(&conn->zh, zh, __ATOMIC_RELEASE);
+
+  /* so it gets its first interests check (and timer) */
+  mark_dirty(conn);
+}
+
+static void fanout_written(int rc, const void *data)
+{
+  fanout_writer *w = (fanout_writer *)data;
+  const char *name = strrchr(w->next, '/') + 1;
+
+  record_latency(g_write_op,
+                 strtoull(name + strlen(CLIENTS_FANOUT_PREFIX), NULL, 10));
+
+  if (rc == ZOK) {
+    strcpy(w->path, w->next);
+  } else {
+    clients_record_error(g_write_op);
+
+    /* i.e.: the old child went away with an expired session */
+    warn("Fan-out write failed with rc=%d", rc);
+    w->path[0] = '\0';
+  }
+
+  __atomic_store_n(&w->pending, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Replaces the fan-out child through the first client, which is shared
+ * with the workers (hence the lock), so it needs the threaded engine.
+ */
+static void *write_fanout(void *data)
+{
+  int rc, count;
+  const char *sep;
+  zhandle_t *zh;
+  run_params *params = (run_params *)data;
+  connection *conn = &g_zhs[0];
+  fanout_writer *w = (fanout_writer *)safe_alloc(sizeof(fanout_writer));
+
+  sep = params->path[strlen(params->path) - 1] == '/' ? "" : "/";
+
+  while (1) {
+    usleep(params->write_interval * 1000);
+
+    if (__atomic_load_n(&w->pending, __ATOMIC_ACQUIRE))
+      continue;
+
+    /* the session can't be replaced (see watcher()) while we hold this */
+    pthread_mutex_lock(&conn->lock);
+
+    zh = __atomic_load_n(&conn->zh, __ATOMIC_ACQUIRE);
+    if (!zh || zoo_state(zh) != ZOO_CONNECTED_STATE) {
+      pthread_mutex_unlock(&conn->lock);
+      continue;
+    }
+
+    snprintf(w->next,
+             sizeof(w->next),
+             "%s%s" CLIENTS_FANOUT_PREFIX "%lu",
+             params->path,
+             sep,
+             now_nsecs());
+
+    count = 0;
+    if (w->path[0])
+      zoo_delete_op_init(&w->ops[count++], w->path, -1);
+    zoo_create_op_init(&w->ops[count++],
+                       w->next,
+                       "",
+                       0,
+                       &ZOO_OPEN_ACL_UNSAFE,
+                       ZOO_EPHEMERAL,
+                       w->created,
+                       sizeof(w->created));
+
+    w->pending = 1;
+    rc = zoo_amulti(zh, count, w->ops, w->results, fanout_written, w);
+    if (rc) {
+      warn("Failed to write the fan-out child, rc=%d", rc);
+      w->pending = 0;
+    }
+
+    pthread_mutex_unlock(&conn->lock);
+
+    /* it has something to send now */
+    mark_dirty(conn);
+  }
+
+  return NULL;
+}
+
+void clients_set_issuer(int (*issue)(zhandle_t *, session_context *))
+{
+  g_issue = issue;
+}
+
+void clients_add_options(const clients_option *options)
+{
+  g_options = options;
+  for (g_num_options=0; options[g_num_options].name; g_num_options++)
+    ;
+}
+
+/*
+ * Like write_fanout(), it shares the connection with the workers. due is
+ * when the op should have been sent, see clients_op_start().
+ */
+static void issue_op(connection *conn, uint64_t due)
+{
+  zhandle_t *zh;
+  int rc = -1;
+
+  t_intended = due;
+  t_scheduled = NULL;
+
+  /*
+   * The session can't be replaced (see watcher()) while we hold this. If
+   * it's (re)connecting, the library queues the op until it's connected,
+   * so it completes late rather than disappearing from the histograms.
+   */
+  pthread_mutex_lock(&conn->lock);
+  zh = __atomic_load_n(&conn->zh, __ATOMIC_ACQUIRE);
+  if (zh)
+    rc = g_issue(zh, (session_context *)zoo_get_context(zh));
+  pthread_mutex_unlock(&conn->lock);
+
+  t_intended = 0;
+
+  if (rc) {
+    /* no completion will free it */
+    free(t_scheduled);
+
+    __atomic_add_fetch(&g_stats.issue_skipped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  __atomic_add_fetch(&g_stats.issued, 1, __ATOMIC_RELAXED);
+
+  /* it has something to send now */
+  mark_dirty(conn);
+}
+
+static void *issue_ops(void *data)
+{
+  issuer *self = (issuer *)data;
+  run_params *params = self->params;
+  uint64_t now = now_nsecs(), interval;
+  unsigned seed = now ^ self->id;
+  wheel_timer *t, *next;
+  connection *conn;
+  wheel_t w;
+  int j;
+
+  /* every session does its share of the whole --rate */
+  interval = (uint64_t)params->num_procs * params->num_clients * 1000000000ULL /
+    params->rate;
+  if (!interval)
+    interval = 1;
+
+  w = wheel_new(ISSUER_WHEEL_SLOTS, ISSUER_TICK_US * 1000ULL, now);
+
+  /* random phases, so sessions don't all fire on the same tick */
+  for (j=self->id; j < params->num_clients; j += params->num_issuers)
+    wheel_add(w,
+              &g_zhs[j].issue_timer,
+              now + (uint64_t)(interval * (rand_r(&seed) / (RAND_MAX + 1.0))));
+
+  while (1) {
+    usleep(ISSUER_TICK_US);
+
+    for (t = wheel_expire(w, now_nsecs()); t; t = next) {
+      next = t->next;
+      conn = (connection *)((char *)t - offsetof(connection, issue_timer));
+
+      issue_op(conn, t->due);
+
+      /* when it was due, not now: if we fell behind, it catches up */
+      wheel_add(w, t, t->due + interval);
+    }
   }
 
-  conn->zh = zh;
+  return NULL;
 }
 
 /* no locks are taken here, those happen from wherever zookeeper_process
@@ -434,14 +2300,35 @@ static void create_client(connection *conn, void *context)
 static void watcher(zhandle_t *zzh, int type, int state, const char *path, void *ctxt)
 {
   session_context *context = (session_context *)zoo_get_context(zzh);
+  connection *conn = &g_zhs[context->pos];
+  uint64_t started;
+  int connected;
+
+  if (type == ZOO_SESSION_EVENT) {
+    connected = state == ZOO_CONNECTED_STATE || state == ZOO_CONNECTED_RO_STATE;
+    if (connected != conn->connected) {
+      __atomic_add_fetch(&g_stats.connected, connected ? 1 : -1, __ATOMIC_RELAXED);
+      conn->connected = connected;
+    }
+
+    /* the first time since zookeeper_init(), reconnects don't count */
+    started = connected ?
+      __atomic_exchange_n(&conn->connect_started, 0, __ATOMIC_RELAXED) : 0;
+    if (started) {
+      record_latency(g_connect_op, started);
+      __atomic_add_fetch(&g_stats.sessions, 1, __ATOMIC_RELAXED);
+    }
+  }
 
   if (state == ZOO_EXPIRED_SESSION_STATE) {
+    __atomic_add_fetch(&g_stats.expirations, 1, __ATOMIC_RELAXED);
+
     /* Cleanup the expired session */
     zookeeper_close(zzh);
 
     /* create a new session */
     context->reset_watcher_data(context->data);
-    create_client(&g_zhs[context->pos], context);
+    create_client(conn, context);
   } else {
     /* dispatch the event to the other watcher */
     context->watcher(zzh, type, state, path);
@@ -450,8 +2337,8 @@ static void watcher(zhandle_t *zzh, int type, int state, const char *path, void
 
 static void parse_argv(int argc, const char **argv, run_params *params)
 {
-  const char *sopts = "+he:c:p:w:s:u:P:N:n:W:";
-  static const struct option options[] = {
+  const char *sopts = "+he:c:p:w:s:u:P:N:n:W:m:x:B:q:T:i:I:r:R:d:o:E:M:b:";
+  static const struct option base_options[] = {
     { "help",                 no_argument,       NULL, 'h' },
     { "max-events",           required_argument, NULL, 'e' },
     { "num-clients",          required_argument, NULL, 'c' },
@@ -463,13 +2350,38 @@ static void parse_argv(int argc, const char **argv, run_params *params)
     { "sleep-in-between",     required_argument, NULL, 'n' },
     { "paths",                required_argument, NULL, 'P' },
     { "num-workers",          required_argument, NULL, 'W' },
+    { "min-workers",          required_argument, NULL, 'm' },
+    { "max-workers",          required_argument, NULL, 'x' },
+    { "worker-batch",         required_argument, NULL, 'B' },
+    { "queue-size",           required_argument, NULL, 'q' },
+    { "queue-timeout",        required_argument, NULL, 'T' },
+    { "stats-interval",       required_argument, NULL, 'i' },
+    { "write-interval",       required_argument, NULL, 'I' },
+    { "rate",                 required_argument, NULL, 'r' },
+    { "issuers",              required_argument, NULL, 'R' },
+    { "duration",             required_argument, NULL, 'd' },
+    { "results-file",         required_argument, NULL, 'o' },
+    { "engine",               required_argument, NULL, 'E' },
+    { "epoll-mode",           required_argument, NULL, 'M' },
+    { "poll-backend",         required_argument, NULL, 'b' },
     {}
   };
-  int c;
+  int c, j, num_base = sizeof(base_options) / sizeof(base_options[0]) - 1;
+  struct option *options;
 
   assert(argc >= 0);
   assert(argv);
 
+  /* the program's own options go after ours (and the {} after them) */
+  options = (struct option *)safe_alloc(sizeof(struct option) *
+                                        (num_base + g_num_options + 1));
+  memcpy(options, base_options, sizeof(struct option) * num_base);
+  for (j=0; j < g_num_options; j++) {
+    options[num_base + j].name = g_options[j].name;
+    options[num_base + j].has_arg = required_argument;
+    options[num_base + j].val = EXTRA_OPTION_BASE + j;
+  }
+
   while ((c = getopt_long(argc, (char **)argv, sopts, options, NULL)) >= 0) {
     switch (c) {
     case 'h':
@@ -506,15 +2418,93 @@ static void parse_argv(int argc, const char **argv, run_params *params)
     case 'W':
       params->num_workers =
         positive_int(optarg, "number of workers for zookeeper_process");
+      if (!params->num_workers)
+        error(EXIT_BAD_PARAMS, "Bad param for number of workers: 0");
+      break;
+    case 'm':
+      params->min_workers = positive_int(optarg, "min number of workers");
+      if (!params->min_workers)
+        error(EXIT_BAD_PARAMS, "Bad param for min workers: 0");
+      break;
+    case 'x':
+      params->max_workers = positive_int(optarg, "max number of workers");
+      if (!params->max_workers)
+        error(EXIT_BAD_PARAMS, "Bad param for max workers: 0");
+      break;
+    case 'B':
+      params->worker_batch =
+        positive_int(optarg, "max connections per worker wakeup");
+      if (!params->worker_batch)
+        error(EXIT_BAD_PARAMS, "Bad param for worker batch: 0");
+      break;
+    case 'q':
+      params->queue_size = positive_int(optarg, "queue size");
+      break;
+    case 'T':
+      params->queue_timeout = positive_int(optarg, "queue timeout");
+      break;
+    case 'i':
+      params->stats_interval = positive_int(optarg, "stats interval");
+      if (!params->stats_interval)
+        error(EXIT_BAD_PARAMS, "Bad param for stats interval: 0");
+      break;
+    case 'I':
+      params->write_interval = positive_int(optarg, "write interval");
+      break;
+    case 'r':
+      params->rate = positive_int(optarg, "rate");
+      break;
+    case 'R':
+      params->num_issuers = positive_int(optarg, "num issuers");
+      if (!params->num_issuers)
+        error(EXIT_BAD_PARAMS, "Bad param for num issuers: 0");
+      break;
+    case 'd':
+      params->duration = positive_int(optarg, "duration");
+      break;
+    case 'o':
+      params->results_file = safe_strdup(optarg);
+      break;
+    case 'E':
+      if (!strcmp(optarg, "threaded"))
+        params->engine = ENGINE_THREADED;
+      else if (!strcmp(optarg, "reactor"))
+        params->engine = ENGINE_REACTOR;
+      else
+        error(EXIT_BAD_PARAMS, "Bad param for engine: %s", optarg);
+      break;
+    case 'M':
+      if (!strcmp(optarg, "level"))
+        params->epoll_mode = EPOLL_MODE_LEVEL;
+      else if (!strcmp(optarg, "oneshot"))
+        params->epoll_mode = EPOLL_MODE_ONESHOT;
+      else if (!strcmp(optarg, "edge"))
+        params->epoll_mode = EPOLL_MODE_EDGE;
+      else
+        error(EXIT_BAD_PARAMS, "Bad param for epoll mode: %s", optarg);
+      break;
+    case 'b':
+      if (!strcmp(optarg, "epoll"))
+        params->poll_backend = POLL_BACKEND_EPOLL;
+      else if (!strcmp(optarg, "io_uring"))
+        params->poll_backend = POLL_BACKEND_URING;
+      else
+        error(EXIT_BAD_PARAMS, "Bad param for poll backend: %s", optarg);
       break;
     case '?':
       help();
       exit(1);
     default:
+      if (c >= EXTRA_OPTION_BASE && c < EXTRA_OPTION_BASE + g_num_options) {
+        g_options[c - EXTRA_OPTION_BASE].parse(optarg);
+        break;
+      }
       error(EXIT_BAD_PARAMS, "Bad option %c\n", (char)c);
     }
   }
 
+  free(options);
+
 
   if (argc <= optind)
     error(EXIT_BAD_PARAMS, "Give me the hostname");
@@ -525,6 +2515,45 @@ static void parse_argv(int argc, const char **argv, run_params *params)
   if (!params->username_prefix)
     params->username_prefix = DEFAULT_USERNAME_PREFIX;
 
+  if (params->write_interval && params->engine == ENGINE_REACTOR)
+    error(EXIT_BAD_PARAMS, "The writer needs --engine threaded");
+
+  if (params->rate && !g_issue)
+    error(EXIT_BAD_PARAMS, "There are no ops to issue at a --rate");
+  if (!params->rate && g_issue)
+    error(EXIT_BAD_PARAMS, "Give me a --rate to issue ops at");
+  if (params->rate && params->engine == ENGINE_REACTOR)
+    error(EXIT_BAD_PARAMS, "Issuing at a --rate needs --engine threaded");
+  if (params->num_issuers > params->num_clients)
+    params->num_issuers = params->num_clients ? params->num_clients : 1;
+
+  /* a fixed # of workers, unless bounds were given */
+  if (!params->min_workers)
+    params->min_workers = params->max_workers &&
+      params->max_workers < params->num_workers ?
+      params->max_workers : params->num_workers;
+  if (!params->max_workers)
+    params->max_workers = params->min_workers > params->num_workers ?
+      params->min_workers : params->num_workers;
+  if (params->min_workers > params->max_workers)
+    error(EXIT_BAD_PARAMS,
+          "Bad params for workers: min %d > max %d",
+          params->min_workers,
+          params->max_workers);
+
+  /* it's where the workers start from */
+  if (params->num_workers < params->min_workers)
+    params->num_workers = params->min_workers;
+  if (params->num_workers > params->max_workers)
+    params->num_workers = params->max_workers;
+
+  /* multishot polls are edge-triggered, for all intents & purposes */
+  if (params->poll_backend == POLL_BACKEND_URING &&
+      params->epoll_mode != EPOLL_MODE_EDGE) {
+    info("io_uring polls are multishot, switching to --epoll-mode edge");
+    params->epoll_mode = EPOLL_MODE_EDGE;
+  }
+
   info("Running with:");
   info("server = %s", params->servername);
   info("username_prefix = %s", params->username_prefix);
@@ -536,11 +2565,32 @@ static void parse_argv(int argc, const char **argv, run_params *params)
   info("zk_session_timeout = %d", params->zk_session_timeout);
   info("sleep_after_clients = %d", params->sleep_after_clients);
   info("sleep_inbetween_clients = %d", params->sleep_inbetween_clients);
+  info("engine = %s",
+       params->engine == ENGINE_REACTOR ? "reactor" : "threaded");
+  info("poll_backend = %s",
+       params->poll_backend == POLL_BACKEND_URING ? "io_uring" : "epoll");
+  info("epoll_mode = %s",
+       params->epoll_mode == EPOLL_MODE_ONESHOT ? "oneshot" :
+       params->epoll_mode == EPOLL_MODE_EDGE ? "edge" : "level");
   info("num_workers = %d", params->num_workers);
+  info("min_workers = %d", params->min_workers);
+  info("max_workers = %d", params->max_workers);
+  info("worker_batch = %d", params->worker_batch);
+  info("queue_size = %d", params->queue_size);
+  info("queue_timeout = %d", params->queue_timeout);
+  info("stats_interval = %d", params->stats_interval);
+  info("write_interval = %d", params->write_interval);
+  info("rate = %d", params->rate);
+  info("num_issuers = %d", params->num_issuers);
+  info("duration = %d", params->duration);
+  info("results_file = %s", params->results_file ? params->results_file : "none");
 }
 
 static void help(void)
 {
+  const clients_option *opt;
+  int j;
+
   printf("%s [OPTIONS...] {ZK_SERVER}\n\n"
          "Create and maintain a given number of ZK clients.\n\n"
          "  --help,                -h        Show this help\n"
@@ -552,7 +2602,30 @@ static void help(void)
          "  --switch-uid,          -u        Switch UID after forking\n"
          "  --sleep-after-clients, -N        Sleep after starting N clients\n"
          "  --sleep-in-between,    -n        Seconds to sleep inbetween N started clients\n"
-         "  --num-workers,         -W        # of workers to call zookeeper_process() from\n"
+         "  --engine,              -E        threaded (poller, queue & workers) or reactor\n"
+         "  --epoll-mode,          -M        level (default), oneshot or edge\n"
+         "  --poll-backend,        -b        epoll (default) or io_uring\n"
+         "  --num-workers,         -W        # of workers (or reactors) to call zookeeper_process() from\n"
+         "  --min-workers,         -m        Fewest workers to shrink down to, when idle (threaded only)\n"
+         "  --max-workers,         -x        Most workers to grow up to, when backed up (threaded only)\n"
+         "  --worker-batch,        -B        Max # of connections a worker takes per wakeup\n"
+         "  --queue-size,          -q        Size of the work queues, all together (default: num clients)\n"
+         "  --queue-timeout,       -T        Millisecs to wait for room in a full work queue\n"
+         "  --stats-interval,      -i        Seconds between stats reports\n"
+         "  --write-interval,      -I        Millisecs between fan-out writes from the 1st client (default: no writes)\n"
+         "  --rate,                -r        Ops/sec to issue across all procs, open-loop (default: none)\n"
+         "  --issuers,             -R        # of threads issuing them, per proc\n"
+         "  --duration,            -d        Seconds to run for (default: until interrupted)\n"
+         "  --results-file,        -o        Append JSON lines with per-second & final results to this file\n"
          "  --paths,               -P        Paths\n",
          program_invocation_short_name);
+
+  for (j=0; j < g_num_options; j++) {
+    opt = &g_options[j];
+    printf("  --%s,%*s%s\n",
+           opt->name,
+           (int)(30 - strlen(opt->name)),
+           "",
+           opt->help);
+  }
 }
@@ -1,8 +1,12 @@
 #ifndef _CLIENTS_H_
 #define _CLIENTS_H_
 
+#include <stdint.h>
 #include <zookeeper.h>
 
+/* the writer (see --write-interval) names children <prefix><now_nsecs()> */
+#define CLIENTS_FANOUT_PREFIX "fanout-"
+
 typedef struct {
   void *data;
   int pos;
@@ -12,6 +16,39 @@ typedef struct {
 } session_context;
 
 
+/*
+ * latencies of async ops, see clients_register_op(). With --rate, the ops
+ * registered before clients_run() also get an <op>_corrected histogram:
+ * their latency from when the op was due, not from when it was sent.
+ */
+#define CLIENTS_MAX_OPS 32
+
+int clients_register_op(const char *name);
+const void * clients_op_start(void);
+void clients_record_latency(int op, const void *start);
+void clients_record_value(int op, uint64_t nsecs);
+void clients_record_error(int op);
+void clients_record_missed(int op);
+
+/*
+ * Open-loop load (see --rate): issue() is called for every session on a
+ * fixed schedule, whether or not its previous op completed (or the session
+ * is connected), from an issuer thread holding the session's lock. It
+ * returns the rc of the zoo_a*() call it made, and if that failed it also
+ * passes the op to clients_record_missed(). Set it before clients_run().
+ */
+void clients_set_issuer(int (*issue)(zhandle_t *, session_context *));
+
+/* extra --options for a program, they all take an argument */
+typedef struct {
+  const char *name;
+  const char *help;
+  void (*parse)(const char *arg);
+} clients_option;
+
+/* a {}-terminated array, before clients_run() */
+void clients_add_options(const clients_option *options);
+
 void clients_run(int,
                  const char **,
                  void (*)(zhandle_t *, int, int, const char *),
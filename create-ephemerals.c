@@ -10,6 +10,8 @@ typedef struct {
   char created;
 } watcher_data;
 
+static int create_op;
+
 static void *new_watcher_data(void)
 {
   watcher_data *wdata =
@@ -25,6 +27,10 @@ static void reset_watcher_data(void *data)
 
 static void create_cb(int rc, const char *path, const void *data)
 {
+  clients_record_latency(create_op, data);
+  if (rc)
+    clients_record_error(create_op);
+
   if (!rc)
     info("Created %s", path);
   else
@@ -54,7 +60,7 @@ void my_watcher(zhandle_t *zzh, int type, int state, const char *path)
                        &ZOO_OPEN_ACL_UNSAFE,
                        flags,
                        create_cb,
-                       NULL);
+                       clients_op_start());
       if (rc)
         warn("Failed to create path");
       else
@@ -65,6 +71,8 @@ void my_watcher(zhandle_t *zzh, int type, int state, const char *path)
 
 int main(int argc, const char **argv)
 {
+  create_op = clients_register_op("create");
+
   clients_run(argc,
               argv,
               &my_watcher,
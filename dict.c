@@ -1,5 +1,28 @@
+
 /*
- * a simple, fixed size & thread-safe, dictionary
+ * a simple, growing & thread-safe, dictionary
+ *
+ * It's a flat open-addressing table with Robin Hood probing: an entry
+ * being placed takes the slot of any entry that's closer to its home
+ * slot, so probe lengths stay short and similar, and a lookup can stop
+ * as soon as it sees an entry closer to home than the key would be.
+ * Removals shift the following entries back, so there are no tombstones.
+ *
+ * When it gets too full (or too empty after removals) a new table is
+ * allocated and every operation moves a few entries over, so there's
+ * never one long pause to rehash everything. Meanwhile, lookups check
+ * every table and new entries only go to the new one.
+ *
+ * With dict_use_concurrent_reads(), dict_get() doesn't take the lock:
+ * writers make d->seq odd while they change anything (a seqlock), and
+ * lookups that overlapped with that are retried. Tables replaced by a
+ * rehash are only freed once the lookups that might still be walking
+ * them are done, tracked with per-epoch reader counts (like SRCU).
+ *
+ * Iterators (see dict_iter_init()) are just a position in the tables, and
+ * while there's any, entries aren't moved from one table to another. If
+ * the new table fills up meanwhile, yet another one is started: there can
+ * be a few of them, until the iterators are done and the rehash catches up.
  */
 
 #ifndef _GNU_SOURCE
@@ -7,6 +30,8 @@
 #endif
 
 #include <assert.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,10 +40,27 @@
 #include "list.h"
 #include "util.h"
 
-#define DICT_KEY_COLLISIONS     10
-
-#define keys_for_each_list(dict, i, list)                \
-  for (i = 0, list = dict->keys[0]; i < dict->size; i++, list = dict->keys[i])
+/* it grows past 4/5 full, to twice the slots (i.e.: 2/5 full) */
+#define DICT_GROW_NUM       4
+#define DICT_GROW_DEN       5
+/* and shrinks below 1/8 full, to 2/5 full again */
+#define DICT_SHRINK_DEN     8
+#define DICT_MIN_SLOTS      8
+/* moved per operation while rehashing, and slots looked at for them */
+#define DICT_REHASH_ENTRIES 8
+#define DICT_REHASH_SLOTS   64
+/* lock-free lookups retried this many times before taking the lock */
+#define DICT_READ_TRIES     8
+/* per-epoch reader counts, spread out so readers don't share lines */
+#define DICT_READER_STRIPES 16
+#define DICT_CACHE_LINE     64
+
+struct dict_readers {
+  long count[2];
+} __attribute__((aligned(DICT_CACHE_LINE)));
+
+static int g_reader_stripes;
+static __thread int t_reader_stripe = -1;
 
 
 void dict_init(dict_t d)
@@ -32,26 +74,122 @@ static int default_key_comparator(void *a, void *b)
 }
 
 
-/* Note:
- *  the step)_factor size usually is the number of bytes between each key
+/*
+ * wyhash (final version 4, public domain, by Wang Yi): 64x64->128 bit
+ * multiplies folded back into 64 bits. Keys longer than 48 bytes go three
+ * independent 16-byte lanes at a time, so the multiplies overlap.
  */
-static int default_hash_func(void *key, int size)
+static const uint64_t g_wyp[4] = {
+  0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL,
+  0x4b33a62ed433d4a3ULL, 0x4d5a2da51de1aa47ULL
+};
+
+static inline uint64_t wymix(uint64_t a, uint64_t b)
+{
+  __uint128_t r = (__uint128_t)a * b;
+  return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+static inline uint64_t wyr8(const uint8_t *p)
+{
+  uint64_t v;
+  memcpy(&v, p, 8);
+  return v;
+}
+
+static inline uint64_t wyr4(const uint8_t *p)
+{
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+static inline uint64_t wyr3(const uint8_t *p, size_t k)
+{
+  return ((uint64_t)p[0] << 16) | ((uint64_t)p[k >> 1] << 8) | p[k - 1];
+}
+
+uint64_t dict_hash_bytes(const void *data, size_t len)
+{
+  const uint8_t *p = (const uint8_t *)data;
+  uint64_t seed = wymix(g_wyp[0], g_wyp[1]), see1, see2, a, b;
+  __uint128_t r;
+  size_t i = len;
+
+  if (len <= 16) {
+    if (len >= 4) {
+      a = (wyr4(p) << 32) | wyr4(p + ((len >> 3) << 2));
+      b = (wyr4(p + len - 4) << 32) | wyr4(p + len - 4 - ((len >> 3) << 2));
+    } else if (len > 0) {
+      a = wyr3(p, len);
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    if (i > 48) {
+      see1 = see2 = seed;
+      do {
+        seed = wymix(wyr8(p) ^ g_wyp[1], wyr8(p + 8) ^ seed);
+        see1 = wymix(wyr8(p + 16) ^ g_wyp[2], wyr8(p + 24) ^ see1);
+        see2 = wymix(wyr8(p + 32) ^ g_wyp[3], wyr8(p + 40) ^ see2);
+        p += 48;
+        i -= 48;
+      } while (i > 48);
+      seed ^= see1 ^ see2;
+    }
+
+    while (i > 16) {
+      seed = wymix(wyr8(p) ^ g_wyp[1], wyr8(p + 8) ^ seed);
+      p += 16;
+      i -= 16;
+    }
+
+    a = wyr8(p + i - 16);
+    b = wyr8(p + i - 8);
+  }
+
+  a ^= g_wyp[1];
+  b ^= seed;
+  r = (__uint128_t)a * b;
+  return wymix((uint64_t)r ^ g_wyp[0] ^ len, (uint64_t)(r >> 64) ^ g_wyp[1]);
+}
+
+/* pointers are mostly aligned & close together, mix all the bits */
+static uint64_t default_hash_func(void *key)
+{
+  return wymix((uint64_t)(uintptr_t)key ^ g_wyp[0], g_wyp[1]);
+}
+
+/* the fewest slots for count entries, without growing right away */
+static unsigned slots_for(int count)
+{
+  unsigned slots = DICT_MIN_SLOTS;
+
+  while ((uint64_t)slots * DICT_GROW_NUM / DICT_GROW_DEN < (unsigned)count)
+    slots <<= 1;
+
+  return slots;
+}
+
+static void table_init(dict_table *t, unsigned slots)
 {
-  return (int)(((long)key / 32) % size);
+  /* not safe_alloc(): big tables come zeroed from mmap(), and clearing
+   * them up front would be the very pause rehashing gradually avoids */
+  t->entries = (dict_key_value_t)calloc(slots, sizeof(dict_key_value));
+  if (!t->entries)
+    error(EXIT_SYSTEM_CALL, "Failed to allocate memory");
+  t->mask = slots - 1;
+  t->count = 0;
 }
 
+/* size is how many entries it should take before it first grows */
 dict_t dict_new(int size)
 {
-  int i;
   dict_t d = safe_alloc(sizeof(dict));
 
-  /* init lists */
-  d->keys = (list_t *)safe_alloc(sizeof(list_t) * size);
-  for (i=0; i < size; i++)
-    d->keys[i] = list_new(DICT_KEY_COLLISIONS);
-
-  d->pool = pool_new(sizeof(dict_key_value) * size, sizeof(dict_key_value));
-  d->size = size;
+  d->min_slots = slots_for(size);
+  table_init(&d->tables[0], d->min_slots);
   d->key_comparator = &default_key_comparator;
   d->hash_func = &default_hash_func;
   dict_init(d);
@@ -63,7 +201,7 @@ void dict_set_key_comparator(dict_t d, int (*comparator)(void *, void *))
   d->key_comparator = comparator;
 }
 
-void dict_set_hash_func(dict_t d, int (*hash_func)(void *, int))
+void dict_set_hash_func(dict_t d, uint64_t (*hash_func)(void *))
 {
   d->hash_func = hash_func;
 }
@@ -73,17 +211,10 @@ static int strings_cmp(void *a, void *b)
   return strcmp((const char *)a, (const char *)b);
 }
 
-static int strings_hash(void *key, int size)
+static uint64_t strings_hash(void *key)
 {
-  const char *s = (const char *)key;
-  int sum = 0, i;
-
-  assert(s);
-
-  for (i=0; i < strlen(s); i++)
-    sum += (int)s[i];
-
-  return sum % size;
+  assert(key);
+  return dict_hash_bytes(key, strlen((const char *)key));
 }
 
 void dict_use_string_keys(dict_t d)
@@ -94,99 +225,414 @@ void dict_use_string_keys(dict_t d)
 
 void dict_destroy(dict_t d)
 {
-  int i;
+  int j;
 
   assert(d);
-  assert(d->keys);
-
-  for (i=0; i < d->size; i++)
-    list_destroy(d->keys[i]);
+  assert(d->tables[0].entries);
 
-  free(d->keys);
+  for (j=0; j <= d->rehashing; j++)
+    free(d->tables[j].entries);
+  free(d->readers);
   free(d);
 }
 
-static list_t get_keys(dict_t d, void *key)
+/*
+ * Lock-free lookups from here on. It has to be called before the dict is
+ * shared, and whoever frees keys (or values) after dict_unset() has to
+ * call dict_synchronize() first.
+ */
+void dict_use_concurrent_reads(dict_t d)
+{
+  d->readers = aligned_alloc(DICT_CACHE_LINE,
+                             sizeof(struct dict_readers) * DICT_READER_STRIPES);
+  if (!d->readers)
+    error(EXIT_SYSTEM_CALL, "Failed to allocate memory");
+  memset(d->readers, 0, sizeof(struct dict_readers) * DICT_READER_STRIPES);
+  d->concurrent = 1;
+}
+
+static int read_lock(dict_t d)
+{
+  int epoch;
+
+  if (t_reader_stripe < 0)
+    t_reader_stripe = __atomic_fetch_add(&g_reader_stripes, 1, __ATOMIC_RELAXED) %
+      DICT_READER_STRIPES;
+
+  epoch = __atomic_load_n(&d->reader_epoch, __ATOMIC_SEQ_CST) & 1;
+  __atomic_add_fetch(&d->readers[t_reader_stripe].count[epoch], 1, __ATOMIC_SEQ_CST);
+  return epoch;
+}
+
+static void read_unlock(dict_t d, int epoch)
+{
+  __atomic_sub_fetch(&d->readers[t_reader_stripe].count[epoch], 1, __ATOMIC_SEQ_CST);
+}
+
+static void wait_for_readers(dict_t d, int epoch)
+{
+  long count;
+  int j;
+
+  do {
+    for (j=0, count=0; j < DICT_READER_STRIPES; j++)
+      count += __atomic_load_n(&d->readers[j].count[epoch], __ATOMIC_SEQ_CST);
+  } while (count);
+}
+
+/*
+ * Must be called with the lock held. New readers go to the other epoch's
+ * counts while the current one drains, and both are drained: a reader
+ * that read the epoch right before a flip still counts itself in the old
+ * one, however late it does it.
+ */
+static void synchronize_readers(dict_t d)
+{
+  int j, epoch;
+
+  for (j=0; j < 2; j++) {
+    epoch = __atomic_fetch_add(&d->reader_epoch, 1, __ATOMIC_SEQ_CST) & 1;
+    wait_for_readers(d, epoch);
+  }
+}
+
+/* waits for the lookups that might still see what was unset before */
+void dict_synchronize(dict_t d)
+{
+  if (!d->concurrent)
+    return;
+
+  LOCK(d);
+  synchronize_readers(d);
+  UNLOCK(d);
+}
+
+/* see dict_use_concurrent_reads(), they always go in pairs */
+static void write_begin(dict_t d)
+{
+  __atomic_store_n(&d->seq, d->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void write_end(dict_t d)
+{
+  __atomic_store_n(&d->seq, d->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* entries replaced by a rehash, once nobody could be looking at them */
+static void retire_entries(dict_t d, dict_key_value_t entries)
 {
-  int pos = d->hash_func(key, d->size);
-  return d->keys[pos];
+  if (d->concurrent)
+    synchronize_readers(d);
+  free(entries);
 }
 
-static dict_key_value_t key_value_for(dict_t d, void *key, list_t *keys)
+/* the entry for key in t, or NULL */
+static dict_key_value_t table_lookup(dict_t d,
+                                     dict_table *t,
+                                     void *key,
+                                     unsigned hash)
 {
+  unsigned pos = hash & t->mask, dib;
   dict_key_value_t kv;
-  list_item_t item;
 
-  *keys = get_keys(d, key);
-  assert(*keys);
-  list_for_each(item, kv, *keys) {
-    if (kv && d->key_comparator(kv->key, key) == 0)
+  for (dib=1; ; dib++, pos = (pos + 1) & t->mask) {
+    kv = &t->entries[pos];
+
+    /* it'd have taken this slot (or an empty one) if it was there */
+    if (kv->dib < dib)
+      return NULL;
+
+    /* most of the ones that aren't it are told apart by the hash alone */
+    if (kv->hash == hash && d->key_comparator(kv->key, key) == 0)
+      return kv;
+  }
+}
+
+/* the entry for key in either table, or NULL */
+static dict_key_value_t key_value_for(dict_t d,
+                                      void *key,
+                                      unsigned hash,
+                                      dict_table **t)
+{
+  dict_key_value_t kv;
+  int j;
+
+  for (j=0; j <= d->rehashing; j++) {
+    *t = &d->tables[j];
+    if ((kv = table_lookup(d, *t, key, hash)))
       return kv;
   }
 
   return NULL;
 }
 
-static void add_key_value(list_t keys, dict_key_value_t kv)
+/* key must not be in t already, and there must be room */
+static void add_key_value(dict_table *t, void *key, void *value, unsigned hash)
 {
-  if (list_full(keys))
-    list_resize(keys, list_count(keys) * 2);
-  list_append(keys, kv);
+  dict_key_value kv, tmp;
+  dict_key_value_t slot;
+  unsigned pos;
+
+  kv.key = key;
+  kv.value = value;
+  kv.hash = hash;
+  kv.dib = 1;
+  pos = hash & t->mask;
+
+  t->count++;
+
+  for (;; kv.dib++, pos = (pos + 1) & t->mask) {
+    slot = &t->entries[pos];
+
+    if (!slot->dib) {
+      *slot = kv;
+      return;
+    }
+
+    /* take from the rich: the one closer to home moves on instead */
+    if (slot->dib < kv.dib) {
+      tmp = *slot;
+      *slot = kv;
+      kv = tmp;
+    }
+  }
 }
 
-static void * remove_key_value(list_t keys, dict_key_value_t kv)
+static void remove_key_value(dict_table *t, dict_key_value_t kv)
 {
-  return list_remove_by_value(keys, kv);
+  unsigned pos = kv - t->entries;
+  unsigned next = (pos + 1) & t->mask;
+
+  t->count--;
+
+  /* pull back whatever comes after, until something is already home */
+  while (t->entries[next].dib > 1) {
+    t->entries[pos] = t->entries[next];
+    t->entries[pos].dib--;
+    pos = next;
+    next = (next + 1) & t->mask;
+  }
+
+  memset(&t->entries[pos], 0, sizeof(dict_key_value));
+}
+
+/*
+ * Moves entries from [0] to the newest table, going through [0]'s slots in
+ * order. The entries after a moved one are shifted back as usual, so [0]
+ * is still a valid table (and everything before rehash_pos is empty). Once
+ * it's empty, the rest move down a place.
+ */
+static void rehash_step(dict_t d, int max_entries, int max_slots)
+{
+  dict_table *from = &d->tables[0], *to = &d->tables[d->rehashing];
+  dict_key_value_t kv;
+
+  while (max_entries > 0 && max_slots-- > 0 && from->count) {
+    assert(d->rehash_pos <= from->mask);
+    kv = &from->entries[d->rehash_pos];
+
+    if (!kv->dib) {
+      d->rehash_pos++;
+      continue;
+    }
+
+    /* no need to hash it again */
+    add_key_value(to, kv->key, kv->value, kv->hash);
+    remove_key_value(from, kv);
+    max_entries--;
+  }
+
+  if (from->count)
+    return;
+
+  kv = from->entries;
+  memmove(d->tables, d->tables + 1, sizeof(dict_table) * d->rehashing);
+  memset(to, 0, sizeof(dict_table));
+  d->rehash_pos = 0;
+  d->rehashing--;
+
+  retire_entries(d, kv);
+}
+
+/* everything in [0], in one go */
+static void finish_rehash(dict_t d)
+{
+  while (d->rehashing)
+    rehash_step(d, INT_MAX, INT_MAX);
+}
+
+/*
+ * With iterators around, nothing can be moved, so a rehash that was still
+ * going just gets another table. Each is twice the last (shrinking only
+ * starts from a single table), so there's always room for them.
+ */
+static void start_rehash(dict_t d, unsigned slots)
+{
+  /* i.e.: it grew (or shrank) again before it was done */
+  if (!d->iterators)
+    finish_rehash(d);
+
+  assert(d->rehashing + 1 < DICT_MAX_TABLES);
+  table_init(&d->tables[d->rehashing + 1], slots);
+  if (!d->rehashing)
+    d->rehash_pos = 0;
+  d->rehashing++;
+}
+
+/* a bit of rehashing, or starting it if it's time */
+static void rehash(dict_t d)
+{
+  unsigned slots = d->tables[d->rehashing].mask + 1;
+
+  /*
+   * With iterators around, a rehash can start (new entries go to the new
+   * table) but not move anything.
+   */
+  if ((uint64_t)d->count * DICT_GROW_DEN > (uint64_t)slots * DICT_GROW_NUM)
+    start_rehash(d, slots * 2);
+  else if (slots > d->min_slots && d->count < slots / DICT_SHRINK_DEN &&
+           !(d->rehashing && d->iterators))
+    start_rehash(d, slots_for(d->count * 2) > d->min_slots ?
+                 slots_for(d->count * 2) : d->min_slots);
+
+  if (d->rehashing && !d->iterators)
+    rehash_step(d, DICT_REHASH_ENTRIES, DICT_REHASH_SLOTS);
 }
 
 /* This returns:
  *  - the old value, if the key existed
  *  - the new value, if there was no key
- *  - NULL, if the dictionary is full
  */
 void *dict_set(dict_t d, void *key, void *value)
 {
   void *old = NULL;
-  list_t keys = NULL;
-  dict_key_value_t kv = NULL;
+  unsigned hash = (unsigned)d->hash_func(key);
+  dict_key_value_t kv;
+  dict_table *t;
 
   LOCK(d);
+  write_begin(d);
 
-  if (d->count == d->size)
-    goto out;
-
-  kv = key_value_for(d, key, &keys);
+  kv = key_value_for(d, key, hash, &t);
 
   if (kv) {
     old = kv->value;
     kv->value = value;
   } else {
-    kv = pool_get(d->pool);
-    kv->key = key;
-    old = kv->value = value;
-    add_key_value(keys, kv);
+    /* while rehashing, new ones go straight to the new table */
+    add_key_value(&d->tables[d->rehashing], key, value, hash);
+    old = value;
     d->count++;
   }
 
-out:
+  rehash(d);
+
+  write_end(d);
   UNLOCK(d);
   return old;
 }
 
 
+/* the seqlock moved on since seq, i.e.: what was read can't be trusted */
+static int read_retry(dict_t d, unsigned seq)
+{
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&d->seq, __ATOMIC_RELAXED) != seq;
+}
+
+/*
+ * A lookup without the lock, returns 0 if it raced with a writer. The
+ * tables are copied (& checked) first so the walk stays in bounds, and
+ * the key is checked before it's handed to the comparator.
+ */
+static int read_optimistic(dict_t d, void *key, unsigned hash, void **value)
+{
+  dict_table tables[DICT_MAX_TABLES];
+  dict_key_value_t kv;
+  unsigned seq, pos, dib;
+  void *k, *v;
+  int j, num_tables;
+
+  seq = __atomic_load_n(&d->seq, __ATOMIC_ACQUIRE);
+  if (seq & 1)
+    return 0;
+
+  num_tables = __atomic_load_n(&d->rehashing, __ATOMIC_RELAXED) + 1;
+  if (num_tables > DICT_MAX_TABLES)
+    return 0;
+  for (j=0; j < num_tables; j++) {
+    tables[j].entries = __atomic_load_n(&d->tables[j].entries, __ATOMIC_RELAXED);
+    tables[j].mask = __atomic_load_n(&d->tables[j].mask, __ATOMIC_RELAXED);
+  }
+
+  if (read_retry(d, seq))
+    return 0;
+
+  *value = NULL;
+
+  for (j=0; j < num_tables; j++) {
+    pos = hash & tables[j].mask;
+
+    for (dib=1; dib <= tables[j].mask + 1; dib++, pos = (pos + 1) & tables[j].mask) {
+      kv = &tables[j].entries[pos];
+
+      if (__atomic_load_n(&kv->dib, __ATOMIC_RELAXED) < dib)
+        break;
+      if (__atomic_load_n(&kv->hash, __ATOMIC_RELAXED) != hash)
+        continue;
+
+      k = __atomic_load_n(&kv->key, __ATOMIC_RELAXED);
+      v = __atomic_load_n(&kv->value, __ATOMIC_RELAXED);
+      if (read_retry(d, seq))
+        return 0;
+
+      if (d->key_comparator(k, key) == 0) {
+        *value = v;
+        return !read_retry(d, seq);
+      }
+    }
+  }
+
+  return !read_retry(d, seq);
+}
+
 /* the value associated to the key, or NULL */
 void * dict_get(dict_t d, void *key)
 {
-  list_t keys = NULL;
-  dict_key_value_t kv = NULL;
+  unsigned hash = (unsigned)d->hash_func(key);
+  dict_key_value_t kv;
+  dict_table *t;
   void * value = NULL;
+  int epoch, tries;
+
+  if (d->concurrent) {
+    epoch = read_lock(d);
+    for (tries=0; tries < DICT_READ_TRIES; tries++) {
+      if (read_optimistic(d, key, hash, &value))
+        break;
+    }
+    read_unlock(d, epoch);
+
+    if (tries < DICT_READ_TRIES)
+      return value;
+
+    /* there's too much writing going on, queue up with the writers */
+  }
 
   LOCK(d);
 
-  kv = key_value_for(d, key, &keys);
+  kv = key_value_for(d, key, hash, &t);
   if (kv)
     value = kv->value;
 
+  /* the lock-free lookups leave rehashing to the writers */
+  if (d->rehashing && !d->concurrent && !d->iterators) {
+    write_begin(d);
+    rehash_step(d, DICT_REHASH_ENTRIES, DICT_REHASH_SLOTS);
+    write_end(d);
+  }
+
   UNLOCK(d);
 
   return value;
@@ -194,49 +640,189 @@ void * dict_get(dict_t d, void *key)
 
 void * dict_unset(dict_t d, void *key)
 {
-  list_t keys = NULL;
-  dict_key_value_t kv = NULL;
+  unsigned hash = (unsigned)d->hash_func(key);
+  dict_key_value_t kv;
+  dict_table *t;
   void * value = NULL;
 
   LOCK(d);
+  write_begin(d);
 
-  kv = key_value_for(d, key, &keys);
+  kv = key_value_for(d, key, hash, &t);
   if (kv) {
     value = kv->value;
-    remove_key_value(keys, kv);
+    remove_key_value(t, kv);
     d->count--;
   }
 
+  rehash(d);
+
+  write_end(d);
   UNLOCK(d);
 
   return value;
 }
 
-static void * key_transform(list_item_t item)
+/*
+ * A slot that's empty or already home: nothing before it is ever shifted
+ * past it (or back into it) by removals, so walking from there to there
+ * sees everything once, even with dict_iter_unset() along the way.
+ */
+static unsigned walk_start(dict_table *t)
 {
-  dict_key_value_t kv = (dict_key_value_t)item->value;
-  return kv->key;
+  unsigned pos;
+
+  for (pos = 0; pos <= t->mask; pos++)
+    if (t->entries[pos].dib <= 1)
+      return pos;
+
+  return 0;
 }
 
-list_t dict_keys(dict_t d)
+/*
+ * Walks over every entry without copying them, taking the lock for each
+ * step only:
+ *
+ *   dict_iter it;
+ *   dict_iter_init(d, &it);
+ *   while (dict_iter_next(&it, &key, &value))
+ *     ...
+ *
+ * Rehashing is held off until it's done, so growing or shrinking doesn't
+ * make it miss (or repeat) entries. To drop entries on the way, use
+ * dict_iter_unset(): plain dict_unset() or dict_set() of new keys shift
+ * entries around, so the walk might skip some and see others twice. It's
+ * done when dict_iter_next() returns 0, or call dict_iter_done() to stop
+ * before that.
+ */
+void dict_iter_init(dict_t d, dict_iter *it)
 {
-  list_t keys;
-  list_t collision_list;
-  int i;
+  it->d = d;
+  it->table = 0;
+  it->pos = 0;
+  it->current = 0;
+
+  LOCK(d);
+  d->iterators++;
+  it->start = walk_start(&d->tables[0]);
+  UNLOCK(d);
+}
+
+/* 1 if there was one more (key & value can be NULL), 0 at the end */
+int dict_iter_next(dict_iter *it, void **key, void **value)
+{
+  dict_t d = it->d;
+  dict_key_value_t kv;
+  dict_table *t;
+
+  if (!d)
+    return 0;
 
   LOCK(d);
-  keys = list_new(d->count);
-  keys_for_each_list(d, i, collision_list) {
-    list_concat_with_transform(keys, collision_list, key_transform);
+
+  it->current = 0;
+
+  while (it->table <= d->rehashing) {
+    t = &d->tables[it->table];
+
+    for (; it->pos <= t->mask; it->pos++) {
+      kv = &t->entries[(it->start + it->pos) & t->mask];
+      if (!kv->dib)
+        continue;
+
+      if (key)
+        *key = kv->key;
+      if (value)
+        *value = kv->value;
+      it->pos++;
+      it->current = 1;
+
+      UNLOCK(d);
+      return 1;
+    }
+
+    if (++it->table <= d->rehashing)
+      it->start = walk_start(&d->tables[it->table]);
+    it->pos = 0;
   }
+
   UNLOCK(d);
 
-  return keys;
+  dict_iter_done(it);
+  return 0;
+}
+
+/*
+ * Unsets what dict_iter_next() just returned, and returns its value. What
+ * comes after it is shifted back, so the cursor goes back a slot too.
+ */
+void * dict_iter_unset(dict_iter *it)
+{
+  dict_t d = it->d;
+  dict_key_value_t kv;
+  dict_table *t;
+  void *value;
+
+  assert(d && it->current);
+
+  LOCK(d);
+  write_begin(d);
+
+  t = &d->tables[it->table];
+  it->pos--;
+  kv = &t->entries[(it->start + it->pos) & t->mask];
+  value = kv->value;
+  remove_key_value(t, kv);
+  d->count--;
+  it->current = 0;
+
+  rehash(d);
+
+  write_end(d);
+  UNLOCK(d);
+
+  return value;
+}
+
+void dict_iter_done(dict_iter *it)
+{
+  dict_t d = it->d;
+
+  if (!d)
+    return;
+
+  LOCK(d);
+  d->iterators--;
+  UNLOCK(d);
+
+  it->d = NULL;
+}
+
+static list_t iter_collect(dict_t d, int values)
+{
+  list_t l = list_new(dict_count(d) ? dict_count(d) : 1);
+  dict_iter it;
+  void *key, *value;
+
+  dict_iter_init(d, &it);
+  while (dict_iter_next(&it, &key, &value)) {
+    /* it grew while we were at it */
+    if (list_full(l))
+      list_resize(l, l->size * 2);
+    list_append(l, values ? value : key);
+  }
+
+  return l;
+}
+
+list_t dict_keys(dict_t d)
+{
+  return iter_collect(d, 0);
 }
 
 list_t dict_values(dict_t d)
 {
-  return NULL;
+  return iter_collect(d, 1);
 }
 
 int dict_count(dict_t d)
@@ -331,14 +917,702 @@ static void test_big_dict(void)
   }
 }
 
+/* everything lands on the same slot, so it's all one long probe */
+static uint64_t same_hash(void *key)
+{
+  return 42;
+}
+
+static void test_collisions(void)
+{
+  int num_keys = 100;
+  dict_t d = dict_new(num_keys);
+  long i;
+
+  dict_set_hash_func(d, &same_hash);
+
+  for (i=1; i <= num_keys; i++)
+    assert(dict_set(d, (void *)i, (void *)i) == (void *)i);
+
+  info("dict has %d keys", dict_count(d));
+  assert(dict_count(d) == num_keys);
+
+  /* the ones after each removed entry have to be shifted back */
+  for (i=1; i <= num_keys; i += 3)
+    assert(dict_unset(d, (void *)i) == (void *)i);
+
+  for (i=1; i <= num_keys; i++)
+    assert(dict_get(d, (void *)i) == (i % 3 == 1 ? NULL : (void *)i));
+
+  dict_destroy(d);
+}
+
+static void test_grow_shrink(void)
+{
+  long i, num_keys = 1 << 14;
+  dict_t d = dict_new(1);
+  unsigned slots;
+
+  for (i=1; i <= num_keys; i++) {
+    assert(dict_set(d, (void *)(i * 32), (void *)i) == (void *)i);
+
+    /* wherever it is, old or new table */
+    assert(dict_get(d, (void *)(i / 2 * 32 + 32)) == (void *)(i / 2 + 1));
+  }
+
+  slots = d->tables[d->rehashing].mask + 1;
+  info("dict has %d keys in %u slots", dict_count(d), slots);
+  assert(dict_count(d) == num_keys);
+  assert(slots >= num_keys);
+
+  for (i=1; i <= num_keys; i++) {
+    if (i % 64)
+      assert(dict_unset(d, (void *)(i * 32)) == (void *)i);
+  }
+
+  info("dict has %d keys in %u slots", dict_count(d), d->tables[d->rehashing].mask + 1);
+  assert(dict_count(d) == num_keys / 64);
+  assert(d->tables[d->rehashing].mask + 1 < slots / 8);
+
+  for (i=1; i <= num_keys; i++)
+    assert(dict_get(d, (void *)(i * 32)) == (i % 64 ? NULL : (void *)i));
+
+  /* down to what it was created for, but no further */
+  for (i=64; i <= num_keys; i += 64)
+    dict_unset(d, (void *)(i * 32));
+  for (i=0; i < 100; i++)
+    dict_get(d, (void *)32);
+
+  assert(dict_count(d) == 0);
+  assert(!d->rehashing && d->tables[0].mask + 1 == d->min_slots);
+
+  dict_destroy(d);
+}
+
+/* every entry once, as the walk goes */
+static void iter_check(dict_iter *it, char *seen, long num_keys, long steps)
+{
+  void *key, *value;
+
+  for (; steps && dict_iter_next(it, &key, &value); steps--) {
+    assert((long)key / 32 == (long)value);
+    assert((long)value >= 1 && (long)value <= num_keys);
+    assert(!seen[(long)value]);
+    seen[(long)value] = 1;
+  }
+}
+
+static void test_iter(void)
+{
+  long i, num_keys = 1000;
+  dict_t d = dict_new(1);
+  char *seen = safe_alloc(num_keys + 1);
+  dict_iter it;
+  list_t values, keys;
+  list_item_t item;
+  void *value;
+  unsigned left;
+
+  dict_iter_init(d, &it);
+  assert(!dict_iter_next(&it, NULL, NULL));
+  assert(d->iterators == 0);
+
+  /* stop as soon as it's halfway through moving them to a bigger table */
+  for (i=1; i <= num_keys; i++) {
+    dict_set(d, (void *)(i * 32), (void *)i);
+    if (i > num_keys / 2 && d->rehashing)
+      break;
+  }
+  num_keys = i;
+  assert(d->rehashing && d->tables[0].count && d->tables[1].count);
+
+  dict_iter_init(d, &it);
+  iter_check(&it, seen, num_keys, num_keys / 2);
+
+  /* these would've finished the rehash, but it waits for the iterator */
+  left = d->tables[0].count;
+  for (i=0; i < num_keys; i++)
+    dict_get(d, (void *)32);
+  assert(d->rehashing && d->tables[0].count == left);
+
+  iter_check(&it, seen, num_keys, -1);
+  for (i=1; i <= num_keys; i++)
+    assert(seen[i]);
+  assert(d->iterators == 0);
+
+  /* and now it goes on */
+  dict_get(d, (void *)32);
+  assert(!d->rehashing || d->tables[0].count < left);
+
+  /* stopping early */
+  dict_iter_init(d, &it);
+  assert(dict_iter_next(&it, NULL, &value) && value);
+  dict_iter_done(&it);
+  dict_iter_done(&it);
+  assert(d->iterators == 0 && !dict_iter_next(&it, NULL, NULL));
+
+  memset(seen, 0, num_keys + 1);
+  values = dict_values(d);
+  assert(list_count(values) == num_keys);
+  list_for_each(item, value, values) {
+    assert(!seen[(long)value]);
+    seen[(long)value] = 1;
+  }
+  list_destroy(values);
+
+  keys = dict_keys(d);
+  assert(list_count(keys) == num_keys);
+  list_destroy(keys);
+
+  free(seen);
+  dict_destroy(d);
+}
+
+/* way past what the new table takes, while the walk is still in [0] */
+/* unsets the odd ones on the way, keeping the rest */
+static void iter_unset_odd(dict_t d, long num_keys)
+{
+  char *seen = safe_alloc(num_keys + 1);
+  void *key, *value;
+  dict_iter it;
+  long i;
+
+  dict_iter_init(d, &it);
+  while (dict_iter_next(&it, &key, &value)) {
+    assert((long)key / 32 == (long)value);
+    assert((long)value >= 1 && (long)value <= num_keys);
+    assert(!seen[(long)value]);
+    seen[(long)value] = 1;
+
+    if ((long)value % 2)
+      assert(dict_iter_unset(&it) == value);
+  }
+  assert(d->iterators == 0);
+
+  for (i=1; i <= num_keys; i++) {
+    assert(seen[i]);
+    assert(dict_get(d, (void *)(i * 32)) == (i % 2 ? NULL : (void *)i));
+  }
+  assert(dict_count(d) == num_keys / 2);
+
+  free(seen);
+}
+
+static void test_iter_unset(void)
+{
+  long i, num_keys = 1000;
+  dict_t d = dict_new(1);
+
+  /* halfway through moving them to a bigger table */
+  for (i=1; i <= num_keys; i++) {
+    dict_set(d, (void *)(i * 32), (void *)i);
+    if (i > num_keys / 2 && d->rehashing)
+      break;
+  }
+  num_keys = i;
+  assert(d->rehashing == 1);
+
+  iter_unset_odd(d, num_keys);
+  dict_destroy(d);
+
+  /* one run that wraps around the end of the table */
+  num_keys = 100;
+  d = dict_new(num_keys);
+  dict_set_hash_func(d, &same_hash);
+  for (i=1; i <= num_keys; i++)
+    dict_set(d, (void *)(i * 32), (void *)i);
+  assert(!d->rehashing && (42 + num_keys) > d->tables[0].mask);
+
+  iter_unset_odd(d, num_keys);
+  dict_destroy(d);
+}
+
+static void test_iter_grow(void)
+{
+  long i, num_keys, more = 1 << 15;
+  dict_t d = dict_new(1);
+  char *seen;
+  dict_iter it;
+  unsigned left;
+  int tables;
+
+  /* so new ones go to [1], rather than to the table being walked */
+  for (i=1; !d->rehashing || i < 1000; i++)
+    dict_set(d, (void *)(i * 32), (void *)i);
+  num_keys = i - 1;
+  assert(d->rehashing == 1);
+
+  seen = safe_alloc(num_keys + more + 1);
+  left = d->tables[0].count;
+
+  dict_iter_init(d, &it);
+  iter_check(&it, seen, num_keys, left / 2);
+  assert(it.table == 0);
+
+  for (i=num_keys + 1; i <= num_keys + more; i++)
+    dict_set(d, (void *)(i * 32), (void *)i);
+
+  tables = d->rehashing + 1;
+  info("%d tables while iterating", tables);
+  assert(tables > 2 && d->tables[0].count == left);
+
+  /* the new ones are in tables it hadn't got to, so those show up too */
+  iter_check(&it, seen, num_keys + more, -1);
+  for (i=1; i <= num_keys + more; i++)
+    assert(seen[i]);
+
+  /* and then it goes back to one table, eventually */
+  for (i=0; i < more && d->rehashing; i++)
+    dict_set(d, (void *)32, (void *)1);
+  assert(!d->rehashing && dict_count(d) == num_keys + more);
+
+  for (i=1; i <= num_keys + more; i++)
+    assert(dict_get(d, (void *)(i * 32)) == (void *)i);
+
+  free(seen);
+  dict_destroy(d);
+}
+
+static int cmp_hashes(const void *a, const void *b)
+{
+  unsigned x = *(const unsigned *)a, y = *(const unsigned *)b;
+  return x == y ? 0 : (x < y ? -1 : 1);
+}
+
+/*
+ * How evenly the keys spread out: how far from their home slot entries
+ * ended up, and how many share their (cached) hash with another one, so
+ * only the key comparator can tell them apart.
+ */
+static void report_distribution(dict_t d, const char *desc)
+{
+  dict_table *t = &d->tables[0];
+  dict_key_value_t kv;
+  unsigned *hashes, i, max_dib = 0;
+  long home = 0, dibs = 0, same = 0;
+  int count = 0;
+
+  /* all of it in one table */
+  finish_rehash(d);
+
+  hashes = (unsigned *)safe_alloc(sizeof(unsigned) * (t->count + 1));
+
+  for (i=0, kv=t->entries; i <= t->mask; i++, kv++) {
+    if (!kv->dib)
+      continue;
+
+    hashes[count++] = kv->hash;
+    dibs += kv->dib;
+    home += kv->dib == 1;
+    if (kv->dib > max_dib)
+      max_dib = kv->dib;
+  }
+
+  qsort(hashes, count, sizeof(unsigned), &cmp_hashes);
+  for (i=1; i < count; i++)
+    same += hashes[i] == hashes[i - 1];
+
+  info("%s: keys=%d slots=%u at_home=%.1f%% avg_probe=%.2f max_probe=%u "
+       "hash_collisions=%ld",
+       desc,
+       count,
+       t->mask + 1,
+       100.0 * home / count,
+       (double)dibs / count,
+       max_dib,
+       same);
+
+  /* linear probing at <= 4/5 full, and n^2 / 2^33 expected collisions */
+  assert((double)dibs / count < 4.0);
+  assert(max_dib < 64);
+  assert(same < 16);
+
+  free(hashes);
+}
+
+static void test_distribution(void)
+{
+  int num_keys = 1 << 16, key_size = 96, i;
+  char *keys = safe_alloc(num_keys * key_size), *k;
+  dict_t d;
+
+  /* znodes share long prefixes, and the ones that differ are sequential */
+  d = dict_new(1);
+  dict_use_string_keys(d);
+  for (i=0, k=keys; i < num_keys; i++, k += key_size) {
+    snprintf(k, key_size, "/zookeeper/services/payments-prod/ephemerals/member-%010d", i);
+    dict_set(d, k, k);
+  }
+  report_distribution(d, "long paths, shared prefix");
+  dict_destroy(d);
+
+  d = dict_new(1);
+  dict_use_string_keys(d);
+  for (i=0, k=keys; i < num_keys; i++, k += key_size) {
+    snprintf(k, key_size, "/q/lock-%010d", i);
+    dict_set(d, k, k);
+  }
+  report_distribution(d, "short paths, sequential");
+  dict_destroy(d);
+
+  /* all of them have the same bytes, just in a different order */
+  d = dict_new(1);
+  dict_use_string_keys(d);
+  for (i=0, k=keys; i < num_keys; i++, k += key_size) {
+    snprintf(k, key_size, "abcdefghijklmnopqrstuvwyz0123456789");
+    strfry(k);
+    dict_set(d, k, k);
+  }
+  report_distribution(d, "permutations");
+  dict_destroy(d);
+
+  d = dict_new(1);
+  for (i=0, k=keys; i < num_keys; i++, k += key_size)
+    dict_set(d, k, k);
+  report_distribution(d, "pointers");
+  dict_destroy(d);
+
+  free(keys);
+}
+
+#define CONCURRENT_READERS  3
+#define CONCURRENT_KEYS     1024
+#define CONCURRENT_CHURN    8192
+#define CONCURRENT_ROUNDS   10
+
+typedef struct {
+  dict_t d;
+  char **keys;     /* never unset, key i's value is keys[i] */
+  char **churn;    /* come & go, along with the tables, key i's value is i + 1 */
+  int stop;
+  long lookups;
+} concurrent_state;
+
+static void *concurrent_reader(void *data)
+{
+  concurrent_state *st = (concurrent_state *)data;
+  char churned[32];
+  long i, j, value, lookups = 0;
+
+  while (!__atomic_load_n(&st->stop, __ATOMIC_ACQUIRE)) {
+    for (i=0; i < CONCURRENT_KEYS; i++, lookups += 2) {
+      assert(dict_get(st->d, st->keys[i]) == st->keys[i]);
+
+      /*
+       * Either it's not there, or it's the right one. The value isn't a
+       * pointer to the key: that one could be freed as soon as we're back.
+       */
+      j = i * 7 % CONCURRENT_CHURN;
+      snprintf(churned, sizeof(churned), "churn-%ld", j);
+      value = (long)dict_get(st->d, churned);
+      assert(!value || value == j + 1);
+    }
+  }
+
+  __atomic_add_fetch(&st->lookups, lookups, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+static void test_concurrent_reads(void)
+{
+  concurrent_state st;
+  pthread_t readers[CONCURRENT_READERS];
+  char buf[32];
+  long i, j;
+
+  memset(&st, 0, sizeof(st));
+  st.d = dict_new(1);
+  dict_use_string_keys(st.d);
+  dict_use_concurrent_reads(st.d);
+
+  st.keys = safe_alloc(sizeof(char *) * CONCURRENT_KEYS);
+  for (i=0; i < CONCURRENT_KEYS; i++) {
+    snprintf(buf, sizeof(buf), "key-%ld", i);
+    st.keys[i] = safe_strdup(buf);
+    dict_set(st.d, st.keys[i], st.keys[i]);
+  }
+
+  for (j=0; j < CONCURRENT_READERS; j++)
+    pthread_create(&readers[j], NULL, &concurrent_reader, &st);
+
+  /* the tables grow & shrink underneath the readers, over and over */
+  st.churn = safe_alloc(sizeof(char *) * CONCURRENT_CHURN);
+  for (j=0; j < CONCURRENT_ROUNDS; j++) {
+    for (i=0; i < CONCURRENT_CHURN; i++) {
+      snprintf(buf, sizeof(buf), "churn-%ld", i);
+      st.churn[i] = safe_strdup(buf);
+      dict_set(st.d, st.churn[i], (void *)(i + 1));
+    }
+
+    for (i=0; i < CONCURRENT_CHURN; i++)
+      assert(dict_unset(st.d, st.churn[i]) == (void *)(i + 1));
+
+    /* readers might still be comparing against them */
+    dict_synchronize(st.d);
+    for (i=0; i < CONCURRENT_CHURN; i++)
+      free(st.churn[i]);
+  }
+
+  __atomic_store_n(&st.stop, 1, __ATOMIC_RELEASE);
+  for (j=0; j < CONCURRENT_READERS; j++)
+    pthread_join(readers[j], NULL);
+
+  info("%ld lookups while the tables were resized", st.lookups);
+  assert(dict_count(st.d) == CONCURRENT_KEYS);
+
+  for (i=0; i < CONCURRENT_KEYS; i++)
+    free(st.keys[i]);
+  free(st.keys);
+  free(st.churn);
+  dict_destroy(st.d);
+}
+
 int main(int argc, char **argv)
 {
   run_test("basic: add, set, get & remove", &test_basic);
   run_test("string keys", &test_string_keys);
   run_test("big dict", &test_big_dict);
+  run_test("collisions: removals shift back", &test_collisions);
+  run_test("grow & shrink", &test_grow_shrink);
+  run_test("iterators hold off rehashing", &test_iter);
+  run_test("iterators while it grows past the new table", &test_iter_grow);
+  run_test("unsetting while iterating", &test_iter_unset);
+  run_test("distribution of keys", &test_distribution);
+  run_test("concurrent reads", &test_concurrent_reads);
 
   return 0;
 }
 
 
+#endif
+
+#ifdef RUN_BENCH
+
+#include <malloc.h>
+
+#define BENCH_SIZE      (1 << 12)
+#define BENCH_LOOKUPS   (1 << 20)
+
+typedef struct {
+  char pad[32];   /* string keys are kept here */
+} bench_slot;
+
+/* big tables are mmap()ed, those are in hblkhd */
+static size_t heap_in_use(void)
+{
+  struct mallinfo2 mi = mallinfo2();
+  return mi.uordblks + mi.hblkhd;
+}
+
+static void bench_load(int percent, int string_keys)
+{
+  dict_t d;
+  int count = BENCH_SIZE * percent / 100;
+  bench_slot *slots = safe_alloc(sizeof(bench_slot) * count * 2);
+  void **keys = safe_alloc(sizeof(void *) * count * 2);
+  const char *key_type = string_keys ? "string" : "ptr";
+  uint64_t start, elapsed;
+  size_t heap_before, heap_after;
+  char params[128];
+  dict_iter it;
+  void *value;
+  long i;
+
+  /* everything the dict allocates, buckets & entries (not the keys) */
+  heap_before = heap_in_use();
+  d = dict_new(BENCH_SIZE);
+
+  if (string_keys)
+    dict_use_string_keys(d);
+
+  /* the second half never goes in, for misses */
+  for (i=0; i < count * 2; i++) {
+    if (string_keys) {
+      keys[i] = slots[i].pad;
+      snprintf(slots[i].pad, sizeof(slots[i].pad), "/bench/key-%ld", i);
+    } else {
+      keys[i] = &slots[i];
+    }
+  }
+
+  start = now_nsecs();
+  for (i=0; i < count; i++)
+    dict_set(d, keys[i], keys[i]);
+  elapsed = now_nsecs() - start;
+  heap_after = heap_in_use();
+
+  assert(dict_count(d) == count);
+
+  snprintf(params,
+           sizeof(params),
+           "op=set load=%d%% key=%s bytes_per_entry=%.1f",
+           percent,
+           key_type,
+           (double)(heap_after - heap_before) / count);
+  bench_report("dict", params, count, elapsed);
+
+  start = now_nsecs();
+  for (i=0; i < BENCH_LOOKUPS; i++)
+    dict_get(d, keys[i % count]);
+  elapsed = now_nsecs() - start;
+
+  snprintf(params, sizeof(params), "op=get_hit load=%d%% key=%s", percent, key_type);
+  bench_report("dict", params, BENCH_LOOKUPS, elapsed);
+
+  start = now_nsecs();
+  for (i=0; i < BENCH_LOOKUPS; i++)
+    dict_get(d, keys[count + i % count]);
+  elapsed = now_nsecs() - start;
+
+  snprintf(params, sizeof(params), "op=get_miss load=%d%% key=%s", percent, key_type);
+  bench_report("dict", params, BENCH_LOOKUPS, elapsed);
+
+  start = now_nsecs();
+  for (i=0; i < BENCH_LOOKUPS; i += count) {
+    dict_iter_init(d, &it);
+    while (dict_iter_next(&it, NULL, &value))
+      ;
+  }
+  elapsed = now_nsecs() - start;
+
+  snprintf(params, sizeof(params), "op=iterate load=%d%% key=%s", percent, key_type);
+  bench_report("dict", params, i, elapsed);
+
+  dict_destroy(d);
+  free(keys);
+  free(slots);
+}
+
+/* how long a single set can take, when it's grown from nothing */
+static void bench_grow(void)
+{
+  dict_t d = dict_new(1);
+  long i, count = 1 << 20;
+  uint64_t start, began, elapsed, max = 0;
+  char params[64];
+
+  began = now_nsecs();
+  for (i=1; i <= count; i++) {
+    start = now_nsecs();
+    dict_set(d, (void *)(i * 32), (void *)i);
+    elapsed = now_nsecs() - start;
+    if (elapsed > max)
+      max = elapsed;
+  }
+  elapsed = now_nsecs() - began;
+
+  snprintf(params, sizeof(params), "op=grow key=ptr max_set_us=%.1f", max / 1000.0);
+  bench_report("dict", params, count, elapsed);
+
+  dict_destroy(d);
+}
+
+typedef struct {
+  dict_t d;
+  void **keys;
+  long count;
+  long lookups;
+  int stop;
+} bench_readers_state;
+
+static void *bench_reader(void *data)
+{
+  bench_readers_state *st = (bench_readers_state *)data;
+  long i;
+
+  for (i=0; i < st->lookups; i++)
+    dict_get(st->d, st->keys[i % st->count]);
+
+  return NULL;
+}
+
+/* keeps the tables growing & shrinking, until the readers are done */
+static void *bench_writer(void *data)
+{
+  bench_readers_state *st = (bench_readers_state *)data;
+  long i;
+
+  while (!__atomic_load_n(&st->stop, __ATOMIC_ACQUIRE)) {
+    for (i=1; i <= BENCH_SIZE; i++)
+      dict_set(st->d, (void *)(i * 8 + 1), (void *)i);
+    for (i=1; i <= BENCH_SIZE; i++)
+      dict_unset(st->d, (void *)(i * 8 + 1));
+  }
+
+  return NULL;
+}
+
+/* BENCH_LOOKUPS hits, split among the readers */
+static void bench_readers(int threads, int concurrent, int churn)
+{
+  bench_readers_state st;
+  pthread_t readers[threads], writer;
+  bench_slot *slots = safe_alloc(sizeof(bench_slot) * BENCH_SIZE);
+  uint64_t start, elapsed;
+  char params[128];
+  long i;
+
+  memset(&st, 0, sizeof(st));
+  st.d = dict_new(BENCH_SIZE);
+  st.count = BENCH_SIZE / 2;
+  st.keys = safe_alloc(sizeof(void *) * st.count);
+  st.lookups = BENCH_LOOKUPS / threads;
+
+  if (concurrent)
+    dict_use_concurrent_reads(st.d);
+
+  for (i=0; i < st.count; i++) {
+    st.keys[i] = &slots[i];
+    dict_set(st.d, st.keys[i], st.keys[i]);
+  }
+
+  if (churn)
+    pthread_create(&writer, NULL, &bench_writer, &st);
+
+  start = now_nsecs();
+  for (i=0; i < threads; i++)
+    pthread_create(&readers[i], NULL, &bench_reader, &st);
+  for (i=0; i < threads; i++)
+    pthread_join(readers[i], NULL);
+  elapsed = now_nsecs() - start;
+
+  if (churn) {
+    __atomic_store_n(&st.stop, 1, __ATOMIC_RELEASE);
+    pthread_join(writer, NULL);
+  }
+
+  snprintf(params,
+           sizeof(params),
+           "op=get_hit key=ptr mode=%s threads=%d writer=%s",
+           concurrent ? "concurrent" : "locked",
+           threads,
+           churn ? "churn" : "none");
+  bench_report("dict", params, st.lookups * threads, elapsed);
+
+  dict_destroy(st.d);
+  free(st.keys);
+  free(slots);
+}
+
+int main(int argc, char **argv)
+{
+  static const int loads[] = { 25, 50, 90 };
+  static const int threads[] = { 1, 2, 4, 8 };
+  int i, mode, churn;
+
+  for (i=0; i < sizeof(loads) / sizeof(loads[0]); i++) {
+    bench_load(loads[i], 0);
+    bench_load(loads[i], 1);
+  }
+
+  bench_grow();
+
+  for (churn=0; churn < 2; churn++)
+    for (mode=0; mode < 2; mode++)
+      for (i=0; i < sizeof(threads) / sizeof(threads[0]); i++)
+        bench_readers(threads[i], mode, churn);
+
+  return 0;
+}
+
 #endif
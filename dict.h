@@ -2,25 +2,45 @@
 #define _DICT_H_
 
 #include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #include "list.h"
-#include "pool.h"
 
 
 typedef struct {
   void *key;
   void *value;
+  unsigned hash;  /* (the low bits of) hash_func(key), it's never rehashed */
+  unsigned dib;   /* distance from home + 1, 0 if the slot is empty */
 } dict_key_value;
 
 typedef dict_key_value * dict_key_value_t;
 
+/* each one twice the last, so it's never short of them (see start_rehash()) */
+#define DICT_MAX_TABLES 32
+
 typedef struct {
-  list_t *keys;
-  pool_t pool;
+  dict_key_value_t entries; /* mask + 1 slots */
+  unsigned mask;
   int count;
-  int size;
+} dict_table;
+
+struct dict_readers;
+
+typedef struct {
+  dict_table tables[DICT_MAX_TABLES]; /* while rehashing, [0] is moved into the newest */
+  int rehashing;        /* the newest table, 0 if there's only [0] */
+  unsigned rehash_pos;  /* the next slot of [0] to move */
+  int count;
+  unsigned min_slots;   /* it never shrinks below what it was created for */
+  unsigned seq;         /* odd while the tables are being changed */
+  int concurrent;       /* see dict_use_concurrent_reads() */
+  struct dict_readers *readers; /* lock-free lookups in flight, per epoch */
+  unsigned reader_epoch;
+  int iterators;        /* the ones in progress, rehashing waits for them */
   int (*key_comparator)(void *a, void *b); /* 0 if =, -1 if a < b, 1 if a > b */
-  int (*hash_func)(void *key, int size);
+  uint64_t (*hash_func)(void *key);
   pthread_mutex_t lock;
   pthread_cond_t cond;
   void *user_data;
@@ -28,6 +48,15 @@ typedef struct {
 
 typedef dict * dict_t;
 
+/* a cursor, see dict_iter_init() */
+typedef struct {
+  dict_t d;       /* NULL once it's done */
+  int table;
+  unsigned start; /* where the walk of this table began */
+  unsigned pos;   /* slots walked so far, from start */
+  int current;    /* 1 if the last one hasn't been unset */
+} dict_iter;
+
 dict_t dict_new(int size);
 void dict_destroy(dict_t d);
 void dict_init(dict_t d);
@@ -35,11 +64,18 @@ void * dict_set(dict_t d, void *key, void *value);
 void * dict_get(dict_t d, void *key);
 list_t dict_keys(dict_t d);
 list_t dict_values(dict_t d);
+void dict_iter_init(dict_t d, dict_iter *it);
+int dict_iter_next(dict_iter *it, void **key, void **value);
+void dict_iter_done(dict_iter *it);
+void * dict_iter_unset(dict_iter *it);
 void * dict_unset(dict_t d, void *key);
 int dict_count(dict_t d);
 void dict_set_key_comparator(dict_t d, int (*comparator)(void *, void *));
-void dict_set_hash_func(dict_t d, int (*hash_func)(void *, int));
+void dict_set_hash_func(dict_t d, uint64_t (*hash_func)(void *));
+uint64_t dict_hash_bytes(const void *data, size_t len);
 void dict_use_string_keys(dict_t d);
+void dict_use_concurrent_reads(dict_t d);
+void dict_synchronize(dict_t d);
 void dict_set_user_data(dict_t d, void *data);
 void * dict_get_user_data(dict_t q);
 
@@ -1,15 +1,34 @@
 /*
  * calls getChildren(path, watch: true) repeatedly
+ *
+ * When some other client runs the writer (see --write-interval), it also
+ * measures how long it took to learn about each change (fanout_notify) and
+ * to get the children that reflect it (fanout_refresh).
  */
 
+#include <stdlib.h>
+#include <string.h>
+
 #include "clients.h"
 #include "util.h"
 
 
 typedef struct {
   char following;
+  uint64_t notified_at;  /* when the last child event arrived, or 0 */
+  uint64_t last_change;  /* the newest fan-out child seen so far */
 } watcher_data;
 
+/* a getChildren in flight, freed when it completes */
+typedef struct {
+  watcher_data *wdata;
+  const void *start;
+} list_request;
+
+static int get_children_op;
+static int notify_op;
+static int refresh_op;
+
 static void *new_watcher_data(void)
 {
   watcher_data *wdata =
@@ -21,6 +40,7 @@ static void reset_watcher_data(void *data)
 {
   watcher_data *wdata = (watcher_data *)data;
   wdata->following = 0;
+  wdata->notified_at = 0;
 }
 
 static int is_connected(zhandle_t *zh)
@@ -29,40 +49,94 @@ static int is_connected(zhandle_t *zh)
   return state == ZOO_CONNECTED_STATE || state == ZOO_CONNECTED_RO_STATE;
 }
 
-/* i guess i could move console IO to another thread... */
+/* when the newest fan-out child was written, 0 if there's none */
+static uint64_t last_change(const struct String_vector *strings)
+{
+  uint64_t when, newest = 0;
+  size_t len = strlen(CLIENTS_FANOUT_PREFIX);
+  int j;
+
+  for (j=0; j < strings->count; j++) {
+    if (strncmp(strings->data[j], CLIENTS_FANOUT_PREFIX, len))
+      continue;
+
+    when = strtoull(strings->data[j] + len, NULL, 10);
+    if (when > newest)
+      newest = when;
+  }
+
+  return newest;
+}
+
 static void strings_completion(int rc,
         const struct String_vector *strings,
         const void *data) {
-  if (strings)
-      info("Got %d children", strings->count);
+  list_request *req = (list_request *)data;
+  watcher_data *wdata = req->wdata;
+  uint64_t when;
+
+  clients_record_latency(get_children_op, req->start);
+  free(req);
+  if (rc)
+    clients_record_error(get_children_op);
+
+  if (!strings)
+    return;
+
+  info("Got %d children", strings->count);
+
+  /* the first listing only tells us where we are */
+  when = last_change(strings);
+  if (when > wdata->last_change) {
+    if (wdata->notified_at > when) {
+      clients_record_value(notify_op, wdata->notified_at - when);
+      clients_record_value(refresh_op, now_nsecs() - when);
+    }
+    wdata->last_change = when;
+  }
+
+  wdata->notified_at = 0;
+}
+
+static int get_children(zhandle_t *zzh, session_context *context)
+{
+  list_request *req = (list_request *)safe_alloc(sizeof(list_request));
+  int rc;
+
+  /* there might be more than one in flight, each with its own start */
+  req->wdata = (watcher_data *)context->data;
+  req->start = clients_op_start();
+  rc = zoo_aget_children(zzh,
+                         context->path,
+                         1,
+                         strings_completion,
+                         req);
+  if (rc)
+    free(req);
+
+  return rc;
 }
 
 /* session expiration is handled for us (and a new session created) */
 void my_watcher(zhandle_t *zzh, int type, int state, const char *path)
 {
   session_context *context = (session_context *)zoo_get_context(zzh);
+  watcher_data *wdata = (watcher_data *)context->data;
   int rc;
 
   if (type != ZOO_SESSION_EVENT) {
+    if (type == ZOO_CHILD_EVENT)
+      wdata->notified_at = now_nsecs();
+
     info("%d %d %s", type, state, path);
-    rc = zoo_aget_children(zzh,
-                           context->path,
-                           1,
-                           strings_completion,
-                           NULL);
+    rc = get_children(zzh, context);
     if (rc)
       warn("Failed to list path");
 
   } else {
     if (is_connected(zzh)) {
-      watcher_data *wdata = (watcher_data *)context->data;
-
       if (!wdata->following) {
-        rc = zoo_aget_children(zzh,
-                               context->path,
-                               1,
-                               strings_completion,
-                               NULL);
+        rc = get_children(zzh, context);
         if (rc)
           warn("Failed to list path");
         else
@@ -74,6 +148,10 @@ void my_watcher(zhandle_t *zzh, int type, int state, const char *path)
 
 int main(int argc, const char **argv)
 {
+  get_children_op = clients_register_op("get_children");
+  notify_op = clients_register_op("fanout_notify");
+  refresh_op = clients_register_op("fanout_refresh");
+
   clients_run(argc,
               argv,
               &my_watcher,
@@ -0,0 +1,244 @@
+/*
+ * a binary min-heap of (key, value), i.e.: for deadlines
+ *
+ * Values can be told where they are in the heap (see heap_set_pos_func()),
+ * so they can later be updated or removed.
+ *
+ * Not thread-safe, it's meant to be owned by a single thread.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+
+#include "heap.h"
+#include "util.h"
+
+
+static void default_set_pos(void *value, int pos)
+{
+}
+
+heap_t heap_new(int size)
+{
+  heap_t h = safe_alloc(sizeof(heap));
+
+  if (size < 1)
+    size = 1;
+
+  h->entries = safe_alloc(sizeof(heap_entry) * size);
+  h->size = size;
+  h->set_pos = &default_set_pos;
+  return h;
+}
+
+void heap_destroy(heap_t h)
+{
+  assert(h);
+  assert(h->entries);
+  free(h->entries);
+  free(h);
+}
+
+void heap_set_pos_func(heap_t h, void (*set_pos)(void *, int))
+{
+  h->set_pos = set_pos;
+}
+
+static void put(heap_t h, int pos, heap_entry *entry)
+{
+  h->entries[pos] = *entry;
+  h->set_pos(entry->value, pos);
+}
+
+static void sift_up(heap_t h, int pos)
+{
+  heap_entry entry = h->entries[pos];
+  int parent;
+
+  while (pos > 0) {
+    parent = (pos - 1) / 2;
+    if (h->entries[parent].key <= entry.key)
+      break;
+    put(h, pos, &h->entries[parent]);
+    pos = parent;
+  }
+
+  put(h, pos, &entry);
+}
+
+static void sift_down(heap_t h, int pos)
+{
+  heap_entry entry = h->entries[pos];
+  int child;
+
+  while ((child = 2 * pos + 1) < h->count) {
+    if (child + 1 < h->count &&
+        h->entries[child + 1].key < h->entries[child].key)
+      child++;
+    if (entry.key <= h->entries[child].key)
+      break;
+    put(h, pos, &h->entries[child]);
+    pos = child;
+  }
+
+  put(h, pos, &entry);
+}
+
+void heap_push(heap_t h, uint64_t key, void *value)
+{
+  if (h->count == h->size) {
+    h->entries = safe_realloc(h->entries,
+                              sizeof(heap_entry) * h->size,
+                              sizeof(heap_entry) * h->size * 2);
+    h->size *= 2;
+  }
+
+  h->entries[h->count].key = key;
+  h->entries[h->count].value = value;
+  sift_up(h, h->count++);
+}
+
+/* the value with the smallest key (stored in *key), or NULL if empty */
+void * heap_peek(heap_t h, uint64_t *key)
+{
+  if (!h->count)
+    return NULL;
+
+  if (key)
+    *key = h->entries[0].key;
+
+  return h->entries[0].value;
+}
+
+void * heap_pop(heap_t h, uint64_t *key)
+{
+  if (!h->count)
+    return NULL;
+
+  if (key)
+    *key = h->entries[0].key;
+
+  return heap_remove(h, 0);
+}
+
+/* changes the key of the value at pos */
+void heap_update(heap_t h, int pos, uint64_t key)
+{
+  uint64_t old;
+
+  assert(pos >= 0 && pos < h->count);
+
+  old = h->entries[pos].key;
+  h->entries[pos].key = key;
+
+  if (key < old)
+    sift_up(h, pos);
+  else
+    sift_down(h, pos);
+}
+
+void * heap_remove(heap_t h, int pos)
+{
+  void *value;
+
+  assert(pos >= 0 && pos < h->count);
+
+  value = h->entries[pos].value;
+  h->set_pos(value, -1);
+
+  if (pos != --h->count) {
+    put(h, pos, &h->entries[h->count]);
+    heap_update(h, pos, h->entries[pos].key);
+  }
+
+  return value;
+}
+
+int heap_count(heap_t h)
+{
+  return h->count;
+}
+
+
+#ifdef RUN_TESTS
+
+typedef struct {
+  int pos;
+} timer;
+
+static void timer_set_pos(void *value, int pos)
+{
+  ((timer *)value)->pos = pos;
+}
+
+static void test_order(void)
+{
+  uint64_t keys[] = { 50, 10, 40, 20, 30, 10 };
+  uint64_t key, last = 0;
+  heap_t h = heap_new(2);
+  int i;
+
+  for (i=0; i < 6; i++)
+    heap_push(h, keys[i], &keys[i]);
+
+  info("heap has %d items", heap_count(h));
+  assert(heap_count(h) == 6);
+
+  for (i=0; i < 6; i++) {
+    assert(*(uint64_t *)heap_pop(h, &key) == key);
+    assert(key >= last);
+    last = key;
+  }
+
+  assert(heap_pop(h, NULL) == NULL);
+  assert(heap_count(h) == 0);
+
+  heap_destroy(h);
+}
+
+static void test_update_remove(void)
+{
+  timer timers[4];
+  uint64_t key;
+  heap_t h = heap_new(4);
+  int i;
+
+  heap_set_pos_func(h, &timer_set_pos);
+
+  for (i=0; i < 4; i++)
+    heap_push(h, (i + 1) * 10, &timers[i]);
+
+  assert(heap_peek(h, &key) == &timers[0]);
+  assert(key == 10);
+
+  /* push the first one to the back */
+  heap_update(h, timers[0].pos, 100);
+  assert(heap_peek(h, &key) == &timers[1]);
+  assert(key == 20);
+
+  /* and bring the last one to the front */
+  heap_update(h, timers[3].pos, 5);
+  assert(heap_peek(h, &key) == &timers[3]);
+  assert(key == 5);
+
+  assert(heap_remove(h, timers[1].pos) == &timers[1]);
+  assert(timers[1].pos == -1);
+  assert(heap_count(h) == 3);
+
+  assert(heap_pop(h, NULL) == &timers[3]);
+  assert(heap_pop(h, NULL) == &timers[2]);
+  assert(heap_pop(h, NULL) == &timers[0]);
+  assert(timers[0].pos == -1);
+
+  heap_destroy(h);
+}
+
+int main(int argc, char **argv)
+{
+  run_test("pop in order", &test_order);
+  run_test("update & remove", &test_update_remove);
+
+  return 0;
+}
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef _HEAP_H_
+#define _HEAP_H_
+
+#include <stdint.h>
+
+typedef struct {
+  uint64_t key;
+  void *value;
+} heap_entry;
+
+typedef struct {
+  heap_entry *entries;
+  int count;
+  int size;
+  void (*set_pos)(void *value, int pos); /* -1 once it's out of the heap */
+} heap;
+
+typedef heap * heap_t;
+
+heap_t heap_new(int size);
+void heap_destroy(heap_t h);
+void heap_set_pos_func(heap_t h, void (*set_pos)(void *, int));
+void heap_push(heap_t h, uint64_t key, void *value);
+void * heap_peek(heap_t h, uint64_t *key);
+void * heap_pop(heap_t h, uint64_t *key);
+void heap_update(heap_t h, int pos, uint64_t key);
+void * heap_remove(heap_t h, int pos);
+int heap_count(heap_t h);
+
+#endif
@@ -0,0 +1,250 @@
+/*
+ * a log-linear (HDR-style) histogram of uint64_t values, i.e.: latencies
+ *
+ * Values below 2^HISTOGRAM_SUB_BITS get a bucket each; past that, every
+ * power of 2 is split into 2^(HISTOGRAM_SUB_BITS - 1) equal buckets, so
+ * any value is off by at most ~1.6% once bucketed.
+ *
+ * Meant to have a single writer (i.e.: a histogram per thread). Others can
+ * read it at any time with histogram_merge(), without locking.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "histogram.h"
+#include "util.h"
+
+
+#define SUB_COUNT   (1ULL << HISTOGRAM_SUB_BITS)
+#define HALF_COUNT  (1ULL << (HISTOGRAM_SUB_BITS - 1))
+
+histogram_t histogram_new(void)
+{
+  return (histogram_t)safe_alloc(sizeof(histogram));
+}
+
+void histogram_destroy(histogram_t h)
+{
+  assert(h);
+  free(h);
+}
+
+static int bucket_of(uint64_t value)
+{
+  int shift;
+
+  if (value < SUB_COUNT)
+    return (int)value;
+
+  shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS + 1;
+  return (int)(shift * HALF_COUNT + (value >> shift));
+}
+
+/* the highest value that lands in the given bucket */
+static uint64_t bucket_max(int bucket)
+{
+  uint64_t shift, sub;
+
+  if (bucket < SUB_COUNT)
+    return (uint64_t)bucket;
+
+  shift = bucket / HALF_COUNT - 1;
+  sub = bucket - shift * HALF_COUNT;
+  return (sub << shift) + ((1ULL << shift) - 1);
+}
+
+/* only the owner records, so plain (but atomic) stores are enough */
+void histogram_record(histogram_t h, uint64_t value)
+{
+  int bucket = bucket_of(value);
+
+  __atomic_store_n(&h->counts[bucket], h->counts[bucket] + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&h->total, h->total + 1, __ATOMIC_RELAXED);
+  if (value > h->max)
+    __atomic_store_n(&h->max, value, __ATOMIC_RELAXED);
+}
+
+/* src might be being recorded to, dst must be owned by the caller */
+void histogram_merge(histogram_t dst, histogram_t src)
+{
+  uint64_t count, max;
+  int j;
+
+  for (j=0; j < HISTOGRAM_BUCKETS; j++) {
+    count = __atomic_load_n(&src->counts[j], __ATOMIC_RELAXED);
+    dst->counts[j] += count;
+    dst->total += count;
+  }
+
+  max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+  if (max > dst->max)
+    dst->max = max;
+}
+
+/*
+ * What was recorded since src was a copy of dst, i.e.: an interval out of
+ * two cumulative snapshots. Both are owned by the caller. Its max is only
+ * as precise as its buckets, unless it's the all time max.
+ */
+void histogram_subtract(histogram_t dst, histogram_t src)
+{
+  int j, top = -1;
+
+  dst->total = 0;
+  for (j=0; j < HISTOGRAM_BUCKETS; j++) {
+    dst->counts[j] -= src->counts[j] < dst->counts[j] ? src->counts[j] : dst->counts[j];
+    dst->total += dst->counts[j];
+    if (dst->counts[j])
+      top = j;
+  }
+
+  if (top == -1)
+    dst->max = 0;
+  else if (bucket_max(top) < dst->max)
+    dst->max = bucket_max(top);
+}
+
+void histogram_reset(histogram_t h)
+{
+  memset(h, 0, sizeof(histogram));
+}
+
+uint64_t histogram_count(histogram_t h)
+{
+  return __atomic_load_n(&h->total, __ATOMIC_RELAXED);
+}
+
+uint64_t histogram_max(histogram_t h)
+{
+  return __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+}
+
+/* percentile is in [0, 100], returns 0 for an empty histogram */
+uint64_t histogram_percentile(histogram_t h, double percentile)
+{
+  uint64_t target, seen = 0, value;
+  int j;
+
+  if (!h->total)
+    return 0;
+
+  if (percentile >= 100.0)
+    return h->max;
+
+  target = (uint64_t)(percentile / 100.0 * h->total + 0.5);
+  if (target < 1)
+    target = 1;
+
+  for (j=0; j < HISTOGRAM_BUCKETS; j++) {
+    seen += h->counts[j];
+    if (seen >= target)
+      break;
+  }
+
+  value = bucket_max(j < HISTOGRAM_BUCKETS ? j : HISTOGRAM_BUCKETS - 1);
+  return value < h->max ? value : h->max;
+}
+
+
+#ifdef RUN_TESTS
+
+static void test_buckets(void)
+{
+  uint64_t values[] = { 0, 1, 127, 128, 130, 1000, 123456789, ~0ULL };
+  uint64_t value;
+  int j, bucket, last = -1;
+
+  for (j=0; j < sizeof(values) / sizeof(values[0]); j++) {
+    value = values[j];
+    bucket = bucket_of(value);
+
+    assert(bucket > last);
+    assert(bucket < HISTOGRAM_BUCKETS);
+    assert(bucket_max(bucket) >= value);
+    assert(bucket_max(bucket) - value <= value / HALF_COUNT);
+    last = bucket;
+  }
+
+  /* buckets are contiguous */
+  for (j=1; j < HISTOGRAM_BUCKETS; j++)
+    assert(bucket_of(bucket_max(j - 1) + 1) == j);
+}
+
+static void test_percentiles(void)
+{
+  histogram_t h = histogram_new();
+  uint64_t p50, p99;
+  int j;
+
+  assert(histogram_percentile(h, 50.0) == 0);
+
+  /* 1..100000 usecs, in nsecs */
+  for (j=1; j <= 100000; j++)
+    histogram_record(h, (uint64_t)j * 1000);
+
+  p50 = histogram_percentile(h, 50.0);
+  p99 = histogram_percentile(h, 99.0);
+  info("p50=%lu p99=%lu max=%lu", p50, p99, histogram_max(h));
+
+  assert(histogram_count(h) == 100000);
+  assert(p50 >= 50000000 && p50 <= 50000000 + 50000000 / HALF_COUNT);
+  assert(p99 >= 99000000 && p99 <= 99000000 + 99000000 / HALF_COUNT);
+  assert(histogram_percentile(h, 100.0) == 100000000);
+  assert(histogram_percentile(h, 0.0) >= 1000);
+  assert(histogram_percentile(h, 0.0) <= 1000 + 1000 / HALF_COUNT);
+
+  histogram_destroy(h);
+}
+
+static void test_merge(void)
+{
+  histogram_t a = histogram_new();
+  histogram_t b = histogram_new();
+  histogram_t all = histogram_new();
+  int j;
+
+  for (j=0; j < 1000; j++) {
+    histogram_record(a, 10);
+    histogram_record(b, 1000000);
+  }
+
+  histogram_merge(all, a);
+  histogram_merge(all, b);
+
+  assert(histogram_count(all) == 2000);
+  assert(histogram_max(all) == 1000000);
+  assert(histogram_percentile(all, 50.0) == 10);
+  assert(histogram_percentile(all, 50.1) >= 1000000);
+
+  /* since a was all there was */
+  histogram_subtract(all, a);
+  assert(histogram_count(all) == 1000);
+  assert(histogram_percentile(all, 1.0) >= 1000000);
+  assert(histogram_max(all) == 1000000);
+
+  histogram_merge(a, a);
+  histogram_subtract(a, b);
+  assert(histogram_count(a) == 2000);
+  assert(histogram_percentile(a, 100.0) == 10);
+
+  histogram_reset(all);
+  assert(histogram_count(all) == 0);
+  assert(histogram_max(all) == 0);
+
+  histogram_destroy(a);
+  histogram_destroy(b);
+  histogram_destroy(all);
+}
+
+int main(int argc, char **argv)
+{
+  run_test("buckets", &test_buckets);
+  run_test("percentiles", &test_percentiles);
+  run_test("merge & subtract", &test_merge);
+
+  return 0;
+}
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef _HISTOGRAM_H_
+#define _HISTOGRAM_H_
+
+#include <stdint.h>
+
+/* 2^HISTOGRAM_SUB_BITS linear sub-buckets per power of 2, i.e.: ~1% error */
+#define HISTOGRAM_SUB_BITS   7
+#define HISTOGRAM_BUCKETS    ((66 - HISTOGRAM_SUB_BITS) << (HISTOGRAM_SUB_BITS - 1))
+
+typedef struct {
+  uint64_t counts[HISTOGRAM_BUCKETS];
+  uint64_t total;
+  uint64_t max;
+} histogram;
+
+typedef histogram * histogram_t;
+
+histogram_t histogram_new(void);
+void histogram_destroy(histogram_t h);
+void histogram_record(histogram_t h, uint64_t value);
+void histogram_merge(histogram_t dst, histogram_t src);
+void histogram_subtract(histogram_t dst, histogram_t src);
+void histogram_reset(histogram_t h);
+uint64_t histogram_count(histogram_t h);
+uint64_t histogram_max(histogram_t h);
+uint64_t histogram_percentile(histogram_t h, double percentile);
+
+#endif
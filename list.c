@@ -369,4 +369,57 @@ int main(int argc, char **argv)
 }
 
 
+#endif
+
+#ifdef RUN_BENCH
+
+#include <stdio.h>
+
+#define BENCH_OPS       (1 << 18)
+
+/*
+ * Fill a list up, then take the values out newest first: that's the worst
+ * case for list_remove_by_value(), since it has to walk the whole list.
+ */
+static void bench_append_remove(int length)
+{
+  list_t l = list_new(length);
+  uint64_t start, appends = 0, removes = 0;
+  char params[64];
+  long ops = 0;
+  int i;
+
+  while (ops < BENCH_OPS) {
+    start = now_nsecs();
+    for (i=0; i < length; i++)
+      list_append(l, (void *)(long)(i + 1));
+    appends += now_nsecs() - start;
+
+    start = now_nsecs();
+    for (i=length - 1; i >= 0; i--)
+      list_remove_by_value(l, (void *)(long)(i + 1));
+    removes += now_nsecs() - start;
+
+    ops += length;
+  }
+
+  assert(list_count(l) == 0);
+
+  snprintf(params, sizeof(params), "op=append length=%d", length);
+  bench_report("list", params, ops, appends);
+  snprintf(params, sizeof(params), "op=remove_by_value length=%d", length);
+  bench_report("list", params, ops, removes);
+
+  list_destroy(l);
+}
+
+int main(int argc, char **argv)
+{
+  bench_append_remove(16);
+  bench_append_remove(256);
+  bench_append_remove(4096);
+
+  return 0;
+}
+
 #endif
@@ -0,0 +1,2018 @@
+/*
+ * a mock ZooKeeper server, to load test the clients without an ensemble
+ *
+ * It speaks just enough of the wire protocol for these tools: the connect
+ * handshake (including reconnecting to an existing session), pings,
+ * create (ephemeral and/or sequential), delete, exists, getData, setData,
+ * getChildren(2), multi, sync, setWatches and closeSession. Watches are
+ * one-shot and per connection, like the real thing, and sessions expire
+ * when nothing is heard from them within their timeout (which deletes
+ * their ephemerals).
+ *
+ * Everything lives in memory and a single thread serves every connection
+ * off epoll, so it can hold hundreds of thousands of sessions. ACLs and
+ * auth are accepted and ignored. The response latency can be made worse
+ * on purpose (see --latency & --jitter), to tell client-side limits from
+ * server-side ones.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dict.h"
+#include "heap.h"
+#include "util.h"
+
+
+#define DEFAULT_PORT            2181
+#define DEFAULT_MAX_NODES       (1 << 16)
+#define DEFAULT_MAX_EVENTS      1024
+#define DEFAULT_MIN_TIMEOUT     4000    /* msecs, like tickTime * 2 */
+#define DEFAULT_MAX_TIMEOUT     40000   /* msecs, like tickTime * 20 */
+#define DEFAULT_STATS_INTERVAL  10      /* secs */
+#define PATH_DICT_SIZE          1024    /* to start with, they grow */
+
+#define READ_BUFFER_SIZE        (1 << 16)
+#define MAX_PACKET_SIZE         (1 << 22)
+#define MAX_PATH_SIZE           1024
+#define MAX_MULTI_OPS           128
+#define PASSWD_SIZE             16
+#define SLOT_BITS               24      /* session ids are epoch:gen:slot */
+#define ACCEPT_PAUSE_MS         100     /* when out of fds */
+
+/* op codes */
+#define OP_CREATE               1
+#define OP_DELETE               2
+#define OP_EXISTS               3
+#define OP_GET_DATA             4
+#define OP_SET_DATA             5
+#define OP_GET_ACL              6
+#define OP_GET_CHILDREN         8
+#define OP_SYNC                 9
+#define OP_PING                 11
+#define OP_GET_CHILDREN2        12
+#define OP_CHECK                13
+#define OP_MULTI                14
+#define OP_CREATE2              15
+#define OP_AUTH                 100
+#define OP_SET_WATCHES          101
+#define OP_CLOSE                -11
+#define OP_ERROR                -1
+
+/* error codes */
+#define ERR_OK                  0
+#define ERR_SYSTEM              -1
+#define ERR_INCONSISTENCY       -2
+#define ERR_UNIMPLEMENTED       -6
+#define ERR_BAD_ARGUMENTS       -8
+#define ERR_NO_NODE             -101
+#define ERR_BAD_VERSION         -103
+#define ERR_EPHEMERAL_PARENT    -108
+#define ERR_NODE_EXISTS         -110
+#define ERR_NOT_EMPTY           -111
+
+/* watch events */
+#define EVENT_CREATED           1
+#define EVENT_DELETED           2
+#define EVENT_CHANGED           3
+#define EVENT_CHILD             4
+#define STATE_CONNECTED         3
+
+#define XID_WATCH               -1
+
+#define FLAG_EPHEMERAL          1
+#define FLAG_SEQUENCE           2
+
+#define PERMS_ALL               31
+
+
+typedef struct session session;
+typedef struct connection connection;
+
+typedef struct znode {
+  char *path;
+  const char *name;             /* the last component of path */
+  char *data;
+  int data_len;
+  int64_t czxid;
+  int64_t mzxid;
+  int64_t pzxid;
+  int64_t ctime;
+  int64_t mtime;
+  int version;
+  int cversion;
+  int num_children;
+  session *owner;               /* for ephemerals */
+  struct znode *parent;
+  struct znode *children;
+  struct znode *prev_sibling;
+  struct znode *next_sibling;
+  struct znode *prev_ephemeral; /* the owner's */
+  struct znode *next_ephemeral;
+} znode;
+
+typedef struct watch watch;
+
+/* everyone watching a path, for one kind of watch */
+typedef struct {
+  char *path;
+  dict_t watches;               /* the one it's in */
+  watch *head;
+} watch_list;
+
+typedef struct watch {
+  session *session;
+  watch_list *list;
+  watch *prev;
+  watch *next;
+  int index;                    /* in session->watches */
+} watch;
+
+struct session {
+  int64_t id;
+  char passwd[PASSWD_SIZE];
+  int timeout;                  /* msecs */
+  uint64_t deadline;            /* it expires if nothing's heard by then */
+  int heap_pos;
+  int slot;
+  unsigned gen;                 /* bumped every time the slot is reused */
+  int next_free;
+  connection *conn;             /* NULL while it's disconnected */
+  znode *ephemerals;
+  watch **watches;              /* go away with the connection */
+  int watch_count;
+  int watch_size;
+};
+
+struct connection {
+  int fd;                       /* -1 once it's closed */
+  session *session;
+  char *in;                     /* a partial packet */
+  int in_len;
+  int in_size;
+  char *out;
+  int out_pos;
+  int out_len;
+  int out_size;
+  int writing;                  /* waiting for EPOLLOUT */
+  int closing;                  /* close once everything is out */
+  int pending;                  /* delayed packets not out yet */
+  uint64_t last_due;
+  connection *next_dirty;
+  int dirty;
+};
+
+/* a packet held back by --latency/--jitter */
+typedef struct {
+  connection *conn;
+  int len;
+  char buf[];
+} delayed;
+
+typedef struct {
+  char *buf;
+  int len;
+  int size;
+} packet;
+
+typedef struct {
+  const char *buf;
+  int len;
+  int pos;
+  int bad;
+} reader;
+
+/* what it takes to roll back a change, or to finish it on commit */
+typedef struct {
+  int op;
+  znode *node;
+  char *data;                   /* the previous data, for OP_SET_DATA */
+  int data_len;
+  int version;
+  int64_t mzxid;
+  int64_t mtime;
+} undo;
+
+typedef struct {
+  int type;
+  int child;                    /* a child watch, or else a data watch */
+  char *path;
+} pending_event;
+
+typedef struct {
+  int64_t zxid;
+  undo *undos;
+  int undo_count;
+  int undo_size;
+  pending_event *events;
+  int event_count;
+  int event_size;
+} txn;
+
+typedef struct {
+  int type;
+  char path[MAX_PATH_SIZE];
+  const char *data;
+  int data_len;
+  int flags;
+  int version;
+  int err;
+  znode *node;
+} multi_op;
+
+typedef struct {
+  const char *bind_addr;
+  int port;
+  int max_nodes;
+  int max_events;
+  int min_timeout;
+  int max_timeout;
+  int latency;                  /* msecs */
+  int jitter;                   /* msecs */
+  int stats_interval;
+  char *paths;
+} server_params;
+
+
+static server_params g_params;
+static int g_epfd;
+static int g_listen_fd;
+static uint64_t g_now;
+static uint64_t g_accept_paused;  /* until when, or 0 */
+static int64_t g_zxid;
+static unsigned g_epoch;
+
+static dict_t g_nodes;            /* path -> znode */
+static dict_t g_data_watches;     /* path -> watch_list (exists & getData) */
+static dict_t g_child_watches;    /* path -> watch_list (getChildren) */
+static znode *g_root;
+
+static session **g_sessions;      /* by slot */
+static int g_session_slots;
+static int g_free_slot = -1;
+static heap_t g_expirations;      /* sessions, by deadline */
+static heap_t g_delayed;          /* delayed packets, by when they're due */
+static connection *g_dirty;       /* have output to flush */
+
+static packet g_reply;
+static packet g_event;
+
+static long g_sessions_live;
+static long g_connections;
+static long g_watch_count;
+static long g_requests;
+static long g_expired;
+
+
+static void help(void);
+static void parse_argv(int argc, const char **argv);
+static void close_connection(connection *conn);
+static void release_connection(connection *conn);
+static void expire_session(session *s);
+static void fire_watches(dict_t watches, const char *path, int type);
+
+
+/* jute: big endian ints & longs, length-prefixed buffers & strings */
+
+static void out_reserve(packet *p, int count)
+{
+  int size = p->size ? p->size : 256;
+
+  while (p->len + count > size)
+    size *= 2;
+
+  if (size != p->size) {
+    p->buf = safe_realloc(p->buf, p->size, size);
+    p->size = size;
+  }
+}
+
+static void out_int(packet *p, int32_t value)
+{
+  uint32_t v = htonl((uint32_t)value);
+
+  out_reserve(p, 4);
+  memcpy(p->buf + p->len, &v, 4);
+  p->len += 4;
+}
+
+static void out_long(packet *p, int64_t value)
+{
+  out_int(p, (int32_t)((uint64_t)value >> 32));
+  out_int(p, (int32_t)(value & 0xffffffff));
+}
+
+static void out_bool(packet *p, int value)
+{
+  out_reserve(p, 1);
+  p->buf[p->len++] = value ? 1 : 0;
+}
+
+static void out_buffer(packet *p, const char *data, int len)
+{
+  if (!data) {
+    out_int(p, -1);
+    return;
+  }
+
+  out_int(p, len);
+  out_reserve(p, len);
+  memcpy(p->buf + p->len, data, len);
+  p->len += len;
+}
+
+static void out_string(packet *p, const char *s)
+{
+  out_buffer(p, s, strlen(s));
+}
+
+static void out_stat(packet *p, const znode *node)
+{
+  out_long(p, node->czxid);
+  out_long(p, node->mzxid);
+  out_long(p, node->ctime);
+  out_long(p, node->mtime);
+  out_int(p, node->version);
+  out_int(p, node->cversion);
+  out_int(p, 0);  /* aversion */
+  out_long(p, node->owner ? node->owner->id : 0);
+  out_int(p, node->data_len);
+  out_int(p, node->num_children);
+  out_long(p, node->pzxid);
+}
+
+/* leaves room for the length, see end_packet() */
+static void begin_packet(packet *p)
+{
+  p->len = 0;
+  out_int(p, 0);
+}
+
+static void begin_reply(packet *p, int xid, int err)
+{
+  begin_packet(p);
+  out_int(p, xid);
+  out_long(p, g_zxid);
+  out_int(p, err);
+}
+
+/* for replies begun before the change was committed */
+static void set_reply_zxid(packet *p)
+{
+  uint32_t v[2];
+
+  v[0] = htonl((uint32_t)((uint64_t)g_zxid >> 32));
+  v[1] = htonl((uint32_t)(g_zxid & 0xffffffff));
+  memcpy(p->buf + 8, v, 8);
+}
+
+static void end_packet(packet *p)
+{
+  uint32_t len = htonl(p->len - 4);
+
+  memcpy(p->buf, &len, 4);
+}
+
+static int32_t in_int(reader *r)
+{
+  uint32_t v;
+
+  if (r->bad || r->len - r->pos < 4) {
+    r->bad = 1;
+    return 0;
+  }
+
+  memcpy(&v, r->buf + r->pos, 4);
+  r->pos += 4;
+  return (int32_t)ntohl(v);
+}
+
+static int64_t in_long(reader *r)
+{
+  uint64_t high = (uint32_t)in_int(r);
+  uint64_t low = (uint32_t)in_int(r);
+
+  return (int64_t)(high << 32 | low);
+}
+
+static int in_bool(reader *r)
+{
+  if (r->bad || r->pos >= r->len) {
+    r->bad = 1;
+    return 0;
+  }
+
+  return r->buf[r->pos++] != 0;
+}
+
+/* points into the packet, NULL for a null buffer (*len is then -1) */
+static const char *in_buffer(reader *r, int *len)
+{
+  const char *data;
+
+  *len = in_int(r);
+  if (r->bad || *len < 0)
+    return NULL;
+
+  if (r->len - r->pos < *len) {
+    r->bad = 1;
+    return NULL;
+  }
+
+  data = r->buf + r->pos;
+  r->pos += *len;
+  return data;
+}
+
+static void in_string(reader *r, char *dst, int size)
+{
+  const char *s;
+  int len;
+
+  s = in_buffer(r, &len);
+  if (!s || len >= size) {
+    r->bad = 1;
+    dst[0] = '\0';
+    return;
+  }
+
+  memcpy(dst, s, len);
+  dst[len] = '\0';
+}
+
+/* ACLs are accepted but ignored */
+static void skip_acls(reader *r)
+{
+  char buf[MAX_PATH_SIZE];
+  int count, i;
+
+  count = in_int(r);
+  for (i=0; i < count && !r->bad; i++) {
+    in_int(r);
+    in_string(r, buf, sizeof(buf));
+    in_string(r, buf, sizeof(buf));
+  }
+}
+
+
+/* sending */
+
+static void mark_dirty(connection *conn)
+{
+  if (conn->dirty)
+    return;
+
+  conn->dirty = 1;
+  conn->next_dirty = g_dirty;
+  g_dirty = conn;
+}
+
+static void append_out(connection *conn, const char *buf, int len)
+{
+  int size;
+
+  if (conn->out_len + len > conn->out_size) {
+    size = conn->out_size ? conn->out_size : 512;
+    while (conn->out_len + len > size)
+      size *= 2;
+    conn->out = safe_realloc(conn->out, conn->out_size, size);
+    conn->out_size = size;
+  }
+
+  memcpy(conn->out + conn->out_len, buf, len);
+  conn->out_len += len;
+  mark_dirty(conn);
+}
+
+/* keeps the order per connection, even with jitter */
+static void send_packet(connection *conn, packet *p)
+{
+  delayed *d;
+  uint64_t due;
+
+  end_packet(p);
+
+  if (conn->fd == -1)
+    return;
+
+  if (!g_params.latency && !g_params.jitter) {
+    append_out(conn, p->buf, p->len);
+    return;
+  }
+
+  due = g_now + g_params.latency * 1000000ULL;
+  if (g_params.jitter)
+    due += (uint64_t)(random() % (g_params.jitter * 1000 + 1)) * 1000;
+  if (due <= conn->last_due)
+    due = conn->last_due + 1;
+  conn->last_due = due;
+
+  d = safe_alloc(sizeof(delayed) + p->len);
+  d->conn = conn;
+  d->len = p->len;
+  memcpy(d->buf, p->buf, p->len);
+  conn->pending++;
+  heap_push(g_delayed, due, d);
+}
+
+static void send_due(void)
+{
+  delayed *d;
+  uint64_t due;
+
+  while (heap_peek(g_delayed, &due) && due <= g_now) {
+    d = heap_pop(g_delayed, NULL);
+    d->conn->pending--;
+    if (d->conn->fd != -1)
+      append_out(d->conn, d->buf, d->len);
+    else
+      release_connection(d->conn);
+    free(d);
+  }
+}
+
+static void set_writing(connection *conn, int writing)
+{
+  struct epoll_event ev;
+
+  if (conn->writing == writing)
+    return;
+
+  ev.events = EPOLLIN | (writing ? EPOLLOUT : 0);
+  ev.data.ptr = conn;
+  if (epoll_ctl(g_epfd, EPOLL_CTL_MOD, conn->fd, &ev))
+    error(EXIT_SYSTEM_CALL, "epoll_ctl() failed: %s", strerror(errno));
+  conn->writing = writing;
+}
+
+static void flush_connection(connection *conn)
+{
+  ssize_t n;
+
+  while (conn->out_pos < conn->out_len) {
+    n = write(conn->fd, conn->out + conn->out_pos, conn->out_len - conn->out_pos);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        set_writing(conn, 1);
+        return;
+      }
+      close_connection(conn);
+      return;
+    }
+    conn->out_pos += n;
+  }
+
+  conn->out_pos = conn->out_len = 0;
+  set_writing(conn, 0);
+
+  if (conn->closing && !conn->pending)
+    close_connection(conn);
+}
+
+static void flush_dirty(void)
+{
+  connection *conn;
+
+  while (g_dirty) {
+    conn = g_dirty;
+    g_dirty = conn->next_dirty;
+    conn->dirty = 0;
+
+    if (conn->fd != -1 && !conn->writing)
+      flush_connection(conn);
+
+    release_connection(conn);
+  }
+}
+
+
+/* sessions */
+
+static void session_set_pos(void *value, int pos)
+{
+  ((session *)value)->heap_pos = pos;
+}
+
+static session *new_session(int timeout)
+{
+  session *s;
+  int slot, i;
+
+  if (g_free_slot != -1) {
+    slot = g_free_slot;
+    s = g_sessions[slot];
+    g_free_slot = s->next_free;
+    s->gen++;
+  } else {
+    if (g_session_slots == 1 << SLOT_BITS)
+      return NULL;
+    if ((g_session_slots & (g_session_slots - 1)) == 0)
+      g_sessions = safe_realloc(g_sessions,
+                                sizeof(session *) * g_session_slots,
+                                sizeof(session *) * (g_session_slots ? g_session_slots * 2 : 1));
+    slot = g_session_slots++;
+    s = g_sessions[slot] = safe_alloc(sizeof(session));
+    s->slot = slot;
+  }
+
+  s->id = (int64_t)g_epoch << 48 |
+    (int64_t)(s->gen & ((1 << (48 - SLOT_BITS)) - 1)) << SLOT_BITS |
+    slot;
+  for (i=0; i < PASSWD_SIZE; i++)
+    s->passwd[i] = (char)random();
+  s->timeout = timeout;
+  s->deadline = g_now + timeout * 1000000ULL;
+  s->next_free = -1;
+  heap_push(g_expirations, s->deadline, s);
+  g_sessions_live++;
+
+  return s;
+}
+
+static session *find_session(int64_t id)
+{
+  int slot = id & ((1 << SLOT_BITS) - 1);
+  session *s;
+
+  if (slot >= g_session_slots)
+    return NULL;
+
+  s = g_sessions[slot];
+  return s->heap_pos != -1 && s->id == id ? s : NULL;
+}
+
+static void touch_session(session *s)
+{
+  /* the heap catches up lazily, see expire_sessions() */
+  s->deadline = g_now + s->timeout * 1000000ULL;
+}
+
+static void unlink_session_watch(watch *w)
+{
+  session *s = w->session;
+
+  s->watches[w->index] = s->watches[--s->watch_count];
+  s->watches[w->index]->index = w->index;
+}
+
+/* the whole list goes away with its last watch */
+static void drop_watch(watch *w)
+{
+  watch_list *wl = w->list;
+
+  if (w->prev)
+    w->prev->next = w->next;
+  else
+    wl->head = w->next;
+  if (w->next)
+    w->next->prev = w->prev;
+
+  unlink_session_watch(w);
+  free(w);
+  g_watch_count--;
+
+  if (!wl->head) {
+    dict_unset(wl->watches, wl->path);
+    free(wl->path);
+    free(wl);
+  }
+}
+
+static void add_watch(dict_t watches, const char *path, session *s)
+{
+  watch_list *wl;
+  watch *w;
+  int i;
+
+  wl = dict_get(watches, (void *)path);
+  if (!wl) {
+    wl = safe_alloc(sizeof(watch_list));
+    wl->path = safe_strdup(path);
+    wl->watches = watches;
+    dict_set(watches, wl->path, wl);
+  }
+
+  for (i=0; i < s->watch_count; i++)
+    if (s->watches[i]->list == wl)
+      return;
+
+  if (s->watch_count == s->watch_size) {
+    s->watches = safe_realloc(s->watches,
+                              sizeof(watch *) * s->watch_size,
+                              sizeof(watch *) * (s->watch_size ? s->watch_size * 2 : 4));
+    s->watch_size = s->watch_size ? s->watch_size * 2 : 4;
+  }
+
+  w = safe_alloc(sizeof(watch));
+  w->session = s;
+  w->list = wl;
+  w->next = wl->head;
+  if (wl->head)
+    wl->head->prev = w;
+  wl->head = w;
+  w->index = s->watch_count;
+  s->watches[s->watch_count++] = w;
+  g_watch_count++;
+}
+
+/* watches are per connection: the client sets them again on reconnect */
+static void detach_session(session *s)
+{
+  while (s->watch_count)
+    drop_watch(s->watches[s->watch_count - 1]);
+
+  if (s->conn)
+    s->conn->session = NULL;
+  s->conn = NULL;
+}
+
+static void attach_session(session *s, connection *conn)
+{
+  if (s->conn)
+    close_connection(s->conn);
+
+  s->conn = conn;
+  conn->session = s;
+  touch_session(s);
+}
+
+
+/* the tree */
+
+static int64_t realtime_msecs(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static int valid_path(const char *path)
+{
+  int len = strlen(path);
+
+  if (path[0] != '/')
+    return 0;
+  if (len > 1 && path[len - 1] == '/')
+    return 0;
+  return strstr(path, "//") == NULL;
+}
+
+/* the parent's path goes in buf */
+static znode *find_parent(const char *path, char *buf)
+{
+  char *slash;
+
+  strcpy(buf, path);
+  slash = strrchr(buf, '/');
+  if (slash == buf)
+    slash++;
+  *slash = '\0';
+
+  return dict_get(g_nodes, buf);
+}
+
+static znode *new_znode(const char *path, const char *data, int len)
+{
+  znode *node = safe_alloc(sizeof(znode));
+
+  node->path = safe_strdup(path);
+  node->name = strrchr(node->path, '/') + 1;
+  if (len > 0) {
+    node->data = safe_alloc(len);
+    memcpy(node->data, data, len);
+    node->data_len = len;
+  }
+
+  return node;
+}
+
+static void free_znode(znode *node)
+{
+  free(node->path);
+  free(node->data);
+  free(node);
+}
+
+static void link_znode(znode *node)
+{
+  znode *parent = node->parent;
+  session *s = node->owner;
+
+  node->prev_sibling = NULL;
+  node->next_sibling = parent->children;
+  if (parent->children)
+    parent->children->prev_sibling = node;
+  parent->children = node;
+  parent->num_children++;
+
+  if (s) {
+    node->prev_ephemeral = NULL;
+    node->next_ephemeral = s->ephemerals;
+    if (s->ephemerals)
+      s->ephemerals->prev_ephemeral = node;
+    s->ephemerals = node;
+  }
+
+  dict_set(g_nodes, node->path, node);
+}
+
+static void unlink_znode(znode *node)
+{
+  znode *parent = node->parent;
+  session *s = node->owner;
+
+  if (node->prev_sibling)
+    node->prev_sibling->next_sibling = node->next_sibling;
+  else
+    parent->children = node->next_sibling;
+  if (node->next_sibling)
+    node->next_sibling->prev_sibling = node->prev_sibling;
+  parent->num_children--;
+
+  if (s) {
+    if (node->prev_ephemeral)
+      node->prev_ephemeral->next_ephemeral = node->next_ephemeral;
+    else
+      s->ephemerals = node->next_ephemeral;
+    if (node->next_ephemeral)
+      node->next_ephemeral->prev_ephemeral = node->prev_ephemeral;
+  }
+
+  dict_unset(g_nodes, node->path);
+}
+
+static void txn_begin(txn *t)
+{
+  t->zxid = g_zxid + 1;
+  t->undo_count = 0;
+  t->event_count = 0;
+}
+
+static undo *txn_undo(txn *t, int op, znode *node)
+{
+  undo *u;
+
+  if (t->undo_count == t->undo_size) {
+    t->undos = safe_realloc(t->undos,
+                            sizeof(undo) * t->undo_size,
+                            sizeof(undo) * (t->undo_size ? t->undo_size * 2 : 8));
+    t->undo_size = t->undo_size ? t->undo_size * 2 : 8;
+  }
+
+  u = &t->undos[t->undo_count++];
+  memset(u, 0, sizeof(undo));
+  u->op = op;
+  u->node = node;
+  return u;
+}
+
+static void txn_event(txn *t, int type, int child, const char *path)
+{
+  pending_event *ev;
+
+  if (t->event_count == t->event_size) {
+    t->events = safe_realloc(t->events,
+                             sizeof(pending_event) * t->event_size,
+                             sizeof(pending_event) * (t->event_size ? t->event_size * 2 : 8));
+    t->event_size = t->event_size ? t->event_size * 2 : 8;
+  }
+
+  ev = &t->events[t->event_count++];
+  ev->type = type;
+  ev->child = child;
+  ev->path = safe_strdup(path);
+}
+
+/* the parent's cversion & pzxid are saved in the undo's version & mzxid */
+static void touch_parent(txn *t, undo *u, znode *parent)
+{
+  u->version = parent->cversion;
+  u->mzxid = parent->pzxid;
+  parent->cversion++;
+  parent->pzxid = t->zxid;
+}
+
+static int do_create(txn *t,
+                     char *path,
+                     const char *data,
+                     int len,
+                     int flags,
+                     session *s)
+{
+  char parent_path[MAX_PATH_SIZE];
+  znode *parent, *node;
+  int len_path = strlen(path);
+  undo *u;
+
+  /* path has room for the suffix, it's filled in once the parent is known */
+  if (flags & FLAG_SEQUENCE) {
+    if (len_path + 10 >= MAX_PATH_SIZE)
+      return ERR_BAD_ARGUMENTS;
+    strcpy(path + len_path, "0000000000");
+  }
+
+  if (!valid_path(path))
+    return ERR_BAD_ARGUMENTS;
+  if (!strcmp(path, "/"))
+    return ERR_NODE_EXISTS;
+
+  parent = find_parent(path, parent_path);
+  if (!parent)
+    return ERR_NO_NODE;
+
+  if (flags & FLAG_SEQUENCE)
+    sprintf(path + len_path, "%010d", parent->cversion);
+
+  if (parent->owner)
+    return ERR_EPHEMERAL_PARENT;
+  if (dict_get(g_nodes, path))
+    return ERR_NODE_EXISTS;
+  if (dict_count(g_nodes) == g_params.max_nodes) {
+    warn("Too many nodes (see --max-nodes), can't create %s", path);
+    return ERR_SYSTEM;
+  }
+
+  node = new_znode(path, data, len);
+  node->parent = parent;
+  node->owner = flags & FLAG_EPHEMERAL ? s : NULL;
+  node->czxid = node->mzxid = node->pzxid = t->zxid;
+  node->ctime = node->mtime = realtime_msecs();
+  link_znode(node);
+
+  u = txn_undo(t, OP_CREATE, node);
+  touch_parent(t, u, parent);
+
+  txn_event(t, EVENT_CREATED, 0, path);
+  txn_event(t, EVENT_CHILD, 1, parent->path);
+
+  return ERR_OK;
+}
+
+static int do_delete(txn *t, const char *path, int version)
+{
+  znode *node = dict_get(g_nodes, (void *)path);
+  undo *u;
+
+  if (!node)
+    return ERR_NO_NODE;
+  if (node == g_root)
+    return ERR_BAD_ARGUMENTS;
+  if (version != -1 && version != node->version)
+    return ERR_BAD_VERSION;
+  if (node->num_children)
+    return ERR_NOT_EMPTY;
+
+  unlink_znode(node);
+
+  u = txn_undo(t, OP_DELETE, node);
+  touch_parent(t, u, node->parent);
+
+  txn_event(t, EVENT_DELETED, 0, path);
+  txn_event(t, EVENT_DELETED, 1, path);
+  txn_event(t, EVENT_CHILD, 1, node->parent->path);
+
+  return ERR_OK;
+}
+
+static int do_set_data(txn *t,
+                       const char *path,
+                       const char *data,
+                       int len,
+                       int version,
+                       znode **out)
+{
+  znode *node = dict_get(g_nodes, (void *)path);
+  undo *u;
+
+  if (!node)
+    return ERR_NO_NODE;
+  if (version != -1 && version != node->version)
+    return ERR_BAD_VERSION;
+
+  u = txn_undo(t, OP_SET_DATA, node);
+  u->data = node->data;
+  u->data_len = node->data_len;
+  u->version = node->version;
+  u->mzxid = node->mzxid;
+  u->mtime = node->mtime;
+
+  node->data = NULL;
+  node->data_len = 0;
+  if (len > 0) {
+    node->data = safe_alloc(len);
+    memcpy(node->data, data, len);
+    node->data_len = len;
+  }
+  node->version++;
+  node->mzxid = t->zxid;
+  node->mtime = realtime_msecs();
+
+  txn_event(t, EVENT_CHANGED, 0, path);
+
+  *out = node;
+  return ERR_OK;
+}
+
+static int do_check(const char *path, int version)
+{
+  znode *node = dict_get(g_nodes, (void *)path);
+
+  if (!node)
+    return ERR_NO_NODE;
+  if (version != -1 && version != node->version)
+    return ERR_BAD_VERSION;
+  return ERR_OK;
+}
+
+/* fires the watches, frees what was deleted */
+static void txn_commit(txn *t)
+{
+  undo *u;
+  int i;
+
+  if (t->undo_count)
+    g_zxid = t->zxid;
+
+  for (i=0; i < t->event_count; i++) {
+    fire_watches(t->events[i].child ? g_child_watches : g_data_watches,
+                 t->events[i].path,
+                 t->events[i].type);
+    free(t->events[i].path);
+  }
+
+  for (i=0; i < t->undo_count; i++) {
+    u = &t->undos[i];
+    if (u->op == OP_DELETE)
+      free_znode(u->node);
+    else if (u->op == OP_SET_DATA)
+      free(u->data);
+  }
+
+  t->undo_count = t->event_count = 0;
+}
+
+static void txn_rollback(txn *t)
+{
+  undo *u;
+  int i;
+
+  for (i=t->undo_count - 1; i >= 0; i--) {
+    u = &t->undos[i];
+
+    switch (u->op) {
+    case OP_CREATE:
+      unlink_znode(u->node);
+      u->node->parent->cversion = u->version;
+      u->node->parent->pzxid = u->mzxid;
+      free_znode(u->node);
+      break;
+    case OP_DELETE:
+      link_znode(u->node);
+      u->node->parent->cversion = u->version;
+      u->node->parent->pzxid = u->mzxid;
+      break;
+    case OP_SET_DATA:
+      free(u->node->data);
+      u->node->data = u->data;
+      u->node->data_len = u->data_len;
+      u->node->version = u->version;
+      u->node->mzxid = u->mzxid;
+      u->node->mtime = u->mtime;
+      break;
+    }
+  }
+
+  for (i=0; i < t->event_count; i++)
+    free(t->events[i].path);
+
+  t->undo_count = t->event_count = 0;
+}
+
+static void begin_event(int type, const char *path)
+{
+  begin_packet(&g_event);
+  out_int(&g_event, XID_WATCH);
+  out_long(&g_event, -1);
+  out_int(&g_event, ERR_OK);
+  out_int(&g_event, type);
+  out_int(&g_event, STATE_CONNECTED);
+  out_string(&g_event, path);
+}
+
+static void fire_watches(dict_t watches, const char *path, int type)
+{
+  watch_list *wl = dict_get(watches, (void *)path);
+  watch *w, *next;
+
+  if (!wl)
+    return;
+
+  begin_event(type, path);
+
+  dict_unset(watches, wl->path);
+
+  for (w = wl->head; w; w = next) {
+    next = w->next;
+    send_packet(w->session->conn, &g_event);
+    unlink_session_watch(w);
+    free(w);
+    g_watch_count--;
+  }
+
+  free(wl->path);
+  free(wl);
+}
+
+static void expire_session(session *s)
+{
+  static txn t;
+
+  txn_begin(&t);
+  while (s->ephemerals)
+    do_delete(&t, s->ephemerals->path, -1);
+  txn_commit(&t);
+
+  if (s->conn) {
+    s->conn->closing = 1;
+    mark_dirty(s->conn);
+  }
+  detach_session(s);
+
+  heap_remove(g_expirations, s->heap_pos);
+  s->next_free = g_free_slot;
+  g_free_slot = s->slot;
+  g_sessions_live--;
+}
+
+static void expire_sessions(void)
+{
+  session *s;
+  uint64_t deadline;
+
+  while ((s = heap_peek(g_expirations, &deadline)) && deadline <= g_now) {
+    if (s->deadline > g_now) {
+      heap_update(g_expirations, s->heap_pos, s->deadline);
+      continue;
+    }
+
+    g_expired++;
+    expire_session(s);
+  }
+}
+
+/* creates the persistent paths given with --paths, parents included */
+static void create_paths(char *paths)
+{
+  static txn t;
+  char path[MAX_PATH_SIZE];
+  char *p, *slash;
+
+  for (p = strtok(paths, ","); p; p = strtok(NULL, ",")) {
+    if (strlen(p) >= MAX_PATH_SIZE || !valid_path(p))
+      error(EXIT_BAD_PARAMS, "Bad path: %s", p);
+
+    for (slash = strchr(p + 1, '/'); ; slash = strchr(slash + 1, '/')) {
+      snprintf(path, sizeof(path), "%.*s", slash ? (int)(slash - p) : (int)strlen(p), p);
+      txn_begin(&t);
+      do_create(&t, path, NULL, -1, 0, NULL);
+      txn_commit(&t);
+      if (!slash)
+        break;
+    }
+  }
+}
+
+
+/* requests */
+
+static int handle_multi(connection *conn, reader *r, int xid)
+{
+  static multi_op ops[MAX_MULTI_OPS];
+  static txn t;
+  multi_op *op;
+  int count = 0, err = ERR_OK, i, done;
+
+  while (1) {
+    op = &ops[count];
+    op->type = in_int(r);
+    done = in_bool(r);
+    in_int(r);
+    if (r->bad)
+      return -1;
+    if (done)
+      break;
+    if (count == MAX_MULTI_OPS - 1)
+      return -1;
+
+    in_string(r, op->path, sizeof(op->path));
+    switch (op->type) {
+    case OP_CREATE:
+    case OP_CREATE2:
+      op->data = in_buffer(r, &op->data_len);
+      skip_acls(r);
+      op->flags = in_int(r);
+      break;
+    case OP_DELETE:
+    case OP_CHECK:
+      op->version = in_int(r);
+      break;
+    case OP_SET_DATA:
+      op->data = in_buffer(r, &op->data_len);
+      op->version = in_int(r);
+      break;
+    default:
+      return -1;
+    }
+
+    if (r->bad)
+      return -1;
+    count++;
+  }
+
+  txn_begin(&t);
+
+  for (i=0; i < count; i++) {
+    op = &ops[i];
+    op->err = ERR_INCONSISTENCY;
+    if (err)
+      continue;
+
+    switch (op->type) {
+    case OP_CREATE:
+    case OP_CREATE2:
+      op->err = do_create(&t, op->path, op->data, op->data_len, op->flags,
+                          conn->session);
+      if (!op->err)
+        op->node = dict_get(g_nodes, op->path);
+      break;
+    case OP_DELETE:
+      op->err = do_delete(&t, op->path, op->version);
+      break;
+    case OP_SET_DATA:
+      op->err = do_set_data(&t, op->path, op->data, op->data_len, op->version,
+                            &op->node);
+      break;
+    case OP_CHECK:
+      op->err = do_check(op->path, op->version);
+      break;
+    }
+
+    err = op->err;
+  }
+
+  /* the ones before the failure say ok, the ones after say they didn't run */
+  if (err)
+    txn_rollback(&t);
+
+  /* before the commit, nodes it deleted are still around */
+  begin_reply(&g_reply, xid, ERR_OK);
+
+  for (i=0; i < count; i++) {
+    op = &ops[i];
+
+    if (err) {
+      out_int(&g_reply, OP_ERROR);
+      out_bool(&g_reply, 0);
+      out_int(&g_reply, op->err);
+      out_int(&g_reply, op->err);
+      continue;
+    }
+
+    out_int(&g_reply, op->type);
+    out_bool(&g_reply, 0);
+    out_int(&g_reply, ERR_OK);
+
+    if (op->type == OP_CREATE || op->type == OP_CREATE2)
+      out_string(&g_reply, op->node->path);
+    if (op->type == OP_CREATE2 || op->type == OP_SET_DATA)
+      out_stat(&g_reply, op->node);
+  }
+
+  out_int(&g_reply, -1);
+  out_bool(&g_reply, 1);
+  out_int(&g_reply, -1);
+
+  if (!err) {
+    txn_commit(&t);
+    set_reply_zxid(&g_reply);
+  }
+
+  send_packet(conn, &g_reply);
+  return ERR_OK;
+}
+
+/* what changed since the client last heard from us fires right away */
+static int handle_set_watches(session *s, reader *r)
+{
+  char path[MAX_PATH_SIZE];
+  int64_t relative_zxid;
+  znode *node;
+  int kind, count, i, type;
+
+  relative_zxid = in_long(r);
+
+  /* data, exists & child watches */
+  for (kind=0; kind < 3; kind++) {
+    count = in_int(r);
+    for (i=0; i < count; i++) {
+      in_string(r, path, sizeof(path));
+      if (r->bad)
+        return -1;
+
+      node = dict_get(g_nodes, path);
+      type = 0;
+
+      switch (kind) {
+      case 0:
+        if (!node)
+          type = EVENT_DELETED;
+        else if (node->mzxid > relative_zxid)
+          type = EVENT_CHANGED;
+        else
+          add_watch(g_data_watches, path, s);
+        break;
+      case 1:
+        if (node)
+          type = EVENT_CREATED;
+        else
+          add_watch(g_data_watches, path, s);
+        break;
+      case 2:
+        if (!node)
+          type = EVENT_DELETED;
+        else if (node->pzxid > relative_zxid)
+          type = EVENT_CHILD;
+        else
+          add_watch(g_child_watches, path, s);
+        break;
+      }
+
+      if (type) {
+        begin_event(type, path);
+        send_packet(s->conn, &g_event);
+      }
+    }
+  }
+
+  return r->bad ? -1 : 0;
+}
+
+/* returns -1 if the packet made no sense */
+static int handle_request(connection *conn, reader *r)
+{
+  static txn t;
+  char path[MAX_PATH_SIZE];
+  session *s = conn->session;
+  const char *data;
+  znode *node, *child;
+  int xid, type, watch, version, flags, len, err;
+
+  xid = in_int(r);
+  type = in_int(r);
+  if (r->bad)
+    return -1;
+
+  touch_session(s);
+  g_requests++;
+
+  switch (type) {
+  case OP_PING:
+  case OP_AUTH:
+    begin_reply(&g_reply, xid, ERR_OK);
+    break;
+
+  case OP_CREATE:
+  case OP_CREATE2:
+    in_string(r, path, sizeof(path));
+    data = in_buffer(r, &len);
+    skip_acls(r);
+    flags = in_int(r);
+    if (r->bad)
+      return -1;
+
+    txn_begin(&t);
+    err = do_create(&t, path, data, len, flags, s);
+    txn_commit(&t);
+
+    begin_reply(&g_reply, xid, err);
+    if (!err) {
+      node = dict_get(g_nodes, path);
+      out_string(&g_reply, path);
+      if (type == OP_CREATE2)
+        out_stat(&g_reply, node);
+    }
+    break;
+
+  case OP_DELETE:
+    in_string(r, path, sizeof(path));
+    version = in_int(r);
+    if (r->bad)
+      return -1;
+
+    txn_begin(&t);
+    err = do_delete(&t, path, version);
+    txn_commit(&t);
+
+    begin_reply(&g_reply, xid, err);
+    break;
+
+  case OP_SET_DATA:
+    in_string(r, path, sizeof(path));
+    data = in_buffer(r, &len);
+    version = in_int(r);
+    if (r->bad)
+      return -1;
+
+    txn_begin(&t);
+    err = do_set_data(&t, path, data, len, version, &node);
+    txn_commit(&t);
+
+    begin_reply(&g_reply, xid, err);
+    if (!err)
+      out_stat(&g_reply, node);
+    break;
+
+  case OP_EXISTS:
+  case OP_GET_DATA:
+  case OP_GET_CHILDREN:
+  case OP_GET_CHILDREN2:
+    in_string(r, path, sizeof(path));
+    watch = in_bool(r);
+    if (r->bad)
+      return -1;
+
+    node = dict_get(g_nodes, path);
+    if (!node) {
+      if (watch && type == OP_EXISTS)
+        add_watch(g_data_watches, path, s);
+      begin_reply(&g_reply, xid, ERR_NO_NODE);
+      break;
+    }
+
+    if (watch)
+      add_watch(type == OP_EXISTS || type == OP_GET_DATA ?
+                g_data_watches : g_child_watches,
+                path,
+                s);
+
+    begin_reply(&g_reply, xid, ERR_OK);
+    if (type == OP_GET_DATA)
+      out_buffer(&g_reply, node->data ? node->data : "", node->data_len);
+    if (type == OP_GET_CHILDREN || type == OP_GET_CHILDREN2) {
+      out_int(&g_reply, node->num_children);
+      for (child = node->children; child; child = child->next_sibling)
+        out_string(&g_reply, child->name);
+    }
+    if (type != OP_GET_CHILDREN)
+      out_stat(&g_reply, node);
+    break;
+
+  case OP_GET_ACL:
+    in_string(r, path, sizeof(path));
+    if (r->bad)
+      return -1;
+
+    node = dict_get(g_nodes, path);
+    begin_reply(&g_reply, xid, node ? ERR_OK : ERR_NO_NODE);
+    if (node) {
+      out_int(&g_reply, 1);
+      out_int(&g_reply, PERMS_ALL);
+      out_string(&g_reply, "world");
+      out_string(&g_reply, "anyone");
+      out_stat(&g_reply, node);
+    }
+    break;
+
+  case OP_SYNC:
+    in_string(r, path, sizeof(path));
+    if (r->bad)
+      return -1;
+
+    begin_reply(&g_reply, xid, ERR_OK);
+    out_string(&g_reply, path);
+    break;
+
+  case OP_MULTI:
+    return handle_multi(conn, r, xid);
+
+  case OP_SET_WATCHES:
+    if (handle_set_watches(s, r))
+      return -1;
+    begin_reply(&g_reply, xid, ERR_OK);
+    break;
+
+  case OP_CLOSE:
+    begin_reply(&g_reply, xid, ERR_OK);
+    send_packet(conn, &g_reply);
+    expire_session(s);
+    return 0;
+
+  default:
+    begin_reply(&g_reply, xid, ERR_UNIMPLEMENTED);
+    break;
+  }
+
+  send_packet(conn, &g_reply);
+  return 0;
+}
+
+/* unknown (or expired) sessions get a 0 timeout, which tells them so */
+static int handle_connect(connection *conn, reader *r)
+{
+  static const char no_passwd[PASSWD_SIZE];
+  const char *passwd;
+  session *s = NULL;
+  int64_t id;
+  int timeout, len, read_only;
+
+  in_int(r);    /* protocol version */
+  in_long(r);   /* last zxid seen */
+  timeout = in_int(r);
+  id = in_long(r);
+  passwd = in_buffer(r, &len);
+  if (r->bad)
+    return -1;
+
+  /* newer clients also say whether they're ok with a read-only server */
+  read_only = r->pos < r->len;
+
+  if (timeout < g_params.min_timeout)
+    timeout = g_params.min_timeout;
+  if (timeout > g_params.max_timeout)
+    timeout = g_params.max_timeout;
+
+  if (id) {
+    s = find_session(id);
+    if (s && (len != PASSWD_SIZE || memcmp(passwd, s->passwd, PASSWD_SIZE)))
+      s = NULL;
+  } else {
+    s = new_session(timeout);
+    if (!s)
+      warn("Out of session slots");
+  }
+
+  begin_packet(&g_reply);
+  out_int(&g_reply, 0);
+  if (s) {
+    attach_session(s, conn);
+    out_int(&g_reply, s->timeout);
+    out_long(&g_reply, s->id);
+    out_buffer(&g_reply, s->passwd, PASSWD_SIZE);
+  } else {
+    out_int(&g_reply, 0);
+    out_long(&g_reply, 0);
+    out_buffer(&g_reply, no_passwd, PASSWD_SIZE);
+    conn->closing = 1;
+  }
+  if (read_only)
+    out_bool(&g_reply, 0);
+
+  send_packet(conn, &g_reply);
+  return 0;
+}
+
+
+/* connections */
+
+static void keep_input(connection *conn, const char *buf, int len)
+{
+  int size;
+
+  if (conn->in_len + len > conn->in_size) {
+    size = conn->in_size ? conn->in_size : 512;
+    while (conn->in_len + len > size)
+      size *= 2;
+    conn->in = safe_realloc(conn->in, conn->in_size, size);
+    conn->in_size = size;
+  }
+
+  memcpy(conn->in + conn->in_len, buf, len);
+  conn->in_len += len;
+}
+
+/* handles every complete packet, returns how many bytes it used (or -1) */
+static int consume_input(connection *conn, const char *buf, int len)
+{
+  reader r;
+  uint32_t size;
+  int used = 0, rc;
+
+  while (len - used >= 4 && !conn->closing) {
+    memcpy(&size, buf + used, 4);
+    size = ntohl(size);
+    if (size > MAX_PACKET_SIZE) {
+      warn("Packet too big (%u bytes), closing the connection", size);
+      close_connection(conn);
+      return -1;
+    }
+
+    if (len - used - 4 < size)
+      break;
+
+    r.buf = buf + used + 4;
+    r.len = size;
+    r.pos = 0;
+    r.bad = 0;
+
+    rc = conn->session ?
+      handle_request(conn, &r) : handle_connect(conn, &r);
+    if (rc) {
+      warn("Bad packet, closing the connection");
+      close_connection(conn);
+      return -1;
+    }
+
+    used += 4 + size;
+  }
+
+  return used;
+}
+
+static void read_connection(connection *conn)
+{
+  static char buf[READ_BUFFER_SIZE];
+  ssize_t n;
+  int used;
+
+  n = read(conn->fd, buf, sizeof(buf));
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    return;
+  if (n <= 0) {
+    close_connection(conn);
+    return;
+  }
+
+  /* most of the time, there's no partial packet waiting */
+  if (!conn->in_len) {
+    used = consume_input(conn, buf, n);
+    if (used >= 0 && used < n && !conn->closing)
+      keep_input(conn, buf + used, n - used);
+    return;
+  }
+
+  keep_input(conn, buf, n);
+  used = consume_input(conn, conn->in, conn->in_len);
+  if (used < 0 || conn->fd == -1)
+    return;
+
+  memmove(conn->in, conn->in + used, conn->in_len - used);
+  conn->in_len -= used;
+}
+
+/* it's freed later on, by release_connection() */
+static void close_connection(connection *conn)
+{
+  if (conn->fd == -1)
+    return;
+
+  if (conn->session)
+    detach_session(conn->session);
+
+  epoll_ctl(g_epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+  close(conn->fd);
+  conn->fd = -1;
+
+  free(conn->in);
+  free(conn->out);
+  conn->in = conn->out = NULL;
+  conn->in_len = conn->in_size = 0;
+  conn->out_pos = conn->out_len = conn->out_size = 0;
+
+  g_connections--;
+  mark_dirty(conn);
+}
+
+static void release_connection(connection *conn)
+{
+  if (conn->fd == -1 && !conn->pending && !conn->dirty)
+    free(conn);
+}
+
+static void accept_connections(void)
+{
+  struct epoll_event ev;
+  connection *conn;
+  int fd, one = 1;
+
+  while ((fd = accept4(g_listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    conn = safe_alloc(sizeof(connection));
+    conn->fd = fd;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = conn;
+    if (epoll_ctl(g_epfd, EPOLL_CTL_ADD, fd, &ev))
+      error(EXIT_SYSTEM_CALL, "epoll_ctl() failed: %s", strerror(errno));
+
+    g_connections++;
+  }
+
+  /* the listener would stay readable, so stop polling it for a bit */
+  if (errno == EMFILE || errno == ENFILE) {
+    warn("Out of fds with %ld connections, pausing accept()", g_connections);
+    epoll_ctl(g_epfd, EPOLL_CTL_DEL, g_listen_fd, NULL);
+    g_accept_paused = g_now + ACCEPT_PAUSE_MS * 1000000ULL;
+    return;
+  }
+
+  if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+      errno != ECONNABORTED)
+    warn("accept() failed: %s", strerror(errno));
+}
+
+static void poll_listener(void)
+{
+  struct epoll_event ev;
+
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  if (epoll_ctl(g_epfd, EPOLL_CTL_ADD, g_listen_fd, &ev))
+    error(EXIT_SYSTEM_CALL, "epoll_ctl() failed: %s", strerror(errno));
+}
+
+static void start_listening(void)
+{
+  struct sockaddr_in addr;
+  int one = 1;
+
+  g_listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (g_listen_fd == -1)
+    error(EXIT_SYSTEM_CALL, "socket() failed: %s", strerror(errno));
+
+  setsockopt(g_listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(g_params.port);
+  if (inet_pton(AF_INET, g_params.bind_addr, &addr.sin_addr) != 1)
+    error(EXIT_BAD_PARAMS, "Bad address: %s", g_params.bind_addr);
+
+  if (bind(g_listen_fd, (struct sockaddr *)&addr, sizeof(addr)))
+    error(EXIT_SYSTEM_CALL, "bind() failed: %s", strerror(errno));
+  if (listen(g_listen_fd, SOMAXCONN))
+    error(EXIT_SYSTEM_CALL, "listen() failed: %s", strerror(errno));
+
+  poll_listener();
+}
+
+/* one fd per session */
+static void raise_fd_limit(void)
+{
+  struct rlimit rl;
+
+  if (getrlimit(RLIMIT_NOFILE, &rl))
+    return;
+
+  rl.rlim_cur = rl.rlim_max;
+  if (setrlimit(RLIMIT_NOFILE, &rl))
+    warn("Couldn't raise the max # of open files");
+}
+
+static dict_t new_path_dict(int size)
+{
+  dict_t d = dict_new(size);
+
+  dict_use_string_keys(d);
+  return d;
+}
+
+static int next_timeout(uint64_t next_stats)
+{
+  uint64_t next = next_stats, key;
+
+  if (heap_peek(g_expirations, &key) && key < next)
+    next = key;
+  if (heap_peek(g_delayed, &key) && key < next)
+    next = key;
+  if (g_accept_paused && g_accept_paused < next)
+    next = g_accept_paused;
+
+  if (next <= g_now)
+    return 0;
+
+  /* rounded up, so it doesn't wake up early & spin */
+  return (next - g_now + 999999) / 1000000;
+}
+
+static void report_stats(long requests, uint64_t nsecs)
+{
+  info("sessions=%ld connections=%ld nodes=%d watches=%ld "
+       "requests_per_sec=%.1f expired=%ld zxid=%ld",
+       g_sessions_live,
+       g_connections,
+       dict_count(g_nodes),
+       g_watch_count,
+       requests / ((double)nsecs / 1e9),
+       g_expired,
+       (long)g_zxid);
+}
+
+int main(int argc, const char **argv)
+{
+  struct epoll_event *events;
+  connection *conn;
+  uint64_t last_stats, interval;
+  long last_requests = 0;
+  int i, n;
+
+  parse_argv(argc, argv);
+
+  /* it's meant to be left running, with its output going to a file */
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  signal(SIGPIPE, SIG_IGN);
+  srandom(time(NULL) ^ getpid());
+
+  g_now = now_nsecs();
+  g_epoch = (unsigned)time(NULL) & 0x7fff;
+
+  g_nodes = new_path_dict(PATH_DICT_SIZE);
+  g_data_watches = new_path_dict(PATH_DICT_SIZE);
+  g_child_watches = new_path_dict(PATH_DICT_SIZE);
+
+  g_root = new_znode("/", NULL, 0);
+  dict_set(g_nodes, g_root->path, g_root);
+  if (g_params.paths)
+    create_paths(g_params.paths);
+
+  g_expirations = heap_new(1024);
+  heap_set_pos_func(g_expirations, &session_set_pos);
+  g_delayed = heap_new(1024);
+
+  raise_fd_limit();
+
+  g_epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (g_epfd == -1)
+    error(EXIT_SYSTEM_CALL, "epoll_create1() failed: %s", strerror(errno));
+
+  start_listening();
+  info("Listening on %s:%d", g_params.bind_addr, g_params.port);
+
+  events = safe_alloc(sizeof(struct epoll_event) * g_params.max_events);
+  interval = g_params.stats_interval * 1000000000ULL;
+  last_stats = g_now;
+
+  while (1) {
+    n = epoll_wait(g_epfd, events, g_params.max_events,
+                   next_timeout(last_stats + interval));
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      error(EXIT_SYSTEM_CALL, "epoll_wait() failed: %s", strerror(errno));
+    }
+
+    g_now = now_nsecs();
+
+    for (i=0; i < n; i++) {
+      conn = (connection *)events[i].data.ptr;
+      if (!conn) {
+        accept_connections();
+        continue;
+      }
+
+      if (conn->fd != -1 && events[i].events & EPOLLOUT)
+        flush_connection(conn);
+      if (conn->fd != -1 && events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+        read_connection(conn);
+    }
+
+    send_due();
+    expire_sessions();
+    flush_dirty();
+
+    if (g_accept_paused && g_now >= g_accept_paused) {
+      g_accept_paused = 0;
+      poll_listener();
+    }
+
+    if (g_now - last_stats >= interval) {
+      report_stats(g_requests - last_requests, g_now - last_stats);
+      last_requests = g_requests;
+      last_stats = g_now;
+    }
+  }
+
+  return 0;
+}
+
+static void help(void)
+{
+  printf("mock-zk-server [OPTIONS...]\n\n"
+         "A mock ZK server, good enough for load testing the clients.\n\n"
+         "  --help,              -h        Show this help\n"
+         "  --address,           -a        Address to listen on (default: 0.0.0.0)\n"
+         "  --port,              -p        Port to listen on (default: %d)\n"
+         "  --max-nodes,         -n        Max # of znodes (default: %d)\n"
+         "  --max-events,        -e        Set the max number of events per epoll_wait()\n"
+         "  --min-timeout,       -t        Shortest session timeout, in msecs (default: %d)\n"
+         "  --max-timeout,       -T        Longest session timeout, in msecs (default: %d)\n"
+         "  --latency,           -l        Hold every response for this many msecs\n"
+         "  --jitter,            -j        Plus up to this many msecs, at random\n"
+         "  --stats-interval,    -i        Seconds between stats lines (default: %d)\n"
+         "  --paths,             -P        Persistent paths to create on startup (comma separated)\n",
+         DEFAULT_PORT,
+         DEFAULT_MAX_NODES,
+         DEFAULT_MIN_TIMEOUT,
+         DEFAULT_MAX_TIMEOUT,
+         DEFAULT_STATS_INTERVAL);
+}
+
+static void parse_argv(int argc, const char **argv)
+{
+  const char *sopts = "ha:p:n:e:t:T:l:j:i:P:";
+  static const struct option options[] = {
+    { "help",                 no_argument,       NULL, 'h' },
+    { "address",              required_argument, NULL, 'a' },
+    { "port",                 required_argument, NULL, 'p' },
+    { "max-nodes",            required_argument, NULL, 'n' },
+    { "max-events",           required_argument, NULL, 'e' },
+    { "min-timeout",          required_argument, NULL, 't' },
+    { "max-timeout",          required_argument, NULL, 'T' },
+    { "latency",              required_argument, NULL, 'l' },
+    { "jitter",               required_argument, NULL, 'j' },
+    { "stats-interval",       required_argument, NULL, 'i' },
+    { "paths",                required_argument, NULL, 'P' },
+    {}
+  };
+  int c;
+
+  g_params.bind_addr = "0.0.0.0";
+  g_params.port = DEFAULT_PORT;
+  g_params.max_nodes = DEFAULT_MAX_NODES;
+  g_params.max_events = DEFAULT_MAX_EVENTS;
+  g_params.min_timeout = DEFAULT_MIN_TIMEOUT;
+  g_params.max_timeout = DEFAULT_MAX_TIMEOUT;
+  g_params.stats_interval = DEFAULT_STATS_INTERVAL;
+
+  while ((c = getopt_long(argc, (char **)argv, sopts, options, NULL)) >= 0) {
+    switch (c) {
+    case 'h':
+      help();
+      exit(0);
+    case 'a':
+      g_params.bind_addr = safe_strdup(optarg);
+      break;
+    case 'p':
+      g_params.port = positive_int(optarg, "port");
+      break;
+    case 'n':
+      g_params.max_nodes = positive_int(optarg, "max nodes");
+      if (!g_params.max_nodes)
+        error(EXIT_BAD_PARAMS, "Bad param for max nodes: 0");
+      break;
+    case 'e':
+      g_params.max_events = positive_int(optarg, "max events");
+      if (!g_params.max_events)
+        error(EXIT_BAD_PARAMS, "Bad param for max events: 0");
+      break;
+    case 't':
+      g_params.min_timeout = positive_int(optarg, "min timeout");
+      break;
+    case 'T':
+      g_params.max_timeout = positive_int(optarg, "max timeout");
+      break;
+    case 'l':
+      g_params.latency = positive_int(optarg, "latency");
+      break;
+    case 'j':
+      g_params.jitter = positive_int(optarg, "jitter");
+      break;
+    case 'i':
+      g_params.stats_interval = positive_int(optarg, "stats interval");
+      if (!g_params.stats_interval)
+        error(EXIT_BAD_PARAMS, "Bad param for stats interval: 0");
+      break;
+    case 'P':
+      g_params.paths = safe_strdup(optarg);
+      break;
+    case '?':
+      help();
+      exit(1);
+    default:
+      error(EXIT_BAD_PARAMS, "Bad option %c\n", (char)c);
+    }
+  }
+
+  if (g_params.min_timeout > g_params.max_timeout)
+    error(EXIT_BAD_PARAMS, "The min timeout is bigger than the max timeout");
+}
@@ -0,0 +1,324 @@
+/*
+ * issues a weighted mix of ops from every session, open-loop at a --rate:
+ *
+ *   op-mix --rate 5000 --mix get=80,set=20 --keys 10000 --payload 128 ...
+ *
+ * Keys are <path>/key-<n> for n in [0, --keys), and the mix's creates &
+ * deletes are what makes them come & go, so ZNONODE & ZNODEEXISTS are
+ * expected (and not counted as errors).
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "clients.h"
+#include "util.h"
+
+
+#define DEFAULT_MIX     "get=60,get_children=5,exists=10,set=10,create=5,delete=5,multi=5"
+#define DEFAULT_KEYS    1000
+#define DEFAULT_PAYLOAD "64"
+#define MAX_KEY_LEN     256
+
+typedef struct {
+  const char *name;
+  int (*issue)(zhandle_t *zh, session_context *context);
+  int weight;
+  int op;     /* see clients_register_op() */
+} mix_op;
+
+/* the two setData()s of a multi, freed when it completes */
+typedef struct {
+  const void *start;
+  char keys[2][MAX_KEY_LEN];
+  zoo_op_t ops[2];
+  zoo_op_result_t results[2];
+  struct Stat stats[2];
+} multi_data;
+
+static int issue_get(zhandle_t *zh, session_context *context);
+static int issue_get_children(zhandle_t *zh, session_context *context);
+static int issue_exists(zhandle_t *zh, session_context *context);
+static int issue_set(zhandle_t *zh, session_context *context);
+static int issue_create(zhandle_t *zh, session_context *context);
+static int issue_delete(zhandle_t *zh, session_context *context);
+static int issue_multi(zhandle_t *zh, session_context *context);
+
+enum { MIX_GET, MIX_GET_CHILDREN, MIX_EXISTS, MIX_SET, MIX_CREATE, MIX_DELETE, MIX_MULTI };
+
+static mix_op g_mix[] = {
+  { "get",          issue_get },
+  { "get_children", issue_get_children },
+  { "exists",       issue_exists },
+  { "set",          issue_set },
+  { "create",       issue_create },
+  { "delete",       issue_delete },
+  { "multi",        issue_multi },
+  {}
+};
+
+static int g_total_weight;
+static int g_keys = DEFAULT_KEYS;
+static char *g_payload;
+static int g_payload_len;
+static __thread unsigned t_seed;
+
+
+static int random_int(int bound)
+{
+  if (!t_seed)
+    t_seed = (unsigned)now_nsecs() ^ (unsigned)pthread_self();
+
+  return (int)(bound * (rand_r(&t_seed) / (RAND_MAX + 1.0)));
+}
+
+static void random_key(session_context *context, char *key)
+{
+  const char *path = context->path;
+  const char *sep = path[strlen(path) - 1] == '/' ? "" : "/";
+
+  snprintf(key, MAX_KEY_LEN, "%s%skey-%d", path, sep, random_int(g_keys));
+}
+
+/* these are expected, given that keys come & go */
+static void record_completion(int which, int rc, const void *start)
+{
+  clients_record_latency(g_mix[which].op, start);
+  if (rc != ZOK && rc != ZNONODE && rc != ZNODEEXISTS)
+    clients_record_error(g_mix[which].op);
+}
+
+static void get_completion(int rc,
+                           const char *value,
+                           int value_len,
+                           const struct Stat *stat,
+                           const void *data)
+{
+  record_completion(MIX_GET, rc, data);
+}
+
+static void get_children_completion(int rc,
+                                    const struct String_vector *strings,
+                                    const void *data)
+{
+  record_completion(MIX_GET_CHILDREN, rc, data);
+}
+
+static void exists_completion(int rc, const struct Stat *stat, const void *data)
+{
+  record_completion(MIX_EXISTS, rc, data);
+}
+
+static void set_completion(int rc, const struct Stat *stat, const void *data)
+{
+  record_completion(MIX_SET, rc, data);
+}
+
+static void create_completion(int rc, const char *value, const void *data)
+{
+  record_completion(MIX_CREATE, rc, data);
+}
+
+static void delete_completion(int rc, const void *data)
+{
+  record_completion(MIX_DELETE, rc, data);
+}
+
+static void multi_completion(int rc, const void *data)
+{
+  multi_data *m = (multi_data *)data;
+
+  record_completion(MIX_MULTI, rc, m->start);
+  free(m);
+}
+
+static int issue_get(zhandle_t *zh, session_context *context)
+{
+  char key[MAX_KEY_LEN];
+
+  random_key(context, key);
+  return zoo_aget(zh, key, 0, get_completion, clients_op_start());
+}
+
+static int issue_get_children(zhandle_t *zh, session_context *context)
+{
+  return zoo_aget_children(zh,
+                           context->path,
+                           0,
+                           get_children_completion,
+                           clients_op_start());
+}
+
+static int issue_exists(zhandle_t *zh, session_context *context)
+{
+  char key[MAX_KEY_LEN];
+
+  random_key(context, key);
+  return zoo_aexists(zh, key, 0, exists_completion, clients_op_start());
+}
+
+static int issue_set(zhandle_t *zh, session_context *context)
+{
+  char key[MAX_KEY_LEN];
+
+  random_key(context, key);
+  return zoo_aset(zh,
+                  key,
+                  g_payload,
+                  g_payload_len,
+                  -1,
+                  set_completion,
+                  clients_op_start());
+}
+
+static int issue_create(zhandle_t *zh, session_context *context)
+{
+  char key[MAX_KEY_LEN];
+
+  random_key(context, key);
+  return zoo_acreate(zh,
+                     key,
+                     g_payload,
+                     g_payload_len,
+                     &ZOO_OPEN_ACL_UNSAFE,
+                     0,
+                     create_completion,
+                     clients_op_start());
+}
+
+static int issue_delete(zhandle_t *zh, session_context *context)
+{
+  char key[MAX_KEY_LEN];
+
+  random_key(context, key);
+  return zoo_adelete(zh, key, -1, delete_completion, clients_op_start());
+}
+
+static int issue_multi(zhandle_t *zh, session_context *context)
+{
+  multi_data *m = (multi_data *)safe_alloc(sizeof(multi_data));
+  int j, rc;
+
+  for (j=0; j < 2; j++) {
+    random_key(context, m->keys[j]);
+    zoo_set_op_init(&m->ops[j],
+                    m->keys[j],
+                    g_payload,
+                    g_payload_len,
+                    -1,
+                    &m->stats[j]);
+  }
+
+  m->start = clients_op_start();
+  rc = zoo_amulti(zh, 2, m->ops, m->results, multi_completion, m);
+  if (rc)
+    free(m);
+
+  return rc;
+}
+
+/* called from the issuers, at --rate */
+static int issue(zhandle_t *zh, session_context *context)
+{
+  int j, rc, pick = random_int(g_total_weight);
+
+  for (j=0; pick >= g_mix[j].weight; j++)
+    pick -= g_mix[j].weight;
+
+  rc = g_mix[j].issue(zh, context);
+  if (rc)
+    clients_record_missed(g_mix[j].op);
+
+  return rc;
+}
+
+/* op=weight,... and the ones that aren't there get 0 */
+static void parse_mix(const char *arg)
+{
+  char *mix = safe_strdup(arg), *item, *saveptr, *eq;
+  int j;
+
+  for (j=0; g_mix[j].name; j++)
+    g_mix[j].weight = 0;
+  g_total_weight = 0;
+
+  for (item = strtok_r(mix, ",", &saveptr); item;
+       item = strtok_r(NULL, ",", &saveptr)) {
+    eq = strchr(item, '=');
+    if (!eq)
+      error(EXIT_BAD_PARAMS, "Bad param for mix: %s", item);
+    *eq = '\0';
+
+    for (j=0; g_mix[j].name && strcmp(g_mix[j].name, item); j++)
+      ;
+    if (!g_mix[j].name)
+      error(EXIT_BAD_PARAMS, "Bad op for mix: %s", item);
+
+    g_mix[j].weight = positive_int(eq + 1, "mix weight");
+    g_total_weight += g_mix[j].weight;
+  }
+
+  if (!g_total_weight)
+    error(EXIT_BAD_PARAMS, "Bad param for mix: %s", arg);
+
+  free(mix);
+}
+
+static void parse_keys(const char *arg)
+{
+  g_keys = positive_int(arg, "keys");
+  if (!g_keys)
+    error(EXIT_BAD_PARAMS, "Bad param for keys: 0");
+}
+
+static void parse_payload(const char *arg)
+{
+  free(g_payload);
+
+  g_payload_len = positive_int(arg, "payload");
+  g_payload = (char *)safe_alloc(g_payload_len + 1);
+  memset(g_payload, 'x', g_payload_len);
+}
+
+static const clients_option options[] = {
+  { "mix",     "Weighted ops, e.g. get=80,set=20 (default: " DEFAULT_MIX ")", parse_mix },
+  { "keys",    "# of keys under the path (default: 1000)", parse_keys },
+  { "payload", "Bytes written by set, create & multi (default: " DEFAULT_PAYLOAD ")", parse_payload },
+  {}
+};
+
+static void *new_watcher_data(void)
+{
+  return NULL;
+}
+
+static void reset_watcher_data(void *data)
+{
+}
+
+/* the ops don't set watches, and expirations are handled for us */
+static void my_watcher(zhandle_t *zzh, int type, int state, const char *path)
+{
+}
+
+int main(int argc, const char **argv)
+{
+  int j;
+
+  for (j=0; g_mix[j].name; j++)
+    g_mix[j].op = clients_register_op(g_mix[j].name);
+
+  parse_mix(DEFAULT_MIX);
+  parse_payload(DEFAULT_PAYLOAD);
+
+  clients_set_issuer(&issue);
+  clients_add_options(options);
+  clients_run(argc,
+              argv,
+              &my_watcher,
+              &new_watcher_data,
+              &reset_watcher_data);
+  return 0;
+}
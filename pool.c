@@ -200,3 +200,101 @@ int main(int argc, char **argv)
 }
 
 #endif
+
+#ifdef RUN_BENCH
+
+#include <stdio.h>
+
+#define BENCH_OPS       (1 << 21)
+#define BENCH_ITEMS     1024
+
+typedef struct {
+  pool_t p;
+  long ops;
+} bench_args;
+
+/* each thread keeps a few items out, so there's always churn on the list */
+static void *bench_churn(void *data)
+{
+  bench_args *args = (bench_args *)data;
+  void *items[4];
+  long i;
+  int j;
+
+  for (i=0; i < args->ops; i += 4) {
+    for (j=0; j < 4; j++)
+      items[j] = pool_get(args->p);
+    for (j=0; j < 4; j++)
+      pool_put(args->p, items[j]);
+  }
+
+  return NULL;
+}
+
+static void bench_get_put(int threads)
+{
+  pthread_t tids[8];
+  bench_args args;
+  uint64_t start, elapsed;
+  char params[64];
+  int i;
+
+  args.p = pool_new(64 * BENCH_ITEMS, 64);
+  args.ops = BENCH_OPS / threads;
+
+  start = now_nsecs();
+
+  for (i=0; i < threads; i++)
+    pthread_create(&tids[i], NULL, &bench_churn, &args);
+  for (i=0; i < threads; i++)
+    pthread_join(tids[i], NULL);
+
+  elapsed = now_nsecs() - start;
+
+  snprintf(params, sizeof(params), "op=get_put threads=%d", threads);
+  bench_report("pool", params, args.ops * threads * 2, elapsed);
+
+  pool_destroy(args.p);
+}
+
+/* drain the whole pool, then give everything back */
+static void bench_drain(int item_size)
+{
+  pool_t p = pool_new(item_size * BENCH_ITEMS, item_size);
+  void *items[BENCH_ITEMS];
+  uint64_t start, elapsed;
+  char params[64];
+  long ops = 0;
+  int i;
+
+  start = now_nsecs();
+
+  while (ops < BENCH_OPS) {
+    for (i=0; i < BENCH_ITEMS; i++)
+      items[i] = pool_get(p);
+    for (i=0; i < BENCH_ITEMS; i++)
+      pool_put(p, items[i]);
+    ops += BENCH_ITEMS * 2;
+  }
+
+  elapsed = now_nsecs() - start;
+
+  snprintf(params, sizeof(params), "op=drain item_size=%d", item_size);
+  bench_report("pool", params, ops, elapsed);
+
+  pool_destroy(p);
+}
+
+int main(int argc, char **argv)
+{
+  bench_get_put(1);
+  bench_get_put(2);
+  bench_get_put(4);
+
+  bench_drain(16);
+  bench_drain(256);
+
+  return 0;
+}
+
+#endif
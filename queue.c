@@ -1,9 +1,27 @@
 /*
- * A very simple queue drop-in implementation for writing
- * quick throw away tests/prototypes.
+ * A bounded, lock-free, multi-producer/multi-consumer queue.
+ *
+ * Each slot carries a sequence number which tells producers and consumers
+ * whose turn it is on that slot, so adding & removing only needs a CAS on
+ * the tail (or head) position. Consumers that find the queue empty spin a
+ * bit and then park on a futex; producers only pay for a FUTEX_WAKE (of a
+ * single waiter) when somebody is actually parked.
+ *
+ * queue_add_many() & queue_remove_many() claim a whole range of slots
+ * with a single CAS, so a batch costs one synchronization (and at most
+ * one FUTEX_WAKE) instead of one per item.
+ *
+ * When the queue is full, adds can wait (up to a timeout) for consumers
+ * to make room, parking on a second futex. Every add that finds the queue
+ * full is counted as an overflow.
+ *
+ * The size is rounded up to the next power of 2 (and to at least 2).
  *
  * To test:
- *   gcc -DRUN_TESTS -Wall -lpthread queue.c -o queue
+ *   gcc -DRUN_TESTS -Wall -lpthread queue.c util.c -o queue-test
+ *
+ * To benchmark (against a mutex/condvar queue):
+ *   gcc -DRUN_BENCH -O2 -Wall -lpthread queue.c util.c -o queue-bench
  */
 
 #ifndef _GNU_SOURCE
@@ -14,6 +32,7 @@
 #include "util.h"
 
 #include <assert.h>
+#include <linux/futex.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -23,18 +42,60 @@
 #include <unistd.h>
 
 
+/* how many times to retry before parking on the futex */
+#define QUEUE_SPINS     64
+
+/* q->parked_* hold the # of parked threads and a wakeup epoch */
+#define PARKED_MASK     0xffffU
+#define PARKED_EPOCH    0x10000U
+
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#else
+  __asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+static int futex_wait(unsigned int *addr,
+                      unsigned int val,
+                      const struct timespec *timeout)
+{
+  return syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, timeout, NULL, 0);
+}
+
+static void futex_wake(unsigned int *addr, int count)
+{
+  syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
 void queue_init(queue_t q)
 {
-  if (pthread_mutex_init(&q->lock, 0)) {
-    error(EXIT_SYSTEM_CALL, "Failed to init mutex");
-  }
+  unsigned long i;
+
+  for (i=0; i <= q->mask; i++)
+    q->slots[i].seq = i;
+
+  q->head = q->tail = 0;
+  q->parked_consumers = q->parked_producers = 0;
+  q->overflows = 0;
 }
 
 queue_t queue_new(int size)
 {
+  int slots = 2;
   queue_t q = safe_alloc(sizeof(queue));
-  q->ptrs = safe_alloc(sizeof(void *) * size);
-  q->size = size;
+
+  while (slots < size)
+    slots <<= 1;
+
+  q->slots = safe_alloc(sizeof(queue_slot) * slots);
+  q->mask = slots - 1;
+  q->size = slots;
+  /* spinning only makes sense if the producer can run meanwhile */
+  q->spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? QUEUE_SPINS : 0;
   queue_init(q);
   return q;
 }
@@ -42,79 +103,424 @@ queue_t queue_new(int size)
 void queue_destroy(queue_t q)
 {
   assert(q);
-  assert(q->ptrs);
-  free(q->ptrs);
+  assert(q->slots);
+  free(q->slots);
   free(q);
 }
 
-int queue_add(queue_t q, void *item)
+/* returns 1 if the item was added, 0 if the queue is full */
+static int try_add(queue_t q, void *item)
 {
-  int rv = 1;
+  queue_slot *slot;
+  unsigned long pos, seq;
+  long diff;
+
+  pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+  while (1) {
+    slot = &q->slots[pos & q->mask];
+    seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    diff = (long)seq - (long)pos;
+
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else if (diff < 0) {
+      return 0;
+    } else {
+      pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    }
+  }
 
-  pthread_mutex_lock(&q->lock);
+  slot->item = item;
+  __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
 
-  /* queue full?*/
-  if (q->count == q->size) {
-    warn("Can't add item, queue is full");
-    rv = 0;
-    goto out;
+  return 1;
+}
+
+/* returns 1 if an item was removed (and stored in *item), 0 if empty */
+static int try_remove(queue_t q, void **item)
+{
+  queue_slot *slot;
+  unsigned long pos, seq;
+  long diff;
+
+  pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+  while (1) {
+    slot = &q->slots[pos & q->mask];
+    seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    diff = (long)seq - (long)(pos + 1);
+
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else if (diff < 0) {
+      return 0;
+    } else {
+      pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    }
   }
 
-  if (q->tail >= q->size) {
-    q->tail = 0;
+  *item = slot->item;
+  __atomic_store_n(&slot->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+
+  return 1;
+}
+
+/*
+ * Batches claim a range of positions first and then wait for each slot's
+ * turn: whoever had the slot in the previous lap already claimed it, so
+ * it's only a matter of them finishing the copy.
+ */
+static void wait_for_turn(queue_slot *slot, unsigned long seq)
+{
+  int spins = 0;
+
+  while (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq) {
+    if (++spins < QUEUE_SPINS)
+      cpu_relax();
+    else
+      sched_yield();
   }
+}
 
+/* returns how many items (from the start of items) were added */
+static int try_add_many(queue_t q, void **items, int count)
+{
+  queue_slot *slot;
+  unsigned long pos, head;
+  long n;
+  int i;
+
+  pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+  do {
+    head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+    n = (long)q->size - (long)(pos - head);
+    if (n <= 0)
+      return 0;
+    if (n > count)
+      n = count;
+  } while (!__atomic_compare_exchange_n(&q->tail, &pos, pos + n, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+  for (i=0; i < n; i++) {
+    slot = &q->slots[(pos + i) & q->mask];
+    wait_for_turn(slot, pos + i);
+    slot->item = items[i];
+    __atomic_store_n(&slot->seq, pos + i + 1, __ATOMIC_RELEASE);
+  }
 
-  q->ptrs[q->tail] = item;
-  q->tail++;
-  q->count++;
+  return n;
+}
 
-  pthread_cond_broadcast(&q->cond);
+/* returns how many items were removed (and stored in items) */
+static int try_remove_many(queue_t q, void **items, int max)
+{
+  queue_slot *slot;
+  unsigned long pos, tail;
+  long n;
+  int i;
+
+  pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+  do {
+    tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+    n = (long)(tail - pos);
+    if (n <= 0)
+      return 0;
+    if (n > max)
+      n = max;
+  } while (!__atomic_compare_exchange_n(&q->head, &pos, pos + n, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+  for (i=0; i < n; i++) {
+    slot = &q->slots[(pos + i) & q->mask];
+    wait_for_turn(slot, pos + i + 1);
+    items[i] = slot->item;
+    __atomic_store_n(&slot->seq, pos + i + q->mask + 1, __ATOMIC_RELEASE);
+  }
 
-out:
-  pthread_mutex_unlock(&q->lock);
+  return n;
+}
 
-  return rv;
+/* Note:
+ *
+ * pairs with the fence in prepare_park(): either the parking thread sees
+ * the new item (or free slot) when it re-checks, or we see it in *parked
+ * here. Waking takes the woken threads off the parked count, so a burst of
+ * adds only pays for as many FUTEX_WAKEs as there are threads sleeping.
+ */
+static void wake_parked(unsigned int *parked, int count)
+{
+  unsigned int v, n;
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  v = __atomic_load_n(parked, __ATOMIC_RELAXED);
+  do {
+    n = v & PARKED_MASK;
+    if (n == 0)
+      return;
+    if (n > count)
+      n = count;
+  } while (!__atomic_compare_exchange_n(parked, &v, v + PARKED_EPOCH - n, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+  futex_wake(parked, n);
+}
+
+/* returns the epoch to wait on */
+static unsigned int prepare_park(unsigned int *parked)
+{
+  unsigned int v = __atomic_fetch_add(parked, 1, __ATOMIC_RELAXED);
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  return v & ~PARKED_MASK;
+}
+
+static void cancel_park(unsigned int *parked, unsigned int epoch)
+{
+  unsigned int v = __atomic_load_n(parked, __ATOMIC_RELAXED);
+
+  do {
+    /* somebody already woke us up, pass it on */
+    if ((v & ~PARKED_MASK) != epoch) {
+      wake_parked(parked, 1);
+      return;
+    }
+  } while (!__atomic_compare_exchange_n(parked, &v, v - 1, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/*
+ * deadline is in now_nsecs() terms, 0 to wait forever
+ *
+ * returns 1 if woken up, 0 on timeout (in which case the caller still has
+ * to cancel_park())
+ */
+static int park(unsigned int *parked, unsigned int epoch, uint64_t deadline)
+{
+  struct timespec ts, *timeout = NULL;
+  unsigned int v;
+  uint64_t now;
+
+  while (1) {
+    v = __atomic_load_n(parked, __ATOMIC_ACQUIRE);
+    if ((v & ~PARKED_MASK) != epoch)
+      return 1;
+
+    if (deadline) {
+      now = now_nsecs();
+      if (now >= deadline)
+        return 0;
+      ts.tv_sec = (deadline - now) / 1000000000ULL;
+      ts.tv_nsec = (deadline - now) % 1000000000ULL;
+      timeout = &ts;
+    }
+
+    futex_wait(parked, v, timeout);
+  }
+}
+
+static void wake_consumers(queue_t q, int count)
+{
+  wake_parked(&q->parked_consumers, count);
+}
+
+/* producers only ever park if there's an add timeout */
+static void wake_producers(queue_t q, int count)
+{
+  if (q->add_timeout)
+    wake_parked(&q->parked_producers, count);
+}
+
+static int add_batch(queue_t q, void **items, int count)
+{
+  int n = count == 1 ? try_add(q, items[0]) : try_add_many(q, items, count);
+
+  if (n > 0)
+    wake_consumers(q, n);
+
+  return n;
+}
+
+/*
+ * Adds as many items as possible. If the queue is full, this waits for
+ * up to the add timeout (see queue_set_add_timeout()) for consumers to
+ * make room, and counts an overflow.
+ *
+ * returns how many items (from the start of items) were added
+ */
+int queue_add_many(queue_t q, void **items, int count)
+{
+  int added, n;
+  unsigned int epoch;
+  uint64_t deadline;
+
+  added = add_batch(q, items, count);
+  if (added == count)
+    return added;
+
+  __atomic_add_fetch(&q->overflows, 1, __ATOMIC_RELAXED);
+
+  if (!q->add_timeout)
+    return added;
+
+  deadline = now_nsecs() + (uint64_t)q->add_timeout * 1000000ULL;
+
+  while (added < count) {
+    epoch = prepare_park(&q->parked_producers);
+
+    if ((n = add_batch(q, items + added, count - added))) {
+      cancel_park(&q->parked_producers, epoch);
+      added += n;
+      continue;
+    }
+
+    if (!park(&q->parked_producers, epoch, deadline)) {
+      cancel_park(&q->parked_producers, epoch);
+      break;
+    }
+
+    added += add_batch(q, items + added, count - added);
+  }
+
+  return added;
+}
+
+/* returns 1 if the item was added, 0 if the queue stayed full */
+int queue_add(queue_t q, void *item)
+{
+  return queue_add_many(q, &item, 1);
 }
 
 /*
- * you need to lock the queue to call this
  * returns 1 if empty, 0 otherwise
+ *
+ * this is only a snapshot, other threads might be adding/removing
  */
 int queue_empty(queue_t q)
 {
-  return q->count == 0;
+  return queue_count(q) == 0;
 }
 
 /* blocks until there's an element to remove */
 void *queue_remove(queue_t q)
 {
   void *item = NULL;
+  unsigned int epoch;
+  int spins;
 
-  pthread_mutex_lock(&q->lock);
+  while (1) {
+    for (spins=0; spins < q->spins; spins++) {
+      if (try_remove(q, &item))
+        goto out;
+      cpu_relax();
+    }
 
-  while (queue_empty(q)) {
-    pthread_cond_wait(&q->cond, &q->lock);
+    epoch = prepare_park(&q->parked_consumers);
+
+    if (try_remove(q, &item)) {
+      cancel_park(&q->parked_consumers, epoch);
+      goto out;
+    }
+
+    park(&q->parked_consumers, epoch, 0);
   }
 
-  if (q->head >= q->size)
-    q->head = 0;
+out:
+  wake_producers(q, 1);
+  return item;
+}
 
-  item = q->ptrs[q->head];
-  q->head++;
-  q->count--;
+/* deadline is in now_nsecs() terms, 0 to wait forever */
+static int remove_many_until(queue_t q, void **items, int max, uint64_t deadline)
+{
+  unsigned int epoch;
+  int spins, n;
+
+  while (1) {
+    for (spins=0; spins < q->spins; spins++) {
+      if ((n = try_remove_many(q, items, max)))
+        goto out;
+      cpu_relax();
+    }
+
+    epoch = prepare_park(&q->parked_consumers);
+
+    if ((n = try_remove_many(q, items, max))) {
+      cancel_park(&q->parked_consumers, epoch);
+      goto out;
+    }
+
+    if (!park(&q->parked_consumers, epoch, deadline)) {
+      cancel_park(&q->parked_consumers, epoch);
+      if ((n = try_remove_many(q, items, max)))
+        goto out;
+      return 0;
+    }
+  }
 
-  pthread_mutex_unlock(&q->lock);
+out:
+  wake_producers(q, n);
+  return n;
+}
 
-  return item;
+/*
+ * blocks until there's at least one element, and removes up to max of them
+ *
+ * returns how many were removed
+ */
+int queue_remove_many(queue_t q, void **items, int max)
+{
+  return remove_many_until(q, items, max, 0);
+}
+
+/*
+ * like queue_remove_many(), but gives up after timeout_ms (0 to not block)
+ *
+ * returns how many were removed, 0 on timeout
+ */
+int queue_remove_many_timeout(queue_t q, void **items, int max, int timeout_ms)
+{
+  int n;
+
+  if (timeout_ms <= 0) {
+    if ((n = try_remove_many(q, items, max)))
+      wake_producers(q, n);
+    return n;
+  }
+
+  return remove_many_until(q, items, max,
+                           now_nsecs() + (uint64_t)timeout_ms * 1000000ULL);
 }
 
 int queue_count(queue_t q)
 {
-  return q->count;
+  unsigned long head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+  unsigned long tail = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+  long count = (long)(tail - head);
+
+  if (count < 0)
+    return 0;
+
+  return count > q->size ? q->size : (int)count;
 }
 
 
+/* how long (in ms) adds wait for room when the queue is full, 0 to not wait */
+void queue_set_add_timeout(queue_t q, int timeout_ms)
+{
+  q->add_timeout = timeout_ms;
+}
+
+/* # of times an add found the queue full */
+long queue_overflows(queue_t q)
+{
+  return __atomic_load_n(&q->overflows, __ATOMIC_RELAXED);
+}
+
 void queue_set_user_data(queue_t q, void *data)
 {
   if (q->user_data)
@@ -189,15 +595,31 @@ void test_queue_full(void)
 {
   char *a = "hello";
   char *b = "goodbye";
-  queue_t q = queue_new(1);
+  char *c = "again";
+  queue_t q = queue_new(2);
 
   assert(queue_add(q, a));
+  assert(queue_add(q, b));
   info("count = %d", queue_count(q));
-  assert(queue_count(q) == 1);
-  assert(!queue_add(q, b));
+  assert(queue_count(q) == 2);
+  assert(!queue_add(q, c));
   info("count = %d", queue_count(q));
-  assert(queue_count(q) == 1);
+  assert(queue_count(q) == 2);
+
+  queue_destroy(q);
+}
+
+void test_size_rounding(void)
+{
+  queue_t q = queue_new(1);
 
+  info("size = %d", q->size);
+  assert(q->size == 2);
+  queue_destroy(q);
+
+  q = queue_new(1000);
+  info("size = %d", q->size);
+  assert(q->size == 1024);
   queue_destroy(q);
 }
 
@@ -267,12 +689,495 @@ void test_right_value(void)
   assert(queue_count(q) == 0);
 }
 
+void test_add_remove_many(void)
+{
+  int values[6] = { 1, 2, 3, 4, 5, 6 };
+  void *items[6];
+  void *out[6];
+  queue_t q = queue_new(4);
+  int i;
+
+  for (i=0; i < 6; i++)
+    items[i] = &values[i];
+
+  /* only 4 fit */
+  assert(queue_add_many(q, items, 6) == 4);
+  info("count = %d", queue_count(q));
+  assert(queue_count(q) == 4);
+
+  assert(queue_remove_many(q, out, 3) == 3);
+  for (i=0; i < 3; i++)
+    assert(*(int *)out[i] == i + 1);
+  assert(queue_count(q) == 1);
+
+  /* wraps around */
+  assert(queue_add_many(q, items + 4, 2) == 2);
+  assert(queue_add(q, items[0]));
+  info("count = %d", queue_count(q));
+  assert(queue_count(q) == 4);
+
+  assert(queue_remove_many(q, out, 6) == 4);
+  assert(*(int *)out[0] == 4);
+  assert(*(int *)out[1] == 5);
+  assert(*(int *)out[2] == 6);
+  assert(*(int *)out[3] == 1);
+  assert(queue_count(q) == 0);
+
+  queue_destroy(q);
+}
+
+static void *slow_consumer(void *data)
+{
+  queue_t q = (queue_t)data;
+
+  usleep(50 * 1000);
+  queue_remove(q);
+
+  return NULL;
+}
+
+void test_add_timeout(void)
+{
+  char *a = "hello";
+  char *b = "goodbye";
+  char *c = "again";
+  queue_t q = queue_new(2);
+  pthread_t tid;
+  uint64_t start, elapsed;
+
+  queue_set_add_timeout(q, 100);
+  assert(queue_add(q, a));
+  assert(queue_add(q, b));
+  assert(queue_overflows(q) == 0);
+
+  /* nobody makes room, so we give up after the timeout */
+  start = now_nsecs();
+  assert(!queue_add(q, c));
+  elapsed = now_nsecs() - start;
+  info("gave up after %llu ms", (unsigned long long)elapsed / 1000000);
+  assert(elapsed >= 100 * 1000000ULL);
+  assert(queue_overflows(q) == 1);
+
+  /* a consumer makes room while we wait */
+  pthread_create(&tid, NULL, &slow_consumer, q);
+  assert(queue_add(q, c));
+  pthread_join(tid, NULL);
+  assert(queue_overflows(q) == 2);
+  assert(queue_count(q) == 2);
+  assert(strcmp((char *)queue_remove(q), "goodbye") == 0);
+  assert(strcmp((char *)queue_remove(q), "again") == 0);
+
+  queue_destroy(q);
+}
+
+void test_remove_timeout(void)
+{
+  char *a = "hello";
+  void *items[2];
+  queue_t q = queue_new(2);
+  uint64_t start, elapsed;
+
+  /* non-blocking */
+  assert(queue_remove_many_timeout(q, items, 2, 0) == 0);
+
+  start = now_nsecs();
+  assert(queue_remove_many_timeout(q, items, 2, 50) == 0);
+  elapsed = now_nsecs() - start;
+  info("gave up after %llu ms", (unsigned long long)elapsed / 1000000);
+  assert(elapsed >= 50 * 1000000ULL);
+
+  assert(queue_add(q, a));
+  assert(queue_remove_many_timeout(q, items, 2, 0) == 1);
+  assert(items[0] == a);
+  assert(queue_count(q) == 0);
+
+  queue_destroy(q);
+}
+
+#define MPMC_THREADS    4
+#define MPMC_ITEMS      100000
+
+static int mpmc_seen[MPMC_THREADS * MPMC_ITEMS];
+
+/* producers add chunks of 5 items, odd ones in a single batch */
+static void *mpmc_producer(void *data)
+{
+  static int next = 0;
+  static int next_id = 0;
+  queue_t q = (queue_t)data;
+  int batch = __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED) % 2;
+  void *items[5];
+  long i;
+  int j, n, added;
+
+  while ((i = __atomic_fetch_add(&next, 5, __ATOMIC_RELAXED)) <
+         MPMC_THREADS * MPMC_ITEMS) {
+    /* items are i + 1, so that NULL is never used */
+    for (n=0; n < 5 && i + n < MPMC_THREADS * MPMC_ITEMS; n++)
+      items[n] = (void *)(i + n + 1);
+
+    for (j=0; j < n; j += added) {
+      added = batch ? try_add_many(q, items + j, n - j) : try_add(q, items[j]);
+      if (added)
+        wake_consumers(q, added);
+      else
+        sched_yield();
+    }
+  }
+
+  return NULL;
+}
+
+/* odd consumers remove in batches, even ones one by one */
+static void *mpmc_consumer(void *data)
+{
+  static int next_id = 0;
+  queue_t q = (queue_t)data;
+  int batch = __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED) % 2 ? 7 : 1;
+  void *items[7];
+  long item;
+  int i = 0, j, n;
+
+  while (i < MPMC_ITEMS) {
+    n = queue_remove_many(q, items, MPMC_ITEMS - i < batch ? MPMC_ITEMS - i : batch);
+    for (j=0; j < n; j++) {
+      item = (long)items[j];
+      __atomic_add_fetch(&mpmc_seen[item - 1], 1, __ATOMIC_RELAXED);
+    }
+    i += n;
+  }
+
+  return NULL;
+}
+
+void test_many_producers_consumers(void)
+{
+  pthread_t producers[MPMC_THREADS], consumers[MPMC_THREADS];
+  queue_t q = queue_new(64);
+  int i;
+
+  for (i=0; i < MPMC_THREADS; i++) {
+    pthread_create(&consumers[i], NULL, &mpmc_consumer, q);
+    pthread_create(&producers[i], NULL, &mpmc_producer, q);
+  }
+
+  for (i=0; i < MPMC_THREADS; i++) {
+    pthread_join(producers[i], NULL);
+    pthread_join(consumers[i], NULL);
+  }
+
+  /* every item was removed exactly once */
+  for (i=0; i < MPMC_THREADS * MPMC_ITEMS; i++)
+    assert(mpmc_seen[i] == 1);
+
+  info("count = %d", queue_count(q));
+  assert(queue_count(q) == 0);
+
+  queue_destroy(q);
+}
+
 int main(int argc, char **argv)
 {
   run_test("basic", &test_basic);
   run_test("queue full", &test_queue_full);
+  run_test("size is rounded up to a power of 2", &test_size_rounding);
   run_test("add/remove more than size items", &test_more_than_size);
   run_test("get back the right element", &test_right_value);
+  run_test("add/remove many items at once", &test_add_remove_many);
+  run_test("wait for room when full", &test_add_timeout);
+  run_test("remove with a timeout", &test_remove_timeout);
+  run_test("many producers & consumers", &test_many_producers_consumers);
+
+  return 0;
+}
+
+#endif
+
+
+/*
+ * benchmarks
+ */
+
+#ifdef RUN_BENCH
+
+#define BENCH_ITEMS     2000000
+#define BENCH_STOP      ((void *)-1)
+
+/* the previous mutex/condvar queue, kept around as a baseline */
+typedef struct {
+  void **ptrs;
+  int head;
+  int tail;
+  int count;
+  int size;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} locked_queue;
+
+static void *locked_new(int size)
+{
+  locked_queue *q = safe_alloc(sizeof(locked_queue));
+  q->ptrs = safe_alloc(sizeof(void *) * size);
+  q->size = size;
+  INIT_LOCK(q);
+  pthread_cond_init(&q->cond, NULL);
+  return q;
+}
+
+static void locked_destroy(void *data)
+{
+  locked_queue *q = (locked_queue *)data;
+  free(q->ptrs);
+  free(q);
+}
+
+static int locked_add(void *data, void *item)
+{
+  locked_queue *q = (locked_queue *)data;
+  int rv = 1;
+
+  LOCK(q);
+
+  if (q->count == q->size) {
+    rv = 0;
+    goto out;
+  }
+
+  if (q->tail >= q->size)
+    q->tail = 0;
+
+  q->ptrs[q->tail++] = item;
+  q->count++;
+
+  pthread_cond_broadcast(&q->cond);
+
+out:
+  UNLOCK(q);
+
+  return rv;
+}
+
+static void *locked_remove(void *data)
+{
+  locked_queue *q = (locked_queue *)data;
+  void *item;
+
+  LOCK(q);
+
+  while (q->count == 0)
+    pthread_cond_wait(&q->cond, &q->lock);
+
+  if (q->head >= q->size)
+    q->head = 0;
+
+  item = q->ptrs[q->head++];
+  q->count--;
+
+  UNLOCK(q);
+
+  return item;
+}
+
+static void *lockfree_new(int size)
+{
+  return queue_new(size);
+}
+
+static void lockfree_destroy(void *data)
+{
+  queue_destroy((queue_t)data);
+}
+
+static int lockfree_add(void *data, void *item)
+{
+  return queue_add((queue_t)data, item);
+}
+
+static void *lockfree_remove(void *data)
+{
+  return queue_remove((queue_t)data);
+}
+
+static int lockfree_add_many(void *data, void **items, int count)
+{
+  return queue_add_many((queue_t)data, items, count);
+}
+
+static int lockfree_remove_many(void *data, void **items, int max)
+{
+  return queue_remove_many((queue_t)data, items, max);
+}
+
+#define BENCH_BATCH     16
+
+typedef struct {
+  const char *name;
+  void *(*new)(int);
+  void (*destroy)(void *);
+  int (*add)(void *, void *);
+  void *(*remove)(void *);
+  /* optional, used in batches of BENCH_BATCH */
+  int (*add_many)(void *, void **, int);
+  int (*remove_many)(void *, void **, int);
+} bench_impl;
+
+typedef struct {
+  const bench_impl *impl;
+  void *q;
+  int items;
+} bench_args;
+
+static void *bench_producer(void *data)
+{
+  bench_args *args = (bench_args *)data;
+  void *items[BENCH_BATCH];
+  int i, j, n;
+
+  if (!args->impl->add_many) {
+    for (i=0; i < args->items; i++) {
+      while (!args->impl->add(args->q, (void *)(long)(i + 1)))
+        sched_yield();
+    }
+    return NULL;
+  }
+
+  for (i=0; i < args->items; i += n) {
+    n = args->items - i < BENCH_BATCH ? args->items - i : BENCH_BATCH;
+    for (j=0; j < n; j++)
+      items[j] = (void *)(long)(i + j + 1);
+    for (j=0; j < n; ) {
+      int added = args->impl->add_many(args->q, items + j, n - j);
+      if (!added)
+        sched_yield();
+      j += added;
+    }
+  }
+
+  return NULL;
+}
+
+static void *bench_consumer(void *data)
+{
+  bench_args *args = (bench_args *)data;
+  void *items[BENCH_BATCH];
+  int stops = 0, i, n;
+
+  if (!args->impl->remove_many) {
+    while (args->impl->remove(args->q) != BENCH_STOP)
+      ;
+    return NULL;
+  }
+
+  while (!stops) {
+    n = args->impl->remove_many(args->q, items, BENCH_BATCH);
+    for (i=0; i < n; i++)
+      if (items[i] == BENCH_STOP)
+        stops++;
+  }
+
+  /* we might have taken somebody else's stop marker */
+  while (--stops > 0)
+    while (!args->impl->add(args->q, BENCH_STOP))
+      sched_yield();
+
+  return NULL;
+}
+
+static void bench_contention(const bench_impl *impl,
+                             int producers,
+                             int consumers)
+{
+  pthread_t *tids = safe_alloc(sizeof(pthread_t) * (producers + consumers));
+  bench_args args;
+  uint64_t start, elapsed;
+  char params[128];
+  long total;
+  int i;
+
+  args.impl = impl;
+  args.q = impl->new(1024);
+  args.items = BENCH_ITEMS / producers;
+  total = (long)args.items * producers;
+
+  start = now_nsecs();
+
+  for (i=0; i < consumers; i++)
+    pthread_create(&tids[i], NULL, &bench_consumer, &args);
+  for (i=0; i < producers; i++)
+    pthread_create(&tids[consumers + i], NULL, &bench_producer, &args);
+
+  for (i=0; i < producers; i++)
+    pthread_join(tids[consumers + i], NULL);
+
+  /* one stop marker per consumer, once everything else is in */
+  for (i=0; i < consumers; i++) {
+    while (!impl->add(args.q, BENCH_STOP))
+      sched_yield();
+  }
+
+  for (i=0; i < consumers; i++)
+    pthread_join(tids[i], NULL);
+
+  elapsed = now_nsecs() - start;
+
+  snprintf(params, sizeof(params),
+           "impl=%s producers=%d consumers=%d",
+           impl->name,
+           producers,
+           consumers);
+  bench_report("queue", params, total, elapsed);
+
+  impl->destroy(args.q);
+  free(tids);
+}
+
+/* no contention at all: add a batch, then remove it, from the same thread */
+static void bench_same_thread(const bench_impl *impl)
+{
+  void *q = impl->new(1024);
+  uint64_t start, elapsed;
+  char params[128];
+  int i, j;
+
+  start = now_nsecs();
+
+  for (i=0; i < BENCH_ITEMS; i += 512) {
+    for (j=0; j < 512; j++)
+      impl->add(q, (void *)(long)(j + 1));
+    for (j=0; j < 512; j++)
+      impl->remove(q);
+  }
+
+  elapsed = now_nsecs() - start;
+
+  snprintf(params, sizeof(params), "impl=%s producers=0 consumers=0", impl->name);
+  bench_report("queue", params, (long)i * 2, elapsed);
+
+  impl->destroy(q);
+}
+
+int main(int argc, char **argv)
+{
+  static const bench_impl impls[] = {
+    { "locked",   locked_new,   locked_destroy,   locked_add,   locked_remove,
+      NULL, NULL },
+    { "lockfree", lockfree_new, lockfree_destroy, lockfree_add, lockfree_remove,
+      NULL, NULL },
+    { "lockfree-batch", lockfree_new, lockfree_destroy, lockfree_add,
+      lockfree_remove, lockfree_add_many, lockfree_remove_many },
+  };
+  /* { producers, consumers }: 1 poller feeding N workers, then N:N */
+  static const int shapes[][2] = {
+    { 1, 1 }, { 1, 2 }, { 1, 4 }, { 1, 8 }, { 2, 2 }, { 4, 4 },
+  };
+  int i, j;
+
+  for (j=0; j < 2; j++)
+    bench_same_thread(&impls[j]);
+
+  for (i=0; i < sizeof(shapes) / sizeof(shapes[0]); i++)
+    for (j=0; j < sizeof(impls) / sizeof(impls[0]); j++)
+      bench_contention(&impls[j], shapes[i][0], shapes[i][1]);
 
   return 0;
 }
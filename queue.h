@@ -3,15 +3,26 @@
 
 #include <pthread.h>
 
+#define QUEUE_CACHE_LINE    64
+
+typedef struct {
+  unsigned long seq;
+  void *item;
+} queue_slot;
+
 typedef struct {
-  void **ptrs;
-  int head;
-  int tail;
-  int count;
+  queue_slot *slots;
+  unsigned long mask;
   int size;
-  pthread_mutex_t lock;
-  pthread_cond_t cond;
+  int spins;
+  int add_timeout;
   void *user_data;
+  /* producers, consumers & parked threads each get their own cache line */
+  unsigned long tail __attribute__((aligned(QUEUE_CACHE_LINE)));
+  unsigned long head __attribute__((aligned(QUEUE_CACHE_LINE)));
+  unsigned int parked_consumers __attribute__((aligned(QUEUE_CACHE_LINE)));
+  unsigned int parked_producers;
+  long overflows;
 } queue;
 
 typedef queue * queue_t;
@@ -20,11 +31,15 @@ queue_t queue_new(int size);
 void queue_destroy(queue_t q);
 void queue_init(queue_t q);
 int queue_add(queue_t q, void *item);
+int queue_add_many(queue_t q, void **items, int count);
 void * queue_remove(queue_t q);
+int queue_remove_many(queue_t q, void **items, int max);
+int queue_remove_many_timeout(queue_t q, void **items, int max, int timeout_ms);
 int queue_empty(queue_t q);
 int queue_count(queue_t q);
+void queue_set_add_timeout(queue_t q, int timeout_ms);
+long queue_overflows(queue_t q);
 void queue_set_user_data(queue_t q, void *data);
 void *queue_get_user_data(queue_t q);
 
 #endif
-
@@ -61,3 +61,50 @@ int slab_eof(slab_t s)
 {
   return s->position == s->size;
 }
+
+#ifdef RUN_BENCH
+
+#include <stdio.h>
+
+#define BENCH_OPS       (1 << 22)
+#define BENCH_SLAB_SIZE (1 << 20)
+
+/* carve a slab into items until it's full, over and over */
+static void bench_carve(int item_size)
+{
+  slab_t s = slab_new(BENCH_SLAB_SIZE);
+  uint64_t start, elapsed;
+  char params[64];
+  long ops = 0;
+  char *mem;
+
+  start = now_nsecs();
+
+  while (ops < BENCH_OPS) {
+    s->position = 0;
+    while (!slab_eof(s)) {
+      mem = slab_get_cur(s);
+      *mem = 1;
+      slab_update_position(s, item_size);
+      ops++;
+    }
+  }
+
+  elapsed = now_nsecs() - start;
+
+  snprintf(params, sizeof(params), "op=carve item_size=%d", item_size);
+  bench_report("slab", params, ops, elapsed);
+
+  slab_destroy(s);
+}
+
+int main(int argc, char **argv)
+{
+  bench_carve(16);
+  bench_carve(64);
+  bench_carve(256);
+
+  return 0;
+}
+
+#endif
@@ -0,0 +1,267 @@
+/*
+ * a shared memory segment where each process publishes its stats
+ *
+ * It's created before fork()ing, so every child inherits it. Each child
+ * writes to its own region (cache line aligned, so they don't share lines)
+ * and anyone can read it. Regions are guarded by a seqlock: the writer
+ * makes the sequence odd while it's at it, and readers retry until they
+ * copy a region with the same even sequence before & after.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "stats.h"
+#include "util.h"
+
+
+#define CACHE_LINE  64
+
+#define ROUND_UP(x) (((x) + CACHE_LINE - 1) & ~((size_t)CACHE_LINE - 1))
+
+/* the sequence gets a line of its own, then the counters & the histograms */
+#define COUNTERS_OFFSET     CACHE_LINE
+
+/* a writer that's mid-write for this long probably died there */
+#define READ_TRIES          1000
+
+static size_t hists_offset(stats_t s)
+{
+  return COUNTERS_OFFSET + ROUND_UP(sizeof(uint64_t) * s->num_counters);
+}
+
+static char *region_of(stats_t s, int region)
+{
+  assert(region >= 0 && region < s->num_regions);
+  return (char *)s->base + s->region_size * region;
+}
+
+static unsigned *seq_of(stats_t s, int region)
+{
+  return (unsigned *)region_of(s, region);
+}
+
+stats_t stats_new(int num_regions, int num_counters, int num_hists)
+{
+  int saved;
+  stats_t s = safe_alloc(sizeof(stats));
+
+  s->num_regions = num_regions;
+  s->num_counters = num_counters;
+  s->num_hists = num_hists;
+  s->region_size = ROUND_UP(hists_offset(s) + sizeof(histogram) * num_hists);
+  s->size = s->region_size * num_regions;
+
+  /* zero-filled, which is an empty histogram too */
+  s->base = mmap(NULL,
+                 s->size,
+                 PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS,
+                 -1,
+                 0);
+  if (s->base == MAP_FAILED) {
+    saved = errno;
+    error(EXIT_SYSTEM_CALL,
+          "Failed to map the stats segment: %s",
+          strerror(saved));
+  }
+
+  return s;
+}
+
+void stats_destroy(stats_t s)
+{
+  assert(s);
+  munmap(s->base, s->size);
+  free(s);
+}
+
+void stats_begin_write(stats_t s, int region)
+{
+  unsigned *seq = seq_of(s, region);
+
+  __atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void stats_end_write(stats_t s, int region)
+{
+  unsigned *seq = seq_of(s, region);
+
+  __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+/* writers must only touch these between stats_begin_write() & _end_write() */
+uint64_t * stats_counters(stats_t s, int region)
+{
+  return (uint64_t *)(region_of(s, region) + COUNTERS_OFFSET);
+}
+
+histogram_t stats_histogram(stats_t s, int region, int hist)
+{
+  assert(hist >= 0 && hist < s->num_hists);
+  return (histogram_t)(region_of(s, region) + hists_offset(s)) + hist;
+}
+
+/*
+ * Copies a consistent snapshot of the region. counters must have room for
+ * num_counters, and hists for num_hists (either can be NULL). Returns -1 if
+ * it couldn't, i.e.: its writer was killed in the middle of a write.
+ */
+int stats_read(stats_t s, int region, uint64_t *counters, histogram_t *hists)
+{
+  unsigned *seq = seq_of(s, region);
+  unsigned before, after;
+  int j, tries;
+
+  for (tries=0; tries < READ_TRIES; tries++) {
+    before = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+    if (before & 1) {
+      sched_yield();
+      continue;
+    }
+
+    if (counters)
+      memcpy(counters,
+             stats_counters(s, region),
+             sizeof(uint64_t) * s->num_counters);
+
+    for (j=0; hists && j < s->num_hists; j++)
+      memcpy(hists[j], stats_histogram(s, region, j), sizeof(histogram));
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    after = __atomic_load_n(seq, __ATOMIC_RELAXED);
+    if (before == after)
+      return 0;
+  }
+
+  return -1;
+}
+
+
+#ifdef RUN_TESTS
+
+#include <pthread.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define ROUNDS 100000
+
+static void *write_pairs(void *data)
+{
+  stats_t s = (stats_t)data;
+  uint64_t *counters;
+  int j;
+
+  for (j=1; j <= ROUNDS; j++) {
+    stats_begin_write(s, 1);
+    counters = stats_counters(s, 1);
+    counters[0] = j;
+    counters[1] = j;
+    counters[2] = j;
+    histogram_record(stats_histogram(s, 1, 0), j);
+    stats_end_write(s, 1);
+  }
+
+  return NULL;
+}
+
+static void test_consistent_reads(void)
+{
+  stats_t s = stats_new(2, 3, 1);
+  histogram_t hist = histogram_new();
+  uint64_t counters[3];
+  pthread_t tid;
+
+  pthread_create(&tid, NULL, &write_pairs, s);
+
+  do {
+    histogram_reset(hist);
+    if (stats_read(s, 1, counters, &hist))
+      continue;
+    assert(counters[0] == counters[1]);
+    assert(counters[1] == counters[2]);
+    assert(histogram_count(hist) == counters[0]);
+  } while (counters[0] < ROUNDS);
+
+  pthread_join(tid, NULL);
+
+  /* the other region was left alone */
+  stats_read(s, 0, counters, NULL);
+  assert(counters[0] == 0);
+
+  histogram_destroy(hist);
+  stats_destroy(s);
+}
+
+static void test_across_fork(void)
+{
+  stats_t s = stats_new(4, 1, 0);
+  uint64_t counter, total = 0;
+  pid_t pid;
+  int j;
+
+  for (j=0; j < 4; j++) {
+    pid = fork();
+    assert(pid != -1);
+
+    if (!pid) {
+      stats_begin_write(s, j);
+      stats_counters(s, j)[0] = j + 1;
+      stats_end_write(s, j);
+      _exit(0);
+    }
+  }
+
+  while (wait(NULL) > 0)
+    ;
+
+  for (j=0; j < 4; j++) {
+    assert(stats_read(s, j, &counter, NULL) == 0);
+    total += counter;
+  }
+
+  info("children published a total of %lu", total);
+  assert(total == 1 + 2 + 3 + 4);
+
+  stats_destroy(s);
+}
+
+/* it's never done with the write, so it'd be waited on forever */
+static void test_dead_writer(void)
+{
+  stats_t s = stats_new(2, 1, 0);
+  uint64_t counter;
+  pid_t pid = fork();
+
+  assert(pid != -1);
+  if (!pid) {
+    stats_begin_write(s, 1);
+    stats_counters(s, 1)[0] = 42;
+    _exit(0);
+  }
+
+  waitpid(pid, NULL, 0);
+
+  assert(stats_read(s, 1, &counter, NULL) == -1);
+  assert(stats_read(s, 0, &counter, NULL) == 0);
+
+  stats_destroy(s);
+}
+
+int main(int argc, char **argv)
+{
+  assert(sizeof(histogram) % 8 == 0);
+
+  run_test("consistent reads", &test_consistent_reads);
+  run_test("across fork()", &test_across_fork);
+  run_test("a writer that died mid-write", &test_dead_writer);
+
+  return 0;
+}
+
+#endif
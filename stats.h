@@ -0,0 +1,32 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "histogram.h"
+
+/*
+ * A shared segment with a region per process, each holding num_counters
+ * counters & num_hists histograms. Every region has a single writer.
+ */
+typedef struct {
+  void *base;
+  size_t size;
+  size_t region_size;
+  int num_regions;
+  int num_counters;
+  int num_hists;
+} stats;
+
+typedef stats * stats_t;
+
+stats_t stats_new(int num_regions, int num_counters, int num_hists);
+void stats_destroy(stats_t s);
+void stats_begin_write(stats_t s, int region);
+void stats_end_write(stats_t s, int region);
+uint64_t * stats_counters(stats_t s, int region);
+histogram_t stats_histogram(stats_t s, int region, int hist);
+int stats_read(stats_t s, int region, uint64_t *counters, histogram_t *hists);
+
+#endif
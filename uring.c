@@ -0,0 +1,385 @@
+/*
+ * A minimal io_uring wrapper (raw syscalls, no liburing), just enough for
+ * polling fds: (multishot) poll adds, updates & removes.
+ *
+ * Submissions can come from any thread (they're serialized by a lock) and
+ * are only handed to the kernel on uring_submit() or uring_wait(), so many
+ * of them cost a single io_uring_enter(). Completions are meant to be
+ * reaped by a single thread.
+ *
+ * Needs a 5.13+ kernel (multishot polls & IORING_ENTER_EXT_ARG).
+ *
+ * To test:
+ *   gcc -DRUN_TESTS -Wall -lpthread uring.c util.c -o uring-test
+ */
+
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE
+#endif
+
+#include <assert.h>
+#include <endian.h>
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "uring.h"
+#include "util.h"
+
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd,
+                          unsigned to_submit,
+                          unsigned min_complete,
+                          unsigned flags,
+                          void *arg,
+                          size_t argsz)
+{
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                      arg, argsz);
+}
+
+static void *map_ring(int fd, size_t size, off_t offset)
+{
+  int saved;
+  void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, offset);
+
+  if (ptr == MAP_FAILED) {
+    saved = errno;
+    error(EXIT_SYSTEM_CALL, "Failed to mmap io_uring: %s", strerror(saved));
+  }
+
+  return ptr;
+}
+
+/* cq_entries of 0 means the kernel's default (twice the entries) */
+uring_t uring_new(unsigned entries, unsigned cq_entries)
+{
+  struct io_uring_params p;
+  unsigned *array, i;
+  int saved;
+  uring_t r = safe_alloc(sizeof(uring));
+
+  memset(&p, 0, sizeof(p));
+  if (cq_entries) {
+    p.flags |= IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+    p.cq_entries = cq_entries;
+  }
+
+  r->fd = io_uring_setup(entries, &p);
+  if (r->fd == -1) {
+    saved = errno;
+    error(EXIT_SYSTEM_CALL, "Failed to setup io_uring: %s", strerror(saved));
+  }
+
+  if (!(p.features & IORING_FEAT_EXT_ARG))
+    error(EXIT_SYSTEM_CALL, "io_uring is too old (no IORING_FEAT_EXT_ARG)");
+
+  r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (r->cq_ring_size > r->sq_ring_size)
+      r->sq_ring_size = r->cq_ring_size;
+    r->sq_ring = map_ring(r->fd, r->sq_ring_size, IORING_OFF_SQ_RING);
+    r->cq_ring = r->sq_ring;
+  } else {
+    r->sq_ring = map_ring(r->fd, r->sq_ring_size, IORING_OFF_SQ_RING);
+    r->cq_ring = map_ring(r->fd, r->cq_ring_size, IORING_OFF_CQ_RING);
+  }
+
+  r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes = map_ring(r->fd, r->sqes_size, IORING_OFF_SQES);
+
+  r->sq_entries = p.sq_entries;
+  r->sq_head = (unsigned *)((char *)r->sq_ring + p.sq_off.head);
+  r->sq_tail = (unsigned *)((char *)r->sq_ring + p.sq_off.tail);
+  r->sq_mask = *(unsigned *)((char *)r->sq_ring + p.sq_off.ring_mask);
+  r->cq_head = (unsigned *)((char *)r->cq_ring + p.cq_off.head);
+  r->cq_tail = (unsigned *)((char *)r->cq_ring + p.cq_off.tail);
+  r->cq_mask = *(unsigned *)((char *)r->cq_ring + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)((char *)r->cq_ring + p.cq_off.cqes);
+
+  /* sqes are always used in order, so the indirection is the identity */
+  array = (unsigned *)((char *)r->sq_ring + p.sq_off.array);
+  for (i=0; i < p.sq_entries; i++)
+    array[i] = i;
+
+  INIT_LOCK(r);
+
+  return r;
+}
+
+void uring_destroy(uring_t r)
+{
+  assert(r);
+  munmap(r->sqes, r->sqes_size);
+  if (r->cq_ring != r->sq_ring)
+    munmap(r->cq_ring, r->cq_ring_size);
+  munmap(r->sq_ring, r->sq_ring_size);
+  close(r->fd);
+  free(r);
+}
+
+/* hands whatever is in the SQ to the kernel, returns how many it took */
+static int submit(uring_t r)
+{
+  int rv, saved;
+
+  while ((rv = io_uring_enter(r->fd, r->sq_entries, 0, 0, NULL, 0)) == -1) {
+    saved = errno;
+    if (saved == EINTR)
+      continue;
+    if (saved == EAGAIN || saved == EBUSY) {
+      /* the CQ is backed up, give the reaper a chance */
+      sched_yield();
+      continue;
+    }
+    error(EXIT_SYSTEM_CALL, "io_uring_enter failed with: %s", strerror(saved));
+  }
+
+  return rv;
+}
+
+/* must be called with the lock held, and followed by put_sqe() */
+static struct io_uring_sqe *get_sqe(uring_t r)
+{
+  struct io_uring_sqe *sqe;
+  unsigned tail = *r->sq_tail;
+
+  while (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries)
+    submit(r);
+
+  sqe = &r->sqes[tail & r->sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+static void put_sqe(uring_t r)
+{
+  __atomic_store_n(r->sq_tail, *r->sq_tail + 1, __ATOMIC_RELEASE);
+}
+
+static unsigned poll_events(unsigned events)
+{
+#if __BYTE_ORDER == __BIG_ENDIAN
+  events = (events << 16) | (events >> 16);
+#endif
+  return events;
+}
+
+/* events are poll(2) ones, the cqe's res will hold the ready ones */
+void uring_poll_add(uring_t r, int fd, unsigned events, uint64_t user_data, int multishot)
+{
+  struct io_uring_sqe *sqe;
+
+  LOCK(r);
+  sqe = get_sqe(r);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = poll_events(events);
+  sqe->len = multishot ? IORING_POLL_ADD_MULTI : 0;
+  sqe->user_data = user_data;
+  put_sqe(r);
+  UNLOCK(r);
+}
+
+/*
+ * changes the events of the poll added with target as its user_data, in
+ * place. Its readiness is checked again, so this also re-arms it.
+ *
+ * If it's gone, the update's own cqe (user_data) gets -ENOENT.
+ */
+void uring_poll_update(uring_t r, uint64_t target, unsigned events, int multishot, uint64_t user_data)
+{
+  struct io_uring_sqe *sqe;
+
+  LOCK(r);
+  sqe = get_sqe(r);
+  sqe->opcode = IORING_OP_POLL_REMOVE;
+  sqe->fd = -1;
+  sqe->addr = target;
+  sqe->poll32_events = poll_events(events);
+  sqe->len = IORING_POLL_UPDATE_EVENTS | (multishot ? IORING_POLL_ADD_MULTI : 0);
+  sqe->user_data = user_data;
+  put_sqe(r);
+  UNLOCK(r);
+}
+
+/* the removed poll completes with -ECANCELED */
+void uring_poll_remove(uring_t r, uint64_t target, uint64_t user_data)
+{
+  struct io_uring_sqe *sqe;
+
+  LOCK(r);
+  sqe = get_sqe(r);
+  sqe->opcode = IORING_OP_POLL_REMOVE;
+  sqe->fd = -1;
+  sqe->addr = target;
+  sqe->user_data = user_data;
+  put_sqe(r);
+  UNLOCK(r);
+}
+
+/* returns how many sqes were submitted (a no-op if there are none) */
+int uring_submit(uring_t r)
+{
+  if (__atomic_load_n(r->sq_tail, __ATOMIC_ACQUIRE) ==
+      __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE))
+    return 0;
+
+  return submit(r);
+}
+
+/*
+ * Submits whatever is pending and waits up to timeout_ms (0 to not wait)
+ * for completions, copying up to max of them to cqes.
+ *
+ * returns how many were copied, 0 on timeout
+ */
+int uring_wait(uring_t r, struct io_uring_cqe *cqes, int max, int timeout_ms)
+{
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  unsigned head, tail;
+  int n, saved;
+
+  head = *r->cq_head;
+  tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+
+  if (head == tail) {
+    memset(&arg, 0, sizeof(arg));
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+
+    if (io_uring_enter(r->fd, r->sq_entries, timeout_ms > 0 ? 1 : 0,
+                       IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                       &arg, sizeof(arg)) == -1) {
+      saved = errno;
+      if (saved != ETIME && saved != EINTR && saved != EAGAIN && saved != EBUSY)
+        error(EXIT_SYSTEM_CALL,
+              "io_uring_enter failed with: %s",
+              strerror(saved));
+    }
+
+    tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+  } else {
+    uring_submit(r);
+  }
+
+  for (n=0; head != tail && n < max; head++, n++)
+    cqes[n] = r->cqes[head & r->cq_mask];
+
+  __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+
+  return n;
+}
+
+
+/*
+ * tests
+ */
+
+#ifdef RUN_TESTS
+
+void test_poll_multishot(void)
+{
+  struct io_uring_cqe cqes[4];
+  uring_t r = uring_new(8, 0);
+  int fds[2];
+  char c;
+
+  assert(pipe(fds) == 0);
+
+  uring_poll_add(r, fds[0], POLLIN, 42, 1);
+  assert(uring_wait(r, cqes, 4, 10) == 0);
+
+  /* every new write triggers it again */
+  assert(write(fds[1], "a", 1) == 1);
+  assert(uring_wait(r, cqes, 4, 1000) == 1);
+  info("user_data = %llu, res = %d", (unsigned long long)cqes[0].user_data,
+       cqes[0].res);
+  assert(cqes[0].user_data == 42);
+  assert(cqes[0].res & POLLIN);
+  assert(cqes[0].flags & IORING_CQE_F_MORE);
+
+  assert(write(fds[1], "b", 1) == 1);
+  assert(uring_wait(r, cqes, 4, 1000) == 1);
+  assert(cqes[0].user_data == 42);
+
+  /* an update re-checks readiness, and there's still data to read */
+  uring_poll_update(r, 42, POLLIN, 1, 43);
+  assert(uring_wait(r, cqes, 4, 1000) == 2);
+  assert((cqes[0].user_data == 42 && cqes[1].user_data == 43) ||
+         (cqes[0].user_data == 43 && cqes[1].user_data == 42));
+
+  assert(read(fds[0], &c, 1) == 1);
+  assert(read(fds[0], &c, 1) == 1);
+
+  /* removing it completes it one last time */
+  uring_poll_remove(r, 42, 44);
+  assert(uring_wait(r, cqes, 4, 1000) >= 1);
+  while (uring_wait(r, cqes + 1, 3, 10) > 0)
+    ;
+
+  /* and it's gone */
+  uring_poll_update(r, 42, POLLIN, 1, 45);
+  assert(uring_wait(r, cqes, 4, 1000) == 1);
+  info("update of a removed poll: res = %d", cqes[0].res);
+  assert(cqes[0].user_data == 45);
+  assert(cqes[0].res == -ENOENT);
+
+  close(fds[0]);
+  close(fds[1]);
+  uring_destroy(r);
+}
+
+void test_batched_submit(void)
+{
+  struct io_uring_cqe cqes[64];
+  uring_t r = uring_new(4, 64);
+  int fds[2], i, n;
+
+  assert(pipe(fds) == 0);
+  assert(write(fds[1], "a", 1) == 1);
+
+  /* more than fit in the SQ, so some get pushed out on the way */
+  for (i=0; i < 16; i++)
+    uring_poll_add(r, fds[0], POLLIN, i, 0);
+  uring_submit(r);
+
+  for (n=0; n < 16; )
+    n += uring_wait(r, cqes + n, 64 - n, 1000);
+
+  info("got %d completions", n);
+  assert(n == 16);
+  for (i=0; i < n; i++) {
+    assert(cqes[i].res & POLLIN);
+    assert(!(cqes[i].flags & IORING_CQE_F_MORE));
+  }
+
+  close(fds[0]);
+  close(fds[1]);
+  uring_destroy(r);
+}
+
+int main(int argc, char **argv)
+{
+  run_test("multishot poll, update & remove", &test_poll_multishot);
+  run_test("batched submissions", &test_batched_submit);
+
+  return 0;
+}
+
+#endif
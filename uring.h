@@ -0,0 +1,38 @@
+#ifndef _URING_H_
+#define _URING_H_
+
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct {
+  int fd;
+  unsigned sq_entries;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+  pthread_mutex_t lock; /* serializes the submission side */
+} uring;
+
+typedef uring * uring_t;
+
+uring_t uring_new(unsigned entries, unsigned cq_entries);
+void uring_destroy(uring_t r);
+void uring_poll_add(uring_t r, int fd, unsigned events, uint64_t user_data, int multishot);
+void uring_poll_update(uring_t r, uint64_t target, unsigned events, int multishot, uint64_t user_data);
+void uring_poll_remove(uring_t r, uint64_t target, uint64_t user_data);
+int uring_submit(uring_t r);
+int uring_wait(uring_t r, struct io_uring_cqe *cqes, int max, int timeout_ms);
+
+#endif
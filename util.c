@@ -1,6 +1,7 @@
 #include "util.h"
 
 #include <assert.h>
+#include <fcntl.h>
 #include <pwd.h>
 #include <stdio.h>
 #include <stdarg.h>
@@ -11,7 +12,38 @@
 #include <unistd.h>
 
 
+/*
+ * Async logging (see log_async_start()): each thread formats its messages
+ * into its own ring of records, and a logger thread adds the prefix (the
+ * timestamp is only formatted once per second) and writes them out.
+ */
+#define LOG_RING_SIZE   256   /* records per thread, a power of 2 */
+#define LOG_MSG_SIZE    1024  /* longer ones are written synchronously */
+#define LOG_IDLE_US     1000  /* how long the logger naps when there's nothing */
+
+typedef struct {
+  time_t secs;        /* a coarse timestamp */
+  const char *level;
+  char msg[LOG_MSG_SIZE];
+} log_record;
+
+/* single producer (its thread) & single consumer (whoever holds g_log_lock) */
+typedef struct log_ring {
+  log_record records[LOG_RING_SIZE];
+  unsigned head;
+  unsigned tail;
+  struct log_ring *next;
+} log_ring;
+
+static int g_log_async;
+static pid_t g_log_pid;
+static long g_log_drops;   /* records that didn't fit in their ring */
+static log_ring *g_log_rings; /* all of them */
+static __thread log_ring *t_log_ring;
+static pthread_mutex_t g_log_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static void do_log(const char *level, const char *msgfmt, va_list ap);
+static int drain_logs(void);
 
 
 void * safe_alloc(size_t count)
@@ -62,10 +94,18 @@ void change_uid(const char *username)
   setuid(passwd->pw_uid);
 }
 
+/* always synchronous, after whatever is still in the rings */
 void error(int rc, const char *msgfmt, ...)
 {
   va_list ap;
 
+  if (__atomic_load_n(&g_log_async, __ATOMIC_ACQUIRE)) {
+    pthread_mutex_lock(&g_log_lock);
+    drain_logs();
+    __atomic_store_n(&g_log_async, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&g_log_lock);
+  }
+
   va_start(ap, msgfmt);
   do_log("ERROR", msgfmt, ap);
   va_end(ap);
@@ -91,18 +131,171 @@ void info(const char *msgfmt, ...)
   va_end(ap);
 }
 
-/* an init function to provide the caller's PID would be nice */
-static void do_log(const char *level, const char *msgfmt, va_list ap)
+/* must be called with g_log_lock held */
+static const char *format_time(time_t secs)
+{
+  static char buf[64];
+  static time_t last = -1;
+  struct tm tm;
+
+  if (secs != last) {
+    localtime_r(&secs, &tm);
+    strftime(buf, sizeof(buf), "%B %d %Y %H:%M:%S", &tm);
+    last = secs;
+  }
+
+  return buf;
+}
+
+static log_ring *new_log_ring(void)
+{
+  log_ring *ring = safe_alloc(sizeof(log_ring));
+
+  ring->next = __atomic_load_n(&g_log_rings, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&g_log_rings, &ring->next, ring, 1,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+
+  return ring;
+}
+
+static void log_async(const char *level, const char *msgfmt, va_list ap)
+{
+  log_ring *ring = t_log_ring;
+  log_record *rec;
+  struct timespec ts;
+  unsigned tail;
+  va_list copy;
+  int len;
+
+  if (!ring)
+    ring = t_log_ring = new_log_ring();
+
+  tail = ring->tail;
+  if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == LOG_RING_SIZE) {
+    __atomic_add_fetch(&g_log_drops, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+
+  rec = &ring->records[tail & (LOG_RING_SIZE - 1)];
+  rec->secs = ts.tv_sec;
+  rec->level = level;
+
+  va_copy(copy, ap);
+  len = vsnprintf(rec->msg, LOG_MSG_SIZE, msgfmt, ap);
+  if (len >= LOG_MSG_SIZE) {
+    /* it doesn't fit, so it goes out right away (after what's queued) */
+    pthread_mutex_lock(&g_log_lock);
+    drain_logs();
+    printf("[%s][PID %d][%s] ", level, g_log_pid, format_time(ts.tv_sec));
+    vprintf(msgfmt, copy);
+    printf("\n");
+    fflush(stdout);
+    pthread_mutex_unlock(&g_log_lock);
+    va_end(copy);
+    return;
+  }
+  va_end(copy);
+
+  __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* must be called with g_log_lock held, returns how many were written */
+static int drain_logs(void)
+{
+  static long reported_drops = 0;
+  log_ring *ring;
+  log_record *rec;
+  unsigned head, tail;
+  long drops;
+  int count = 0;
+
+  ring = __atomic_load_n(&g_log_rings, __ATOMIC_ACQUIRE);
+  for (; ring; ring = ring->next) {
+    head = ring->head;
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++, count++) {
+      rec = &ring->records[head & (LOG_RING_SIZE - 1)];
+      printf("[%s][PID %d][%s] %s\n",
+             rec->level,
+             g_log_pid,
+             format_time(rec->secs),
+             rec->msg);
+    }
+
+    __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+  }
+
+  drops = __atomic_load_n(&g_log_drops, __ATOMIC_RELAXED);
+  if (drops != reported_drops) {
+    printf("[WARN][PID %d][%s] Dropped %ld log lines, the rings were full\n",
+           g_log_pid,
+           format_time(time(NULL)),
+           drops - reported_drops);
+    reported_drops = drops;
+    count++;
+  }
+
+  if (count)
+    fflush(stdout);
+
+  return count;
+}
+
+static void *run_logger(void *data)
+{
+  int count;
+
+  while (1) {
+    pthread_mutex_lock(&g_log_lock);
+    count = __atomic_load_n(&g_log_async, __ATOMIC_ACQUIRE) ? drain_logs() : 0;
+    pthread_mutex_unlock(&g_log_lock);
+
+    if (!count)
+      usleep(LOG_IDLE_US);
+  }
+
+  return NULL;
+}
+
+/*
+ * From here on, warn() & info() only format the message (into the calling
+ * thread's ring) and a logger thread writes it out. Threads don't survive
+ * fork(), so call it from the process that'll log.
+ */
+void log_async_start(void)
+{
+  pthread_t tid;
+
+  g_log_pid = getpid();
+
+  pthread_create(&tid, NULL, &run_logger, NULL);
+  set_thread_name(tid, "logger");
+
+  __atomic_store_n(&g_log_async, 1, __ATOMIC_RELEASE);
+}
+
+/* log lines dropped because a ring was full, in total */
+long log_drops(void)
 {
-  char buf[1024];
-  time_t t = time(NULL);
-  struct tm *p = localtime(&t);
+  return __atomic_load_n(&g_log_drops, __ATOMIC_RELAXED);
+}
 
-  strftime(buf, 1024, "%B %d %Y %H:%M:%S", p);
+static void do_log(const char *level, const char *msgfmt, va_list ap)
+{
+  if (__atomic_load_n(&g_log_async, __ATOMIC_ACQUIRE)) {
+    log_async(level, msgfmt, ap);
+    return;
+  }
 
-  printf("[%s][PID %d][%s] ", level, getpid(), buf);
+  pthread_mutex_lock(&g_log_lock);
+  printf("[%s][PID %d][%s] ", level, getpid(), format_time(time(NULL)));
   vprintf(msgfmt, ap);
   printf("\n");
+  pthread_mutex_unlock(&g_log_lock);
 }
 
 void set_thread_name(pthread_t thread, const char *name)
@@ -112,8 +305,122 @@ void set_thread_name(pthread_t thread, const char *name)
 #endif
 }
 
+/* monotonic clock, for measuring intervals */
+uint64_t now_nsecs(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* CPU time consumed by the calling thread */
+uint64_t thread_cpu_nsecs(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 void run_test(const char *test_desc, void (*test_func) (void))
 {
   info("Running %s", test_desc);
   test_func();
 }
+
+/*
+ * One line per benchmark case, always in this format so runs can be diffed:
+ *   <suite> <key=value ...> ops=<n> ns_per_op=<x> ops_per_sec=<y>
+ */
+void bench_report(const char *suite, const char *params, long ops, uint64_t nsecs)
+{
+  printf("%s %s ops=%ld ns_per_op=%.1f ops_per_sec=%.0f\n",
+         suite,
+         params,
+         ops,
+         ops ? (double)nsecs / ops : 0.0,
+         nsecs ? ops / ((double)nsecs / 1e9) : 0.0);
+  fflush(stdout);
+}
+
+#ifdef RUN_TESTS
+
+/* the lines logged from here on end up in path */
+static int redirect_stdout(const char *path)
+{
+  int saved = dup(STDOUT_FILENO);
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+  assert(saved != -1 && fd != -1);
+  fflush(stdout);
+  dup2(fd, STDOUT_FILENO);
+  close(fd);
+  return saved;
+}
+
+static void restore_stdout(int saved)
+{
+  fflush(stdout);
+  dup2(saved, STDOUT_FILENO);
+  close(saved);
+}
+
+/* waits for the logger to write a line that ends with end */
+static int wait_for_line(const char *path, const char *end)
+{
+  char line[4096];
+  FILE *f;
+  int tries, found = 0;
+
+  for (tries=0; tries < 1000 && !found; tries++) {
+    f = fopen(path, "r");
+    assert(f);
+    while (!found && fgets(line, sizeof(line), f))
+      found = strstr(line, end) && line[strlen(line) - 1] == '\n';
+    fclose(f);
+
+    if (!found)
+      usleep(1000);
+  }
+
+  return found;
+}
+
+static void test_long_lines(void)
+{
+  char path[] = "/tmp/util-test-XXXXXX";
+  char msg[2 * LOG_MSG_SIZE];
+  int saved, fd;
+
+  fd = mkstemp(path);
+  assert(fd != -1);
+  close(fd);
+
+  memset(msg, 'x', sizeof(msg) - 1);
+  msg[sizeof(msg) - 1] = '\0';
+
+  saved = redirect_stdout(path);
+  log_async_start();
+
+  /* a few records' worth, & one that doesn't fit in a record at all */
+  info("short line before");
+  info("%.300s end-of-300", msg);
+  info("%s end-of-long", msg);
+  info("short line after");
+
+  assert(wait_for_line(path, "short line after"));
+  restore_stdout(saved);
+
+  assert(wait_for_line(path, "end-of-300"));
+  assert(wait_for_line(path, "end-of-long"));
+  unlink(path);
+}
+
+int main(int argc, char **argv)
+{
+  run_test("log lines longer than 240 chars", &test_long_lines);
+  return 0;
+}
+
+#endif
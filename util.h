@@ -4,6 +4,7 @@
 #define _GNU_SOURCE
 
 #include <pthread.h>
+#include <stdint.h>
 
 
 #define EXIT_BAD_PARAMS       1
@@ -19,8 +20,13 @@ void change_uid(const char *username);
 void error(int rc, const char *msgfmt, ...);
 void warn(const char *msgfmt, ...);
 void info(const char *msgfmt, ...);
+void log_async_start(void);
+long log_drops(void);
 void set_thread_name(pthread_t thread, const char *name);
+uint64_t now_nsecs(void);
+uint64_t thread_cpu_nsecs(void);
 void run_test(const char *test_desc, void (*test_func) (void));
+void bench_report(const char *suite, const char *params, long ops, uint64_t nsecs);
 
 
 #define INIT_LOCK(x) \
@@ -0,0 +1,197 @@
+/*
+ * a hashed timer wheel: timers go in slot (due / tick) % size, so adding
+ * & removing is O(1), and expiring only looks at the slots the clock went
+ * past. Timers further out than a full turn just sit in their slot for a
+ * few more turns.
+ *
+ * Not thread-safe, it's meant to be owned by a single thread.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+
+#include "wheel.h"
+#include "util.h"
+
+
+wheel_t wheel_new(int size, uint64_t tick, uint64_t now)
+{
+  wheel_t w = safe_alloc(sizeof(wheel));
+
+  assert(size > 0 && (size & (size - 1)) == 0);
+  assert(tick > 0);
+
+  w->slots = safe_alloc(sizeof(wheel_timer *) * size);
+  w->size = size;
+  w->tick = tick;
+  w->current = now / tick;
+  return w;
+}
+
+void wheel_destroy(wheel_t w)
+{
+  assert(w);
+  assert(w->slots);
+  free(w->slots);
+  free(w);
+}
+
+/* anything already due goes in the next slot to expire */
+void wheel_add(wheel_t w, wheel_timer *t, uint64_t due)
+{
+  uint64_t tick = due / w->tick;
+  wheel_timer **slot;
+
+  assert(!t->armed);
+
+  if (tick < w->current)
+    tick = w->current;
+
+  t->slot = tick & (w->size - 1);
+  slot = &w->slots[t->slot];
+  t->due = due;
+  t->prev = NULL;
+  t->next = *slot;
+  if (*slot)
+    (*slot)->prev = t;
+  *slot = t;
+  t->armed = 1;
+  w->count++;
+}
+
+static void unlink_timer(wheel_t w, wheel_timer *t, wheel_timer **slot)
+{
+  if (t->prev)
+    t->prev->next = t->next;
+  else
+    *slot = t->next;
+  if (t->next)
+    t->next->prev = t->prev;
+
+  t->prev = t->next = NULL;
+  t->armed = 0;
+  w->count--;
+}
+
+void wheel_remove(wheel_t w, wheel_timer *t)
+{
+  assert(t->armed);
+  unlink_timer(w, t, &w->slots[t->slot]);
+}
+
+/*
+ * Takes out every timer due by now and returns them as a list, linked
+ * through next. They're no longer armed, so they can be added again.
+ */
+wheel_timer * wheel_expire(wheel_t w, uint64_t now)
+{
+  uint64_t last = now / w->tick, tick;
+  wheel_timer *expired = NULL, *t, *next, **slot;
+
+  /* past a full turn, every slot gets looked at anyway */
+  if (last >= w->current + w->size)
+    w->current = last - w->size + 1;
+
+  for (tick = w->current; tick <= last; tick++) {
+    slot = &w->slots[tick & (w->size - 1)];
+
+    /* the rest are due in a later turn (or later in this tick) */
+    for (t = *slot; t; t = next) {
+      next = t->next;
+      if (t->due > now)
+        continue;
+
+      unlink_timer(w, t, slot);
+      t->next = expired;
+      expired = t;
+    }
+  }
+
+  /* the last tick isn't over, more of it might be due on the next call */
+  if (last > w->current)
+    w->current = last;
+
+  return expired;
+}
+
+int wheel_count(wheel_t w)
+{
+  return w->count;
+}
+
+
+#ifdef RUN_TESTS
+
+#define TICK   1000
+
+static void test_expire(void)
+{
+  wheel_timer timers[4] = {};
+  wheel_timer *t;
+  wheel_t w = wheel_new(8, TICK, 0);
+  int count;
+
+  wheel_add(w, &timers[0], 3 * TICK);
+  wheel_add(w, &timers[1], 5 * TICK + 10);
+  /* a full turn (and then some) later, same slot as timers[0] */
+  wheel_add(w, &timers[2], 11 * TICK);
+  wheel_add(w, &timers[3], 0);
+  info("wheel has %d timers", wheel_count(w));
+  assert(wheel_count(w) == 4);
+
+  t = wheel_expire(w, 0);
+  assert(t == &timers[3] && !t->next && !t->armed);
+
+  assert(wheel_expire(w, 2 * TICK) == NULL);
+
+  t = wheel_expire(w, 3 * TICK);
+  assert(t == &timers[0] && !t->next);
+
+  /* same tick, but not quite there yet */
+  assert(wheel_expire(w, 5 * TICK) == NULL);
+  assert(wheel_expire(w, 5 * TICK + 10) == &timers[1]);
+
+  assert(wheel_count(w) == 1);
+
+  for (t = wheel_expire(w, 100 * TICK), count = 0; t; t = t->next, count++)
+    assert(t == &timers[2]);
+  assert(count == 1);
+  assert(wheel_count(w) == 0);
+
+  wheel_destroy(w);
+}
+
+static void test_remove(void)
+{
+  wheel_timer timers[3] = {};
+  wheel_t w = wheel_new(4, TICK, 10 * TICK);
+
+  wheel_add(w, &timers[0], 12 * TICK);
+  wheel_add(w, &timers[1], 12 * TICK);
+  /* already due */
+  wheel_add(w, &timers[2], 5 * TICK);
+
+  wheel_remove(w, &timers[1]);
+  wheel_remove(w, &timers[2]);
+  assert(!timers[1].armed && !timers[2].armed);
+  assert(wheel_count(w) == 1);
+
+  assert(wheel_expire(w, 11 * TICK) == NULL);
+  assert(wheel_expire(w, 12 * TICK) == &timers[0]);
+
+  /* and back in */
+  wheel_add(w, &timers[1], 13 * TICK);
+  assert(wheel_expire(w, 20 * TICK) == &timers[1]);
+
+  wheel_destroy(w);
+}
+
+int main(int argc, char **argv)
+{
+  run_test("expire", &test_expire);
+  run_test("remove", &test_remove);
+
+  return 0;
+}
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef _WHEEL_H_
+#define _WHEEL_H_
+
+#include <stdint.h>
+
+/* embedded in whatever is being scheduled */
+typedef struct wheel_timer {
+  uint64_t due;
+  struct wheel_timer *prev;
+  struct wheel_timer *next;
+  int slot;
+  int armed;
+} wheel_timer;
+
+typedef struct {
+  wheel_timer **slots;
+  int size;          /* a power of 2 */
+  uint64_t tick;     /* nsecs per slot */
+  uint64_t current;  /* the first tick not expired for good */
+  int count;
+} wheel;
+
+typedef wheel * wheel_t;
+
+wheel_t wheel_new(int size, uint64_t tick, uint64_t now);
+void wheel_destroy(wheel_t w);
+void wheel_add(wheel_t w, wheel_timer *t, uint64_t due);
+void wheel_remove(wheel_t w, wheel_timer *t);
+wheel_timer * wheel_expire(wheel_t w, uint64_t now);
+int wheel_count(wheel_t w);
+
+#endif